@@ -60,11 +60,122 @@ extern "C" {
   typedef struct eredis_reader_s eredis_reader_t;
 #endif
   typedef struct redisReply eredis_reply_t;
+  typedef struct eredis_view_s eredis_view_t;
+  typedef struct eredis_scan_s eredis_scan_t;
 
+  /* Pipeline reply callback */
+  typedef void (*eredis_pipe_cb)( eredis_reply_t *reply, void *data );
+
+  /* SCAN iterator callback: key (field, member), value (HSCAN, ZSCAN)
+   * and follow-up replies. Non-zero to stop. */
+  typedef int (*eredis_scan_cb)( eredis_reply_t *key, eredis_reply_t *val,
+                                 eredis_reply_t **follow, void *data );
+
+  /* Pub/sub message callback (event loop): channel and payload */
+  typedef void (*eredis_sub_cb)( const char *channel,
+                                 const char *msg, size_t len, void *data );
+
+#define EREDIS_ERRTIMEOUT -3
 #define EREDIS_ERRCMD   -2
 #define EREDIS_ERR      -1
 #define EREDIS_OK        0
 
+  /* Client-side cache flags */
+#define EREDIS_CACHE_BCAST  0x01
+
+  typedef struct eredis_cache_stats_s {
+    unsigned long long  hits;
+    unsigned long long  misses;
+    unsigned long long  invalidations;
+    unsigned long long  evictions;
+    unsigned long long  flushes;
+    size_t              entries;
+    size_t              mem;
+  } eredis_cache_stats_t;
+
+  /* Host health (eredis_probe), latencies in us */
+  typedef struct eredis_host_health_s {
+    const char          *target;
+    int                 port;
+    int                 connected;
+    int                 degraded;
+    long long           last_us;
+    long long           srtt_us;
+    long long           min_us;
+    long long           max_us;
+    unsigned long long  probes;
+    unsigned long long  timeouts;
+  } eredis_host_health_t;
+
+  /* Reader migration back to the prefered host (eredis_r_migrate) */
+  typedef struct eredis_migrate_stats_s {
+    unsigned long long  migrated;   /* readers moved back */
+    unsigned long long  deferred;   /* releases kept away (rate, probes) */
+    int                 away;       /* readers on another host */
+  } eredis_migrate_stats_t;
+
+  /* Runtime statistics (eredis_stats) */
+  /* Latency histogram buckets: 8 per power of two, 1us to 2^30us */
+#define EREDIS_STATS_HIST       224
+
+  typedef struct eredis_host_stats_s {
+    const char          *target;
+    int                 port;
+    int                 connected;
+    unsigned long long  cmds;           /* sent: writes and readers */
+    unsigned long long  bytes;
+    unsigned long long  replies;        /* readers */
+    unsigned long long  errors;         /* readers: I/O and error replies */
+    unsigned long long  connects;       /* event loop connections */
+    unsigned long long  transitions;    /* connected/lost/failed/degraded */
+    size_t              obuf;           /* event loop output buffer */
+    unsigned long long  latency[ EREDIS_STATS_HIST ]; /* readers, us */
+  } eredis_host_stats_t;
+
+  typedef struct eredis_stats_s {
+    int                 wqueue;         /* writes waiting */
+    int                 readers;        /* reader pool */
+    int                 readers_busy;
+    int                 threads;        /* threads with counters */
+    unsigned long long  reader_waits;   /* waits for a free reader */
+    unsigned long long  reader_wait_us;
+    unsigned long long  lock_waits;     /* contended reader pool lock */
+    unsigned long long  lock_wait_us;
+    long long           loop_lag_us;    /* event loop lag, last */
+    long long           loop_lag_max_us;
+  } eredis_stats_t;
+
+  /* Statistics exporter (eredis_export) */
+#define EREDIS_EXPORT_PROMETHEUS  0
+#define EREDIS_EXPORT_STATSD      1
+
+  typedef void (*eredis_export_cb)( const char *buf, size_t len, void *data );
+
+  /* Slow command log entry (eredis_slowlog) */
+#define EREDIS_SLOWLOG_CMD      64
+
+  typedef struct eredis_slowlog_entry_s {
+    long long           ts_us;          /* wall clock */
+    int                 host;           /* host index */
+    long long           latency_us;
+    size_t              reply_size;     /* string length or elements */
+    int                 cmd_len;        /* formatted command */
+    int                 write;          /* mirrored write */
+    char                cmd[ EREDIS_SLOWLOG_CMD ]; /* truncated */
+  } eredis_slowlog_entry_t;
+
+  /* Hot and big keys (eredis_hotkeys) */
+#define EREDIS_HOTKEYS_COUNT    0
+#define EREDIS_HOTKEYS_BYTES    1
+#define EREDIS_HOTKEY_LEN       64
+
+  typedef struct eredis_hotkey_s {
+    char                key[ EREDIS_HOTKEY_LEN ]; /* truncated */
+    int                 key_len;
+    unsigned long long  count;          /* requests, estimate */
+    unsigned long long  bytes;          /* bytes, estimate */
+  } eredis_hotkey_t;
+
   /* New */
   eredis_t * eredis_new( void );
   /* Free */
@@ -78,10 +189,55 @@ extern "C" {
 
   /* Set timeout */
   void eredis_timeout( eredis_t *e, int timeout_ms );
+  /* Set active health checks (PING probes) */
+  void eredis_probe( eredis_t *e, int interval_ms, int timeout_ms );
+  /* Host health and latency, by index */
+  int eredis_host_health( eredis_t *e, int i, eredis_host_health_t *health );
+  /* Set reconnect backoff */
+  void eredis_reconnect( eredis_t *e, int min_ms, int max_ms );
+  /* Set reader connect timeout */
+  void eredis_connect_timeout( eredis_t *e, int timeout_ms );
   /* Set max readers */
   void eredis_r_max( eredis_t *e, int max );
   /* Set retry for reader */
   void eredis_r_retry( eredis_t *e, int retry );
+  /* Interrupt readers of a lost host */
+  void eredis_r_interrupt( eredis_t *e, int on );
+  /* Set reader migration back to the prefered host */
+  void eredis_r_migrate( eredis_t *e, int per_sec, int stable_probes );
+  /* Reader migration counters */
+  void eredis_r_migrate_stats( eredis_t *e, eredis_migrate_stats_t *st );
+
+  /* Runtime statistics, returns the number of hosts */
+  int eredis_stats( eredis_t *e, eredis_stats_t *st,
+                    eredis_host_stats_t *hosts, int hosts_nb );
+  /* Latency histogram: bucket lowest value (us) */
+  long long eredis_stats_hist_value( int i );
+  /* Latency histogram: percentile value (us) */
+  long long eredis_stats_percentile( const unsigned long long *hist,
+                                     double p );
+  /* Export statistics to a Prometheus textfile (event loop) */
+  int eredis_export_file( eredis_t *e, const char *path, int interval_ms );
+  /* Export statistics to a callback (event loop) */
+  void eredis_export( eredis_t *e, int format, eredis_export_cb cb,
+                      void *data, int interval_ms );
+
+  /* Slow command log: threshold and ring size */
+  int eredis_slowlog( eredis_t *e, long long threshold_us, int entries );
+  /* Slow command log entries, newest first */
+  int eredis_slowlog_get( eredis_t *e, eredis_slowlog_entry_t *out, int nb );
+  /* Slow command log dump */
+  void eredis_slowlog_dump( eredis_t *e, FILE *f );
+  /* Slow command log dump on a signal (event loop) */
+  int eredis_slowlog_signal( eredis_t *e, int signum, const char *path );
+  /* Hot and big keys sampling: 1 in 'rate' commands, 'k' keys kept */
+  int eredis_hotkeys( eredis_t *e, int rate, int k );
+  /* Hot (EREDIS_HOTKEYS_COUNT) or big (_BYTES) keys, heaviest first */
+  int eredis_hotkeys_get( eredis_t *e, int by, eredis_hotkey_t *out, int nb );
+  /* Set reader reply arena chunk size (0: off) */
+  void eredis_r_arena( eredis_t *e, size_t chunk );
+  /* Set multiplexed readers (on the event loop connections) */
+  void eredis_mux( eredis_t *e, int on );
 
   /* Set connect command */
   int eredis_pc_cmd( eredis_t *e, const char *fmt, ... );
@@ -102,14 +258,40 @@ extern "C" {
   /* Reader */
   eredis_reader_t * eredis_r( eredis_t *e );
   void eredis_r_release( eredis_reader_t *reader );
+  /* Deadlines (pool wait, connect, send, receive) - EREDIS_ERRTIMEOUT */
+  long long eredis_deadline( int timeout_ms );
+  eredis_reader_t * eredis_r_timed( eredis_t *e, long long deadline );
+  void eredis_r_deadline( eredis_reader_t *reader, long long deadline );
+  /* Error of the last failed reply: EREDIS_ERR, EREDIS_ERRTIMEOUT */
+  int eredis_r_error( eredis_reader_t *reader );
   /* force all append and cmd to clear (without releasing the reader) */
   void eredis_r_clear( eredis_reader_t *reader );
   /* Get another reply (pipelining) */
   eredis_reply_t * eredis_r_reply( eredis_reader_t *reader );
 
+  /* Windowed pipeline: unbounded batches, bounded memory */
+  void eredis_r_pipe( eredis_reader_t *reader, int window,
+                      eredis_pipe_cb cb, void *data );
+  int eredis_r_pipe_vcmd( eredis_reader_t *reader,
+                          const char *format, va_list ap );
+  int eredis_r_pipe_cmd( eredis_reader_t *reader, const char *format, ... );
+  int eredis_r_pipe_cmdargv( eredis_reader_t *reader, int argc,
+                             const char **argv, const size_t *argvlen );
+  int eredis_r_pipe_end( eredis_reader_t *reader );
+
   /* Get subscribe reply */
   eredis_reply_t * eredis_r_subscribe( eredis_reader_t *reader );
 
+  /* Pub/sub dispatcher (event loop, shared connection) */
+  int eredis_sub( eredis_t *e, const char *channel,
+                  eredis_sub_cb cb, void *data );
+  int eredis_psub( eredis_t *e, const char *pattern,
+                   eredis_sub_cb cb, void *data );
+  int eredis_unsub( eredis_t *e, const char *channel );
+  int eredis_punsub( eredis_t *e, const char *pattern );
+  /* Subscribe on all the mirrors, delivered once (window in ms) */
+  void eredis_sub_mirrors( eredis_t *e, int window_ms );
+
   int eredis_r_append_fcmd(
     eredis_reader_t *reader, const char *cmd, size_t len );
   int eredis_r_append_vcmd(
@@ -131,6 +313,40 @@ extern "C" {
     eredis_r_cmdargv( eredis_reader_t *reader,
                       int argc, const char **argv, const size_t *argvlen );
 
+  /* Zero-copy reply view - valid until next command/reply or release */
+  const eredis_view_t * eredis_r_view( eredis_reader_t *reader );
+  int eredis_view_type( const eredis_view_t *v );
+  size_t eredis_view_len( const eredis_view_t *v );
+  const char * eredis_view_ptr( const eredis_view_t *v );
+  long long eredis_view_integer( const eredis_view_t *v );
+  const eredis_view_t * eredis_view_element( const eredis_view_t *v, size_t i );
+  /* Full tree from a view - will need to be free manually */
+  eredis_reply_t * eredis_view_reply( const eredis_view_t *v );
+
+  /* Streamed array reply - elements by chunks, end is mandatory */
+  const eredis_view_t * eredis_r_stream_begin( eredis_reader_t *reader );
+  int eredis_r_stream_next( eredis_reader_t *reader,
+                            const eredis_view_t **elems, size_t max );
+  void eredis_r_stream_end( eredis_reader_t *reader );
+
+  /* SCAN iterator with pipelined follow-up commands */
+  eredis_scan_t * eredis_scan_new( eredis_t *e,
+                                   const char *cmd, const char *key );
+  int eredis_scan_match( eredis_scan_t *s, const char *pattern );
+  void eredis_scan_count( eredis_scan_t *s, int count );
+  void eredis_scan_mirrors( eredis_scan_t *s, int on );
+  int eredis_scan_follow( eredis_scan_t *s, const char *cmd );
+  long long eredis_scan_run( eredis_scan_t *s, int threads,
+                             eredis_scan_cb cb, void *data );
+  void eredis_scan_free( eredis_scan_t *s );
+
+  /* Client-side cache (Redis >= 6, CLIENT TRACKING) */
+  int eredis_cache( eredis_t *e, size_t max_mem, int flags );
+  int eredis_cache_cmd( eredis_t *e, const char *name );
+  int eredis_cache_prefix( eredis_t *e, const char *prefix );
+  void eredis_cache_flush( eredis_t *e );
+  void eredis_cache_stats( eredis_t *e, eredis_cache_stats_t *stats );
+
   /* Utils */
   void eredis_reply_dump( eredis_reply_t *reply );
   void eredis_reply_free( eredis_reply_t *reply );
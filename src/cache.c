@@ -0,0 +1,927 @@
+/*
+ * Copyright (c) 2016 by Eulerian Technologies SAS
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials
+ *   provided with the distribution.
+ *
+ * * Neither the name of Eulerian Technologies nor the names of its
+ *   contributors may be used to endorse or promote products
+ *   derived from this software without specific prior written
+ *   permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/**
+ * @file cache.c
+ * @brief ERedis client-side cache (sharded LRU, CLIENT TRACKING)
+ *
+ * Replies of whitelisted read commands are kept in a local cache.
+ * Coherency relies on Redis >= 6 'CLIENT TRACKING' in redirect mode:
+ * each host gets a dedicated invalidation connection (event loop)
+ * subscribed to '__redis__:invalidate', and readers enable tracking
+ * with 'REDIRECT <id>' of this connection.
+ *
+ * An entry is only stored if nothing was invalidated in its shard
+ * while the command was in flight, and the whole cache is flushed
+ * when an invalidation connection is lost.
+ */
+
+#define CACHE_INVAL_CHANNEL     "__redis__:invalidate"
+
+/* Shards - DEFAULT */
+#define DEFAULT_CACHE_SHARDS    16
+
+/* Initial buckets per shard (power of 2) */
+#define CACHE_BUCKETS_MIN       64
+
+/* Flat reply alignment */
+#define CACHE_ALIGN(l)          (((l) + 7) & ~((size_t)7))
+
+/*
+ * One cached reply, for one command of one key
+ */
+typedef struct cache_ent_s {
+  struct cache_ent_s  *next, *prev;   /* shard LRU */
+  struct cache_ent_s  *knext;         /* same key */
+  struct cache_key_s  *key;
+  size_t              mem;
+  int                 cmd_l;
+  char                *cmd;
+  redisReply          *reply;         /* flat copy */
+} cache_ent_t;
+
+/*
+ * One redis key (invalidation unit)
+ */
+typedef struct cache_key_s {
+  struct cache_key_s  *next;          /* bucket chain */
+  cache_ent_t         *ents;
+  uint64_t            hash;
+  size_t              l;
+  char                s[];
+} cache_key_t;
+
+typedef struct cache_shard_s {
+  pthread_mutex_t     lock;
+  cache_key_t         **buckets;
+  size_t              buckets_nb;
+  size_t              keys_nb;
+  cache_ent_t         *lru;           /* most recent first */
+  size_t              entries;
+  size_t              mem;
+  size_t              mem_max;
+  unsigned int        seq;            /* bumped on any invalidation */
+
+  unsigned long long  hits;
+  unsigned long long  misses;
+  unsigned long long  invalidations;
+  unsigned long long  evictions;
+} cache_shard_t;
+
+typedef struct eredis_cache_s {
+  cache_shard_t       *shards;
+  int                 shards_nb;
+  int                 flags;
+
+  char                **cmds;         /* whitelisted commands */
+  int                 cmds_nb;
+  char                **prefixes;     /* BCAST prefixes */
+  int                 prefixes_nb;
+
+  unsigned long long  flushes;
+} eredis_cache_t;
+
+/*
+ * FNV-1a
+ */
+  static inline uint64_t
+_eredis_hash( const char *s, size_t l )
+{
+  uint64_t h = 0xcbf29ce484222325ULL;
+
+  while (l--) {
+    h ^= (unsigned char) *s++;
+    h *= 0x100000001b3ULL;
+  }
+
+  return h;
+}
+
+/*
+ * Locate argument 'idx' in a RESP formatted command.
+ * Return the argument count, -1 if not found.
+ */
+  static int
+_eredis_cmd_arg( const char *cmd, size_t len,
+                 int idx, const char **parg, size_t *plen )
+{
+  const char *p = cmd, *end = cmd + len;
+  size_t l;
+  int n, argc;
+
+  if (len < 4 || *p != '*')
+    return -1;
+
+  for (argc = 0, p++; p < end && isdigit(*p); p++)
+    argc = argc * 10 + (*p - '0');
+  p += 2;
+
+  for (n = 0; n < argc && p < end; n++) {
+    if (*p != '$')
+      return -1;
+    for (l = 0, p++; p < end && isdigit(*p); p++)
+      l = l * 10 + (*p - '0');
+    p += 2;
+
+    if (p + l + 2 > end)
+      return -1;
+
+    if (n == idx) {
+      *parg = p;
+      *plen = l;
+      return argc;
+    }
+
+    p += l + 2;
+  }
+
+  return -1;
+}
+
+/*
+ * Deep copy of a reply (freeReplyObject compliant)
+ */
+  static redisReply *
+_eredis_reply_dup( const redisReply *reply )
+{
+  size_t i;
+  redisReply *d;
+
+  d = calloc( 1, sizeof(redisReply) );
+  if (! d)
+    return NULL;
+
+  d->type     = reply->type;
+  d->integer  = reply->integer;
+  d->len      = reply->len;
+
+  switch (reply->type) {
+    case REDIS_REPLY_STRING:
+    case REDIS_REPLY_STATUS:
+    case REDIS_REPLY_ERROR:
+      d->str = malloc( reply->len + 1 );
+      if (! d->str)
+        goto err;
+      memcpy( d->str, reply->str, reply->len );
+      d->str[ reply->len ] = '\0';
+      break;
+
+    case REDIS_REPLY_ARRAY:
+      if (! reply->elements)
+        break;
+      d->element = calloc( reply->elements, sizeof(redisReply*) );
+      if (! d->element)
+        goto err;
+      d->elements = reply->elements;
+      for (i=0; i<reply->elements; i++) {
+        d->element[i] = _eredis_reply_dup( reply->element[i] );
+        if (! d->element[i])
+          goto err;
+      }
+      break;
+  }
+
+  return d;
+
+err:
+  freeReplyObject( d );
+  return NULL;
+}
+
+/*
+ * Flat copy of a reply (one allocation)
+ */
+  static size_t
+_eredis_reply_flat_size( const redisReply *reply )
+{
+  size_t i, l = sizeof(redisReply);
+
+  switch (reply->type) {
+    case REDIS_REPLY_STRING:
+    case REDIS_REPLY_STATUS:
+    case REDIS_REPLY_ERROR:
+      l += CACHE_ALIGN( reply->len + 1 );
+      break;
+
+    case REDIS_REPLY_ARRAY:
+      l += CACHE_ALIGN( reply->elements * sizeof(redisReply*) );
+      for (i=0; i<reply->elements; i++)
+        l += _eredis_reply_flat_size( reply->element[i] );
+      break;
+  }
+
+  return l;
+}
+
+  static redisReply *
+_eredis_reply_flat_copy( const redisReply *reply, char **pbuf )
+{
+  size_t i;
+  redisReply *d;
+
+  d = (redisReply*) *pbuf;
+  *pbuf += sizeof(redisReply);
+  *d = *reply;
+
+  switch (reply->type) {
+    case REDIS_REPLY_STRING:
+    case REDIS_REPLY_STATUS:
+    case REDIS_REPLY_ERROR:
+      d->str = *pbuf;
+      memcpy( d->str, reply->str, reply->len );
+      d->str[ reply->len ] = '\0';
+      *pbuf += CACHE_ALIGN( reply->len + 1 );
+      break;
+
+    case REDIS_REPLY_ARRAY:
+      d->element = (redisReply**) *pbuf;
+      *pbuf += CACHE_ALIGN( reply->elements * sizeof(redisReply*) );
+      for (i=0; i<reply->elements; i++)
+        d->element[i] = _eredis_reply_flat_copy( reply->element[i], pbuf );
+      break;
+  }
+
+  return d;
+}
+
+/*
+ * Shard
+ */
+  static inline cache_shard_t *
+_eredis_cache_shard( eredis_cache_t *ec, uint64_t hash )
+{
+  return &ec->shards[ (hash >> 32) % ec->shards_nb ];
+}
+
+  static cache_key_t *
+_eredis_cache_key_get( cache_shard_t *cs,
+                       uint64_t hash, const char *k, size_t kl )
+{
+  cache_key_t *ck;
+
+  for (ck = cs->buckets[ hash & (cs->buckets_nb - 1) ]; ck; ck = ck->next)
+    if (ck->hash == hash && ck->l == kl && ! memcmp( ck->s, k, kl ))
+      return ck;
+
+  return NULL;
+}
+
+  static void
+_eredis_cache_key_rm( cache_shard_t *cs, cache_key_t *ck )
+{
+  cache_key_t **pck;
+
+  pck = &cs->buckets[ ck->hash & (cs->buckets_nb - 1) ];
+  while (*pck != ck)
+    pck = &(*pck)->next;
+  *pck = ck->next;
+
+  cs->keys_nb --;
+  cs->mem -= sizeof(cache_key_t) + ck->l;
+  free( ck );
+}
+
+  static void
+_eredis_cache_grow( cache_shard_t *cs )
+{
+  size_t i, nb = cs->buckets_nb * 2;
+  cache_key_t **buckets, *ck, *next;
+
+  buckets = calloc( nb, sizeof(cache_key_t*) );
+  if (! buckets)
+    return;
+
+  for (i=0; i<cs->buckets_nb; i++) {
+    for (ck = cs->buckets[i]; ck; ck = next) {
+      next = ck->next;
+      ck->next = buckets[ ck->hash & (nb - 1) ];
+      buckets[ ck->hash & (nb - 1) ] = ck;
+    }
+  }
+
+  free( cs->buckets );
+  cs->buckets     = buckets;
+  cs->buckets_nb  = nb;
+}
+
+/*
+ * Entry LRU (same double linked list as the queues)
+ */
+  static inline void
+_eredis_cache_lru_rm( cache_shard_t *cs, cache_ent_t *ce )
+{
+  if (cs->lru == ce)
+    cs->lru = (ce->next == ce) ? NULL : ce->next;
+
+  ce->next->prev = ce->prev;
+  ce->prev->next = ce->next;
+  ce->next = ce->prev = ce;
+}
+
+  static inline void
+_eredis_cache_lru_unshift( cache_shard_t *cs, cache_ent_t *ce )
+{
+  if (cs->lru) {
+    ce->next   = cs->lru;
+    ce->prev   = ce->next->prev;
+    ce->next->prev = ce->prev->next = ce;
+  }
+  cs->lru = ce;
+}
+
+/*
+ * Drop one entry, and its key when it was the last one
+ */
+  static void
+_eredis_cache_ent_rm( cache_shard_t *cs, cache_ent_t *ce )
+{
+  cache_key_t *ck = ce->key;
+  cache_ent_t **pce;
+
+  _eredis_cache_lru_rm( cs, ce );
+
+  pce = &ck->ents;
+  while (*pce != ce)
+    pce = &(*pce)->knext;
+  *pce = ce->knext;
+
+  if (! ck->ents)
+    _eredis_cache_key_rm( cs, ck );
+
+  cs->entries --;
+  cs->mem -= ce->mem;
+  free( ce );
+}
+
+/*
+ * Lookup - return a copy of the cached reply, or NULL and the
+ * shard sequence to give back to _eredis_cache_set.
+ */
+  static redisReply *
+_eredis_cache_get( eredis_cache_t *ec,
+                   uint64_t hash, const char *k, size_t kl,
+                   const char *cmd, int cmd_l,
+                   unsigned int *pseq )
+{
+  cache_shard_t *cs = _eredis_cache_shard( ec, hash );
+  cache_key_t *ck;
+  cache_ent_t *ce = NULL;
+  redisReply *reply = NULL;
+
+  pthread_mutex_lock( &cs->lock );
+
+  if ((ck = _eredis_cache_key_get( cs, hash, k, kl ))) {
+    for (ce = ck->ents; ce; ce = ce->knext)
+      if (ce->cmd_l == cmd_l && ! memcmp( ce->cmd, cmd, cmd_l ))
+        break;
+  }
+
+  if (ce) {
+    cs->hits ++;
+    if (cs->lru != ce) {
+      _eredis_cache_lru_rm( cs, ce );
+      _eredis_cache_lru_unshift( cs, ce );
+    }
+    reply = _eredis_reply_dup( ce->reply );
+  }
+  else
+    cs->misses ++;
+
+  *pseq = cs->seq;
+
+  pthread_mutex_unlock( &cs->lock );
+
+  return reply;
+}
+
+/*
+ * Store a reply, if its shard was not invalidated since 'seq'
+ */
+  static void
+_eredis_cache_set( eredis_cache_t *ec,
+                   uint64_t hash, const char *k, size_t kl,
+                   const char *cmd, int cmd_l,
+                   const redisReply *reply, unsigned int seq )
+{
+  cache_shard_t *cs = _eredis_cache_shard( ec, hash );
+  cache_key_t *ck;
+  cache_ent_t *ce;
+  size_t mem;
+  char *buf;
+
+  mem = CACHE_ALIGN( sizeof(cache_ent_t) + cmd_l )
+    + _eredis_reply_flat_size( reply );
+
+  if (mem + sizeof(cache_key_t) + kl > cs->mem_max)
+    return;
+
+  ce = malloc( mem );
+  if (! ce)
+    return;
+
+  ce->next = ce->prev = ce;
+  ce->mem   = mem;
+  ce->cmd_l = cmd_l;
+  ce->cmd   = (char*) (ce + 1);
+  memcpy( ce->cmd, cmd, cmd_l );
+  buf = (char*) ce + CACHE_ALIGN( sizeof(cache_ent_t) + cmd_l );
+  ce->reply = _eredis_reply_flat_copy( reply, &buf );
+
+  pthread_mutex_lock( &cs->lock );
+
+  if (cs->seq != seq)
+    /* Invalidated while in flight */
+    goto drop;
+
+  if (! (ck = _eredis_cache_key_get( cs, hash, k, kl ))) {
+    ck = malloc( sizeof(cache_key_t) + kl );
+    if (! ck)
+      goto drop;
+    ck->ents  = NULL;
+    ck->hash  = hash;
+    ck->l     = kl;
+    memcpy( ck->s, k, kl );
+
+    if (cs->keys_nb >= cs->buckets_nb)
+      _eredis_cache_grow( cs );
+
+    ck->next = cs->buckets[ hash & (cs->buckets_nb - 1) ];
+    cs->buckets[ hash & (cs->buckets_nb - 1) ] = ck;
+    cs->keys_nb ++;
+    cs->mem += sizeof(cache_key_t) + kl;
+  }
+  else {
+    cache_ent_t *o;
+    for (o = ck->ents; o; o = o->knext)
+      if (o->cmd_l == cmd_l && ! memcmp( o->cmd, cmd, cmd_l ))
+        /* Raced by another reader */
+        goto drop;
+  }
+
+  ce->key   = ck;
+  ce->knext = ck->ents;
+  ck->ents  = ce;
+  _eredis_cache_lru_unshift( cs, ce );
+  cs->entries ++;
+  cs->mem += mem;
+
+  /* Evict least recently used */
+  while (cs->mem > cs->mem_max && cs->lru->prev != ce) {
+    _eredis_cache_ent_rm( cs, cs->lru->prev );
+    cs->evictions ++;
+  }
+
+  pthread_mutex_unlock( &cs->lock );
+  return;
+
+drop:
+  pthread_mutex_unlock( &cs->lock );
+  free( ce );
+}
+
+/*
+ * Invalidate all entries of a key
+ */
+  static void
+_eredis_cache_invalidate( eredis_cache_t *ec, const char *k, size_t kl )
+{
+  uint64_t hash = _eredis_hash( k, kl );
+  cache_shard_t *cs = _eredis_cache_shard( ec, hash );
+  cache_key_t *ck;
+
+  pthread_mutex_lock( &cs->lock );
+
+  cs->seq ++;
+  cs->invalidations ++;
+
+  if ((ck = _eredis_cache_key_get( cs, hash, k, kl ))) {
+    while (ck->ents->knext)
+      _eredis_cache_ent_rm( cs, ck->ents );
+    /* last one drops the key */
+    _eredis_cache_ent_rm( cs, ck->ents );
+  }
+
+  pthread_mutex_unlock( &cs->lock );
+}
+
+  static void
+_eredis_cache_flush( eredis_cache_t *ec )
+{
+  int i;
+
+  for (i=0; i<ec->shards_nb; i++) {
+    cache_shard_t *cs = &ec->shards[i];
+
+    pthread_mutex_lock( &cs->lock );
+
+    cs->seq ++;
+    while (cs->lru)
+      _eredis_cache_ent_rm( cs, cs->lru );
+
+    pthread_mutex_unlock( &cs->lock );
+  }
+
+  __sync_fetch_and_add( &ec->flushes, 1 );
+}
+
+/*
+ * Is this command cacheable? Return the key.
+ */
+  static int
+_eredis_cache_cmd_key( eredis_cache_t *ec, const char *cmd, size_t len,
+                       const char **pk, size_t *pkl )
+{
+  int i;
+  const char *name;
+  size_t name_l;
+
+  if (_eredis_cmd_arg( cmd, len, 0, &name, &name_l ) < 2)
+    return 0;
+
+  for (i=0; i<ec->cmds_nb; i++) {
+    if (strlen( ec->cmds[i] ) == name_l
+        &&
+        ! strncasecmp( ec->cmds[i], name, name_l ))
+      return (_eredis_cmd_arg( cmd, len, 1, pk, pkl ) > 0);
+  }
+
+  return 0;
+}
+
+/*
+ * Invalidation connection callbacks (event loop)
+ */
+  static void
+_eredis_cache_inval_lost( host_t *h )
+{
+  h->inval_ctx      = NULL;
+  h->inval_id_next  = 0;
+
+  if (h->inval_id) {
+    _P_WARN("cache: invalidation channel lost: %s", h->target);
+    /* Invalidations may be lost, drop everything */
+    h->inval_id = 0;
+    h->inval_gen ++;
+    _eredis_cache_flush( h->e->cache );
+  }
+}
+
+  static void
+_eredis_cache_inval_connect_cb( const redisAsyncContext *c, int status )
+{
+  if (status != REDIS_OK)
+    _eredis_cache_inval_lost( (host_t*) c->data );
+}
+
+  static void
+_eredis_cache_inval_disconnect_cb( const redisAsyncContext *c, int status )
+{
+  (void) status;
+  _eredis_cache_inval_lost( (host_t*) c->data );
+}
+
+  static void
+_eredis_cache_inval_id_cb( redisAsyncContext *c, void *vreply, void *privdata )
+{
+  host_t *h = (host_t*) c->data;
+  redisReply *reply = vreply;
+
+  (void) privdata;
+
+  if (reply && reply->type == REDIS_REPLY_INTEGER)
+    h->inval_id_next = reply->integer;
+  else if (reply)
+    _P_WARN("cache: CLIENT ID failed on %s", h->target);
+}
+
+  static void
+_eredis_cache_inval_msg_cb( redisAsyncContext *c, void *vreply, void *privdata )
+{
+  size_t i;
+  host_t *h = (host_t*) c->data;
+  eredis_cache_t *ec = h->e->cache;
+  redisReply *reply = vreply, *keys;
+
+  (void) privdata;
+
+  if (! reply
+      ||
+      reply->type != REDIS_REPLY_ARRAY
+      ||
+      reply->elements < 3
+      ||
+      reply->element[0]->type != REDIS_REPLY_STRING)
+    return;
+
+  if (! strcmp( reply->element[0]->str, "subscribe" )) {
+    /* Ready - readers can redirect to us */
+    if (h->inval_id_next) {
+      _P_LOG("cache: invalidation channel ready: %s", h->target);
+      h->inval_id = h->inval_id_next;
+      h->inval_gen ++;
+    }
+    return;
+  }
+
+  if (strcmp( reply->element[0]->str, "message" ))
+    return;
+
+  keys = reply->element[2];
+  switch (keys->type) {
+    case REDIS_REPLY_ARRAY:
+      for (i=0; i<keys->elements; i++)
+        if (keys->element[i]->type == REDIS_REPLY_STRING)
+          _eredis_cache_invalidate( ec,
+                                    keys->element[i]->str,
+                                    keys->element[i]->len );
+      break;
+
+    case REDIS_REPLY_STRING:
+      _eredis_cache_invalidate( ec, keys->str, keys->len );
+      break;
+
+    case REDIS_REPLY_NIL:
+      /* FLUSHDB/FLUSHALL */
+      _eredis_cache_flush( ec );
+      break;
+  }
+}
+
+/*
+ * Connect the invalidation connection of a host (event loop)
+ */
+  static void
+_eredis_cache_inval_connect( host_t *h )
+{
+  int i;
+  eredis_t *e = h->e;
+  redisAsyncContext *ac;
+
+  ac = (h->port) ?
+    redisAsyncConnect( h->target, h->port )
+    :
+    redisAsyncConnectUnix( h->target );
+
+  if (! ac) {
+    _P_ERR( "cache: connect async %s undef", h->target);
+    return;
+  }
+  if (ac->err) {
+    _P_LOG( "cache: connect async failed %s err:%d", h->target, ac->err);
+    redisAsyncFree( ac );
+    return;
+  }
+
+#ifdef HOST_TCP_KEEPALIVE
+  if (h->port)
+    redisEnableKeepAlive( &ac->c );
+#endif
+
+  h->inval_ctx      = ac;
+  h->inval_id_next  = 0;
+  ac->data          = h;
+
+  redisLibevAttach( e->loop, ac );
+
+  redisAsyncSetDisconnectCallback( ac, _eredis_cache_inval_disconnect_cb );
+  redisAsyncSetConnectCallback( ac, _eredis_cache_inval_connect_cb );
+
+  /* Post-connect commands first (AUTH, SELECT...) */
+  for (i=0; i<e->cmds_connect_nb; i++)
+    __redisAsyncCommand( ac, NULL, NULL,
+                         e->cmds_connect[i].s, e->cmds_connect[i].l );
+
+  redisAsyncCommand( ac, _eredis_cache_inval_id_cb, NULL, "CLIENT ID" );
+  redisAsyncCommand( ac, _eredis_cache_inval_msg_cb, NULL,
+                     "SUBSCRIBE " CACHE_INVAL_CHANNEL );
+}
+
+  static void
+_eredis_cache_free( eredis_t *e )
+{
+  int i;
+  eredis_cache_t *ec = e->cache;
+
+  _eredis_cache_flush( ec );
+
+  for (i=0; i<ec->shards_nb; i++) {
+    pthread_mutex_destroy( &ec->shards[i].lock );
+    free( ec->shards[i].buckets );
+  }
+  free( ec->shards );
+
+  for (i=0; i<ec->cmds_nb; i++)
+    free( ec->cmds[i] );
+  free( ec->cmds );
+
+  for (i=0; i<ec->prefixes_nb; i++)
+    free( ec->prefixes[i] );
+  free( ec->prefixes );
+
+  free( ec );
+  e->cache = NULL;
+}
+
+/**
+ * @brief Activate the client-side cache
+ *
+ * Must be called after 'new' and before any call to 'run'.
+ * Needs Redis >= 6 (CLIENT TRACKING) and the event loop running
+ * for the invalidation connections. Until a reader has tracking
+ * enabled on its connection, its replies are not cached.
+ *
+ * Only the commands declared via 'eredis_cache_cmd' are cached, when
+ * they are the only pending command of a reader.
+ *
+ * @param e       eredis
+ * @param max_mem memory limit of the cache in bytes
+ * @param flags   EREDIS_CACHE_BCAST for broadcast tracking mode
+ *
+ * @return EREDIS_OK or EREDIS_ERR
+ */
+  int
+eredis_cache( eredis_t *e, size_t max_mem, int flags )
+{
+  int i;
+  eredis_cache_t *ec;
+
+  if (e->cache || IS_INRUN(e))
+    return EREDIS_ERR;
+
+  ec = calloc( 1, sizeof(eredis_cache_t) );
+  if (! ec) {
+    _P_ERR("eredis_cache: failed to allocate");
+    return EREDIS_ERR;
+  }
+
+  ec->flags     = flags;
+  ec->shards_nb = DEFAULT_CACHE_SHARDS;
+  ec->shards    = calloc( ec->shards_nb, sizeof(cache_shard_t) );
+  if (! ec->shards)
+    goto err;
+
+  for (i=0; i<ec->shards_nb; i++) {
+    cache_shard_t *cs = &ec->shards[i];
+
+    cs->buckets_nb  = CACHE_BUCKETS_MIN;
+    cs->buckets     = calloc( cs->buckets_nb, sizeof(cache_key_t*) );
+    cs->mem_max     = max_mem / ec->shards_nb;
+    if (! cs->buckets) {
+      while (i--)
+        free( ec->shards[i].buckets );
+      goto err;
+    }
+    pthread_mutex_init( &cs->lock, NULL );
+  }
+
+  e->cache = ec;
+  return EREDIS_OK;
+
+err:
+  _P_ERR("eredis_cache: failed to allocate");
+  free( ec->shards );
+  free( ec );
+  return EREDIS_ERR;
+}
+
+/**
+ * @brief Add a cacheable read command (GET, HGET, ...)
+ *
+ * The first argument of the command must be the key.
+ * To set before eredis_run(_thr): readers look the commands up without
+ * lock.
+ *
+ * @param e     eredis
+ * @param name  command name
+ *
+ * @return EREDIS_OK or EREDIS_ERR
+ */
+  int
+eredis_cache_cmd( eredis_t *e, const char *name )
+{
+  char **cmds;
+  eredis_cache_t *ec = e->cache;
+
+  if (! ec || IS_INRUN(e))
+    return EREDIS_ERR;
+
+  cmds = realloc( ec->cmds, sizeof(char*) * (ec->cmds_nb + 1) );
+  if (! cmds)
+    return EREDIS_ERR;
+  ec->cmds = cmds;
+
+  if (! (cmds[ ec->cmds_nb ] = strdup( name )))
+    return EREDIS_ERR;
+  ec->cmds_nb ++;
+
+  return EREDIS_OK;
+}
+
+/**
+ * @brief Add a key prefix to track in broadcast mode
+ *
+ * Without prefix, broadcast mode tracks every key.
+ *
+ * @param e       eredis
+ * @param prefix  key prefix
+ *
+ * @return EREDIS_OK or EREDIS_ERR
+ */
+  int
+eredis_cache_prefix( eredis_t *e, const char *prefix )
+{
+  char **prefixes;
+  eredis_cache_t *ec = e->cache;
+
+  if (! ec || ! (ec->flags & EREDIS_CACHE_BCAST) || IS_INRUN(e))
+    return EREDIS_ERR;
+
+  prefixes = realloc( ec->prefixes, sizeof(char*) * (ec->prefixes_nb + 1) );
+  if (! prefixes)
+    return EREDIS_ERR;
+  ec->prefixes = prefixes;
+
+  if (! (prefixes[ ec->prefixes_nb ] = strdup( prefix )))
+    return EREDIS_ERR;
+  ec->prefixes_nb ++;
+
+  return EREDIS_OK;
+}
+
+/**
+ * @brief Drop all cached replies
+ *
+ * @param e eredis
+ */
+  void
+eredis_cache_flush( eredis_t *e )
+{
+  if (e->cache)
+    _eredis_cache_flush( e->cache );
+}
+
+/**
+ * @brief Client-side cache statistics
+ *
+ * @param e     eredis
+ * @param stats filled with the sum over all shards
+ */
+  void
+eredis_cache_stats( eredis_t *e, eredis_cache_stats_t *stats )
+{
+  int i;
+  eredis_cache_t *ec = e->cache;
+
+  memset( stats, 0, sizeof(eredis_cache_stats_t) );
+
+  if (! ec)
+    return;
+
+  for (i=0; i<ec->shards_nb; i++) {
+    cache_shard_t *cs = &ec->shards[i];
+
+    pthread_mutex_lock( &cs->lock );
+    stats->hits           += cs->hits;
+    stats->misses         += cs->misses;
+    stats->invalidations  += cs->invalidations;
+    stats->evictions      += cs->evictions;
+    stats->entries        += cs->entries;
+    stats->mem            += cs->mem;
+    pthread_mutex_unlock( &cs->lock );
+  }
+
+  stats->flushes = ec->flushes;
+}
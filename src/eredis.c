@@ -59,8 +59,19 @@
 #include <errno.h>
 #include <ctype.h>
 #include <pthread.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <sys/socket.h>
 #include <ev.h>
 
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/futex.h>
+/* Multiplexed readers wait for replies on a futex */
+#define EREDIS_MUX_FUTEX
+#endif
+
 /* hiredis ev */
 #include "adapters/libev.h"
 
@@ -75,10 +86,13 @@
  * */
 #define EREDIS_VERBOSE    1
 
-/* Retry to connect host every second, 10 times */
+/* Host "failed" after 10 connect failures in a row (backoff goes on) */
 #define HOST_DISCONNECTED_RETRIES         10
-/* Retry to connect "failed" host every 20 seconds */
-#define HOST_FAILED_RETRY_AFTER           20
+
+/* Reconnect backoff (ms) - DEFAULT
+ * First retry at once, then doubled from min up to max, with jitter */
+#define DEFAULT_HOST_BACKOFF_MIN          50
+#define DEFAULT_HOST_BACKOFF_MAX          10000
 
 /* Max readers - DEFAULT */
 #define DEFAULT_HOST_READER_MAX           10
@@ -86,12 +100,21 @@
 #define DEFAULT_HOST_TIMEOUT              5
 /* Retry - DEFAULT */
 #define DEFAULT_HOST_READER_RETRY         1
+/* Reader connect timeout (ms) - DEFAULT */
+#define DEFAULT_HOST_CONNECT_TIMEOUT      1000
+
+/* Reader connect: next host tried in parallel after (ms), at most */
+#define HOST_CONNECT_STAGGER              50
+#define HOST_CONNECT_PARALLEL             4
 
 /* Number of msg to keep in writer queue if any host is connected */
 #define QUEUE_MAX_UNSHIFT                 10000
 
 #define EREDIS_READER_MAX_BUF             (2 * REDIS_READER_MAX_BUF)
 
+/* Reader output buffer kept across batches, released above */
+#define EREDIS_READER_KEEP_OBUF           (64 * 1024)
+
 
 /*
  * Host status
@@ -103,6 +126,7 @@
 /* 0xf0 reserved for other flags */
 #define HOST_F_INIT             0x10
 #define HOST_F_CONNECTING       0x20
+#define HOST_F_DEGRADED         0x40
 
 /* and helpers */
 #define H_IS_CONNECTED(h)       (h->status & HOST_F_CONNECTED)
@@ -110,6 +134,8 @@
 #define H_IS_FAILED(h)          (h->status & HOST_F_FAILED)
 #define H_IS_INIT(h)            (h->status & HOST_F_INIT)
 #define H_IS_CONNECTING(h)      (h->status & HOST_F_CONNECTING)
+#define H_IS_DEGRADED(h)        (h->status & HOST_F_DEGRADED)
+#define H_IS_HEALTHY(h)         (H_IS_CONNECTED(h) && ! H_IS_DEGRADED(h))
 
 /* Conn state change removes the 'CONNECTING' flag */
 #define H_CONN_STATE(h)         h->status & 0x0f
@@ -129,6 +155,8 @@
 #define H_SET_CONNECTING(h)     h->status |= HOST_F_CONNECTING
 #define H_UNSET_CONNECTING(h)   h->status &= ~(HOST_F_CONNECTING)
 #define H_SET_INIT(h)           h->status |= HOST_F_INIT
+#define H_SET_DEGRADED(h)       h->status |= HOST_F_DEGRADED
+#define H_UNSET_DEGRADED(h)     h->status &= ~(HOST_F_DEGRADED)
 
 /*
  * Misc flags
@@ -170,9 +198,46 @@ typedef struct host_s {
   int               status:8;
   /* Connect failure counter:
    * HOST_DISCONNECTED + HOST_DISCONNECTED_RETRIES failure -> HOST_FAILED
-   * HOST_FAILED       + HOST_FAILED_RETRY_AFTER -> retry
    */
   int               failures:8;
+  /* Post-connect replies to get before HOST_F_CONNECTED */
+  int               pc_pending;
+
+  /* Reconnect: next attempt, current backoff (ms, 0: at once) */
+  ev_timer          retry_timer;
+  int               backoff;
+
+  /* Bumped by the event loop on disconnect: readers connected
+   * before are stale */
+  volatile int      gen;
+
+  /* Client-side cache invalidation connection */
+  redisAsyncContext *inval_ctx;
+  long long         inval_id;       /* CLIENT ID once subscribed, or 0 */
+  long long         inval_id_next;  /* CLIENT ID waiting for subscribe */
+  int               inval_gen;      /* bumped on (re)subscribe and loss */
+
+  /* Pub/sub dispatcher connection */
+  redisAsyncContext *sub_ctx;
+
+  /* Health probe connection and latency (us) */
+  redisAsyncContext *probe_ctx;
+  long long         probe_sent;     /* PING in flight since, or 0 */
+  int               probe_fails;    /* consecutive timeouts */
+  int               probe_stable;   /* consecutive stable replies */
+  long long         probe_last;
+  long long         probe_srtt;
+  long long         probe_min;
+  long long         probe_max;
+  unsigned long long probes;
+  unsigned long long probe_timeouts;
+
+  /* Statistics, event loop side */
+  unsigned long long stats_cmds;    /* writes sent */
+  unsigned long long stats_bytes;
+  unsigned long long stats_connects;
+  unsigned long long stats_transitions;
+  size_t            stats_obuf;     /* async output buffer */
 } host_t;
 
 /*
@@ -183,6 +248,14 @@ typedef struct cmd_s {
   int                 l;
 } cmd_t;
 
+/*
+ * A reader command: in the reader output buffer
+ */
+typedef struct rcmd_s {
+  size_t              off;
+  int                 l;
+} rcmd_t;
+
 /*
  * Write Queue of commands
  */
@@ -200,13 +273,42 @@ typedef struct eredis_reader_s {
   redisContext            *ctx;
   void                    *reply;
   host_t                  *host;
-  cmd_t                   *cmds;
+  rcmd_t                  *cmds;
   int                     cmds_requested; /* delivered requests */
   int                     cmds_replied;   /* delivered replies */
   int                     cmds_nb;
   int                     cmds_alloc;
   int                     free:8;
   int                     retry:8;
+  int                     tracked:8;      /* CLIENT TRACKING enabled */
+  int                     timed:8;        /* socket timeout from deadline */
+  int                     err;            /* last reply error */
+  long long               deadline;       /* ms (monotonic), 0: none */
+  int                     track_gen;      /* host inval_gen when enabled */
+  int                     host_gen;       /* host gen when connected */
+  int                     fd;             /* ctx fd, under reader_lock */
+  struct eredis_view_s    *views;         /* zero-copy reply nodes */
+  size_t                  views_nb;
+  size_t                  views_alloc;
+  struct eredis_arena_s   *arena;         /* reply arena */
+  int                     reply_arena;    /* 'reply' is in the arena */
+  size_t                  stream_left;    /* streamed elements to get */
+  char                    *obuf;          /* formatted commands */
+  size_t                  obuf_len;
+  size_t                  obuf_alloc;
+  char                    *fbuf;          /* format: arguments */
+  size_t                  fbuf_len;
+  size_t                  fbuf_alloc;
+  size_t                  *fargs;         /* format: argument lengths */
+  int                     fargs_nb;
+  int                     fargs_alloc;
+  int                     pipe_window;    /* pipeline mode: window */
+  int                     pipe_err;
+  size_t                  pipe_sent;      /* output buffer sent */
+  void                    (*pipe_cb)( struct redisReply *, void * );
+  void                    *pipe_data;
+  struct eredis_mux_s     *mux_fst;       /* multiplexed batches */
+  struct eredis_mux_s     *mux_lst;
 } eredis_reader_t;
 
 /*
@@ -219,6 +321,10 @@ typedef struct eredis_s {
   int               hosts_connected;
 
   struct timeval    sync_to;
+  int               connect_to;       /* reader connect timeout (ms) */
+  int               backoff_min;      /* reconnect backoff (ms) */
+  int               backoff_max;
+  unsigned int      backoff_seed;     /* jitter */
   pthread_mutex_t   reader_lock;
   pthread_cond_t    reader_cond;
   struct {
@@ -228,9 +334,20 @@ typedef struct eredis_s {
 
   int               reader_max;
   int               reader_retry;
+  size_t            reader_arena;     /* reply arena chunk, 0: off */
+  int               reader_interrupt; /* shutdown() readers of lost hosts */
+  int               migrate_rate;     /* back to hosts[0]/s, 0: no limit */
+  int               migrate_stable;   /* stable probes before, 0: none */
+  long long         migrate_credit;   /* readers x 1000 */
+  long long         migrate_ts;       /* last credit (ms) */
+  unsigned long long migrated;        /* under reader_lock */
+  unsigned long long migrate_deferred;
   int               flags;
 
   ev_timer          connect_timer;
+  ev_timer          probe_timer;
+  int               probe_interval;   /* ms, 0: off */
+  int               probe_timeout;    /* ms */
   ev_async          send_async;
 
   int               send_async_pending;
@@ -246,10 +363,59 @@ typedef struct eredis_s {
 
   pthread_t         async_thr;
   pthread_mutex_t   async_lock;
+
+  struct eredis_cache_s *cache;       /* client-side cache */
+
+  int               mux;              /* readers on async connections */
+  pthread_mutex_t   mux_lock;
+  pthread_cond_t    mux_cond;
+  struct {
+    struct eredis_mux_s *fst, *lst;
+  } mux_queue;
+
+  pthread_mutex_t   sub_lock;
+  struct eredis_sub_s *sub;           /* pub/sub dispatcher */
+  int               sub_window;       /* mirrors: duplicate window ms */
+
+  pthread_mutex_t   stats_lock;
+  struct eredis_tstats_s *tstats;     /* per-thread statistics */
+  struct eredis_tstats_s *tstats_free;    /* of exited threads */
+  struct eredis_tstats_s *tstats_retired; /* their counters */
+  int               tstats_nb;
+  pthread_key_t     stats_key;        /* thread exit destructor */
+  int               stats_key_ok;
+  unsigned int      stats_id;
+  long long         loop_tick;        /* next connect_timer tick (us) */
+  long long         loop_lag;         /* us */
+  long long         loop_lag_max;
+
+  ev_timer          export_timer;
+  int               export_interval;  /* ms, 0: off */
+  int               export_format;    /* callback format */
+  char              *export_path;     /* Prometheus textfile */
+  char              *export_tmp;
+  void              (*export_cb)( const char *, size_t, void * );
+  void              *export_data;
+  char              *export_buf;      /* render buffer, kept */
+  size_t            export_len;
+  size_t            export_alloc;
+  struct eredis_host_stats_s *export_hosts;
+  int               export_hosts_alloc;
+
+  struct eredis_slowlog_s *slowlog;   /* slow command ring */
+  int               slowlog_nb;       /* power of 2 */
+  volatile unsigned long long slowlog_pos;
+  long long         slowlog_us;       /* threshold, 0: off */
+  ev_signal         slowlog_signal;   /* dump */
+  int               slowlog_signum;
+  char              *slowlog_path;
+
+  struct eredis_hk_s *hk;             /* hot and big keys, NULL: off */
 } eredis_t;
 
 /* mine */
 #include "eredis.h"
+#include "trace.h"
 
 /**
  * Err/Warn/Log
@@ -278,6 +444,53 @@ typedef struct eredis_s {
 #endif
 #endif
 
+/* Clock of reader_cond (pthread_cond_timedwait) */
+#if defined(CLOCK_MONOTONIC) && ! defined(__APPLE__)
+#define EREDIS_COND_CLOCK       CLOCK_MONOTONIC
+#else
+#define EREDIS_COND_CLOCK       CLOCK_REALTIME
+#endif
+
+/*
+ * Monotonic time in ms, for deadlines
+ */
+  static inline long long
+_eredis_now_ms( void )
+{
+  struct timespec ts;
+
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Monotonic time in us, for latencies
+ */
+  static inline long long
+_eredis_now_us( void )
+{
+  struct timespec ts;
+
+  clock_gettime( EREDIS_COND_CLOCK, &ts );
+
+  return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+  static inline struct timeval
+_eredis_ms_tv( long long ms )
+{
+  struct timeval tv;
+
+  tv.tv_sec   = ms / 1000;
+  tv.tv_usec  = (ms % 1000) * 1000;
+
+  return tv;
+}
+
+/* Statistics: eredis identifiers, a thread may outlive its eredis */
+static unsigned int _eredis_stats_ids = 0;
+
 /**
  * @brief Build a new eredis environment
  *
@@ -287,6 +500,7 @@ typedef struct eredis_s {
 eredis_new( void )
 {
   eredis_t *e;
+  pthread_condattr_t cattr;
 
   e = calloc( 1, sizeof(eredis_t) );
   if (!e) {
@@ -295,12 +509,27 @@ eredis_new( void )
   }
 
   e->sync_to.tv_sec = DEFAULT_HOST_TIMEOUT;
+  e->connect_to     = DEFAULT_HOST_CONNECT_TIMEOUT;
+  e->backoff_min    = DEFAULT_HOST_BACKOFF_MIN;
+  e->backoff_max    = DEFAULT_HOST_BACKOFF_MAX;
+  e->backoff_seed   = (unsigned int) (time( NULL ) ^ getpid());
   e->reader_max     = DEFAULT_HOST_READER_MAX;
   e->reader_retry   = DEFAULT_HOST_READER_RETRY;
 
   pthread_mutex_init( &e->async_lock,   NULL );
   pthread_mutex_init( &e->reader_lock,  NULL );
-  pthread_cond_init(  &e->reader_cond,  NULL );
+  pthread_condattr_init( &cattr );
+#if defined(CLOCK_MONOTONIC) && ! defined(__APPLE__)
+  pthread_condattr_setclock( &cattr, EREDIS_COND_CLOCK );
+#endif
+  pthread_cond_init(  &e->reader_cond,  &cattr );
+  pthread_mutex_init( &e->mux_lock,     NULL );
+  pthread_mutex_init( &e->sub_lock,     NULL );
+  pthread_cond_init(  &e->mux_cond,     &cattr );
+  pthread_condattr_destroy( &cattr );
+
+  pthread_mutex_init( &e->stats_lock,   NULL );
+  e->stats_id = __sync_add_and_fetch( &_eredis_stats_ids, 1 );
 
   return e;
 }
@@ -320,6 +549,45 @@ eredis_timeout( eredis_t *e, int timeout_ms )
   e->sync_to.tv_usec = (timeout_ms % 1000) * 1000;
 }
 
+/**
+ * @brief Set reconnect backoff of the hosts
+ *
+ * A lost host is reconnected at once, then after each failure with an
+ * exponential backoff from 'min_ms' to 'max_ms'. Delays are jittered
+ * (half to full backoff) so that clients do not reconnect in lockstep.
+ *
+ * Default is DEFAULT_HOST_BACKOFF_MIN (50ms) to
+ * DEFAULT_HOST_BACKOFF_MAX (10 seconds)
+ *
+ * @param e       eredis
+ * @param min_ms  first backoff in milliseconds
+ * @param max_ms  max backoff in milliseconds
+ */
+  void
+eredis_reconnect( eredis_t *e, int min_ms, int max_ms )
+{
+  e->backoff_min = (min_ms > 0) ? min_ms : 1;
+  e->backoff_max = (max_ms > e->backoff_min) ? max_ms : e->backoff_min;
+}
+
+/**
+ * @brief Set connect timeout of readers
+ *
+ * Readers connect in parallel to the candidate hosts, a new one
+ * every HOST_CONNECT_STAGGER ms, the first connected wins.
+ * All attempts are bounded by this timeout (and the reader deadline).
+ *
+ * Default is DEFAULT_HOST_CONNECT_TIMEOUT (1 second)
+ *
+ * @param e          eredis
+ * @param timeout_ms timeout in milliseconds
+ */
+  void
+eredis_connect_timeout( eredis_t *e, int timeout_ms )
+{
+  e->connect_to = timeout_ms;
+}
+
 /**
  * @brief Set max number of reader
  *
@@ -348,6 +616,92 @@ eredis_r_retry( eredis_t *e, int retry )
   e->reader_retry = retry;
 }
 
+/**
+ * @brief Set reader interruption on host loss
+ *
+ * When the event loop loses a host, the sockets of the readers
+ * connected to it are shut down: a blocked read fails at once
+ * (and is retried on another host) instead of waiting for the
+ * timeout.
+ * Without it, the readers reconnect on their next command.
+ *
+ * Default is off.
+ *
+ * @param e   eredis
+ * @param on  1 to enable, 0 to disable
+ */
+  void
+eredis_r_interrupt( eredis_t *e, int on )
+{
+  e->reader_interrupt = on;
+}
+
+/**
+ * @brief Set reader migration back to the prefered host
+ *
+ * Once the prefered host (first one) is back, released readers
+ * connected elsewhere reconnect to it: at most 'per_sec' readers
+ * per second, and with health probes (eredis_probe) only after
+ * 'stable_probes' replies in a row in time and close to the smoothed
+ * latency.
+ *
+ * Default is no limit (all readers move back on release).
+ *
+ * @param e             eredis
+ * @param per_sec       readers per second, 0 for no limit
+ * @param stable_probes stable probes required, 0 for none
+ */
+  void
+eredis_r_migrate( eredis_t *e, int per_sec, int stable_probes )
+{
+  e->migrate_rate   = (per_sec > 0) ? per_sec : 0;
+  e->migrate_stable = (stable_probes > 0) ? stable_probes : 0;
+}
+
+/**
+ * @brief Set reader reply arena
+ *
+ * Replies of each reader are allocated from a per-reader arena
+ * (chunks of 'chunk' bytes), released in one step when the next reply
+ * is processed instead of a recursive freeReplyObject.
+ * A detached reply (eredis_r_reply_detach) is deep copied out of the
+ * arena.
+ *
+ * Default is 0 (off). Must be called before any call to 'eredis_r'.
+ *
+ * @param e     eredis
+ * @param chunk arena chunk size in bytes, 0 to disable
+ */
+  void
+eredis_r_arena( eredis_t *e, size_t chunk )
+{
+  e->reader_arena = chunk;
+}
+
+/**
+ * @brief Set multiplexed readers
+ *
+ * Reader commands are sent by the event loop on the host async
+ * connections instead of a connection per reader. Concurrent readers
+ * share these connections, their commands are written together.
+ * The event loop must run (eredis_run_thr).
+ * Views, streams, subscribe and windowed pipelines keep a reader
+ * connection; the client-side cache is not used.
+ * Commands changing the connection state or blocking it (SELECT, MULTI,
+ * CLIENT, SUBSCRIBE, BLPOP...) would affect the mirrored writes: they
+ * are sent on a reader connection instead.
+ *
+ * Default is 0 (off). Must be called before any call to 'eredis_r'.
+ *
+ * @param e     eredis
+ * @param on    1 to enable, 0 to disable
+ */
+  void
+eredis_mux( eredis_t *e, int on )
+{
+  e->mux = on;
+}
+
 /**
  * @brief Add a post-connect command
  *
@@ -416,6 +770,7 @@ eredis_host_add( eredis_t *e, char *target, int port )
   _P_LOG("adding host: %s (%d)", target, port);
 
   h             = &e->hosts[ e->hosts_nb ];
+  memset( h, 0, sizeof(host_t) );
   h->async_ctx  = NULL;
   h->e          = e;
   h->target     = strdup( target );
@@ -427,6 +782,11 @@ eredis_host_add( eredis_t *e, char *target, int port )
   h->port       = port;
   h->status     = 0;
 
+  h->inval_ctx      = NULL;
+  h->inval_id       = 0;
+  h->inval_id_next  = 0;
+  h->inval_gen      = 0;
+
   H_SET_DISCONNECTED( h );
 
   e->hosts_nb ++;
@@ -507,10 +867,112 @@ out:
   return ret;
 }
 
+/* Embedded stats code */
+#include "stats.c"
 /* Embedded reader code */
 #include "reader.c"
 /* Embedded queue code */
 #include "queue.c"
+/* Embedded cache code */
+#include "cache.c"
+/* Embedded format code */
+#include "format.c"
+/* Embedded mux code */
+#include "mux.c"
+/* Embedded sub code */
+#include "sub.c"
+/* Embedded probe code */
+#include "probe.c"
+/* Embedded export code */
+#include "export.c"
+/* Embedded slowlog code */
+#include "slowlog.c"
+/* Embedded hot keys code */
+#include "hotkey.c"
+
+/*
+ * Ready flag - need a connected host or a connection failure
+ * for each host
+ */
+  static void
+_eredis_ready_check( eredis_t *e )
+{
+  int i, nb = 0;
+
+  if (IS_READY(e))
+    return;
+
+  /* build ready flag */
+  for (i=0; i<e->hosts_nb; i++) {
+    host_t *h = &e->hosts[i];
+    if (H_IS_INIT( h ))
+      nb ++;
+  }
+  if (nb == e->hosts_nb) {
+    SET_READY(e);
+    e->send_async_pending = 1;
+    ev_async_send( e->loop, &e->send_async );
+  }
+}
+
+/*
+ * Schedule the next connect attempt of a host (backoff with jitter)
+ */
+  static void
+_host_retry( host_t *h )
+{
+  eredis_t *e = h->e;
+  int delay = 0;
+
+  if (IS_SHUTDOWN(e) || ev_is_active( &h->retry_timer ))
+    return;
+
+  if (h->backoff) {
+    delay = h->backoff / 2 + rand_r( &e->backoff_seed ) % (h->backoff / 2 + 1);
+    h->backoff = (h->backoff < e->backoff_max / 2) ?
+      h->backoff * 2 : e->backoff_max;
+  }
+  else
+    h->backoff = e->backoff_min;
+
+  ev_timer_set( &h->retry_timer, delay / 1000., 0. );
+  ev_timer_start( e->loop, &h->retry_timer );
+}
+
+/* Host ready for the writes */
+  static void
+_host_connected( host_t *h )
+{
+  H_SET_CONNECTED( h );
+
+  h->e->hosts_connected ++;
+  h->backoff = 0;
+
+  h->stats_connects ++;
+  _eredis_stats_transition( h );
+
+  _eredis_ready_check( h->e );
+}
+
+/* Redis - ev - post-connect command reply */
+  static void
+_redis_pc_cb( redisAsyncContext *ac, void *reply, void *privdata )
+{
+  host_t *h = (host_t*) ac->data;
+  redisReply *rep = reply;
+
+  (void) privdata;
+
+  /* Disconnected - see _redis_disconnect_cb */
+  if (! rep || ! h->pc_pending)
+    return;
+
+  if (rep->type == REDIS_REPLY_ERROR)
+    _P_WARN("post-connect cmd refused by %s: %s", h->target, rep->str);
+
+  if (-- h->pc_pending == 0)
+    _host_connected( h );
+}
 
 /* Redis - ev - connect callback */
   static void
@@ -523,13 +985,15 @@ _redis_connect_cb (const redisAsyncContext *c, int status)
   if (status == REDIS_OK) {
     _P_LOG("connect_cb: connected %s", h->target);
 
-    H_SET_CONNECTED( h );
-
-    h->e->hosts_connected ++;
+    /* Still 'connecting' until the post-connect replies */
+    if (! h->pc_pending)
+      _host_connected( h );
 
     return;
   }
 
+  h->pc_pending = 0;
+
   /* Unset connecting flag */
   H_UNSET_CONNECTING( h );
 
@@ -541,6 +1005,7 @@ _redis_connect_cb (const redisAsyncContext *c, int status)
       if ((++ h->failures) > HOST_DISCONNECTED_RETRIES) {
         _P_WARN("host to failed: %s", h->target);
         H_SET_FAILED( h );
+        _eredis_stats_transition( h );
       }
       break;
 
@@ -551,6 +1016,11 @@ _redis_connect_cb (const redisAsyncContext *c, int status)
 
   /* Free is taken care by hiredis - unlink */
   h->async_ctx  = NULL;
+
+  _eredis_ready_check( h->e );
+
+  /* Next attempt */
+  _host_retry( h );
 }
 
 /* Redis - ev - disconnect callback */
@@ -558,38 +1028,48 @@ _redis_connect_cb (const redisAsyncContext *c, int status)
 _redis_disconnect_cb (const redisAsyncContext *c, int status)
 {
   host_t *h = (host_t*) c->data;
+  int connected = H_IS_CONNECTED(h);
 
   (void)status;
 
   _P_WARN("disconnect_cb: %s", h->target);
 
-  if (! H_IS_CONNECTED(h)) {
+  if (connected)
+    h->e->hosts_connected --;
+  else if (! h->pc_pending) {
     _P_ERR(
       "strange behavior: "
       "redis_disconnect_cb called on !HOST_CONNECTED");
   }
-  else
-    h->e->hosts_connected --;
+
+  h->pc_pending = 0;
 
   h->async_ctx  = NULL;
   H_SET_DISCONNECTED( h );
   /* Free is take care by hiredis */
+
+  if (connected)
+    _eredis_stats_transition( h );
+
+  /* Readers on this host: reconnect on next use, or at once */
+  h->gen ++;
+  if (h->e->reader_interrupt)
+    _eredis_reader_interrupt( h );
+
+  /* Reconnect at once (next loop iteration) */
+  _host_retry( h );
 }
 
-/* Internal host connect - Sync or Async */
+/* Internal host connect - Sync (non-blocking start) or Async */
   static inline redisContext *
-_host_connect_sync( host_t *h, eredis_reader_t *r )
+_host_connect_nb( host_t *h )
 {
-  int i;
-  eredis_t *e;
   redisContext *c;
 
-  e = h->e;
-
   c = (h->port) ?
-    redisConnect( h->target, h->port )
+    redisConnectNonBlock( h->target, h->port )
     :
-    redisConnectUnix( h->target );
+    redisConnectUnixNonBlock( h->target );
 
   if (! c) {
     _P_ERR("connect sync %s NULL", h->target);
@@ -601,8 +1081,31 @@ _host_connect_sync( host_t *h, eredis_reader_t *r )
     return NULL;
   }
 
-  r->ctx   = c;
-  r->host  = h;
+  return c;
+}
+
+/*
+ * Reader context connected by _host_connect_race:
+ * back to blocking and post-connect commands
+ */
+  static inline redisContext *
+_host_connect_sync( host_t *h, eredis_reader_t *r, redisContext *c )
+{
+  int i;
+  eredis_t *e;
+
+  e = h->e;
+
+  if (redisSetBlocking( c, 1 ) != REDIS_OK) {
+    _P_LOG("connect sync failed %s: blocking mode", h->target);
+    redisFree( c );
+    return NULL;
+  }
+  c->flags |= REDIS_BLOCK;
+
+  r->ctx       = c;
+  r->host      = h;
+  r->host_gen  = h->gen;
 
   /* Process post-connect command if any */
   for (i=0; i<e->cmds_connect_nb; i++) {
@@ -621,6 +1124,9 @@ _host_connect_sync( host_t *h, eredis_reader_t *r )
       _P_ERR( "eredis_reader: failed to execute post-connect cmd: %.*s",
               e->cmds_connect[i].l,
               e->cmds_connect[i].s );
+      redisFree( r->ctx );
+      r->ctx  = NULL;
+      r->host = NULL;
       return NULL;
     }
   }
@@ -664,6 +1170,9 @@ _host_connect_async( host_t *h )
   /* data for _redis_*_cb */
   ac->data = h;
 
+  /* multiplexed replies are given to the readers */
+  ac->c.reader->fn = &_eredis_mux_fn;
+
   /* Order is important here */
 
   /* attach */
@@ -676,28 +1185,32 @@ _host_connect_async( host_t *h )
   /* set connecting flag */
   H_SET_CONNECTING( h );
 
-  /* Append post-connect command if any */
-  for (i=e->cmds_connect_nb - 1; i>=0; i--) {
-    char *cmd = strndup( e->cmds_connect[i].s, e->cmds_connect[i].l );
-    if (! cmd) {
+  /* Post-connect commands pipelined on this connection only,
+   * sent once connected: writes wait for their replies */
+  h->pc_pending = 0;
+  for (i=0; i<e->cmds_connect_nb; i++) {
+    if (__redisAsyncCommand( ac, _redis_pc_cb, NULL,
+                             e->cmds_connect[i].s,
+                             e->cmds_connect[i].l ) != REDIS_OK) {
+      h->pc_pending = 0;
       H_SET_DISCONNECTED( h );
       redisAsyncFree( h->async_ctx );
       h->async_ctx = NULL;
       return NULL;
     }
-    _eredis_wqueue_unshift( e, cmd, e->cmds_connect[i].l );
+    h->pc_pending ++;
   }
 
   return (redisContext*) ac;
 }
 
   static int
-_host_connect( host_t *h, eredis_reader_t *r )
+_host_connect( host_t *h, eredis_reader_t *r, redisContext *rc )
 {
   redisContext *c;
 
   /* Connect per context, reader => sync, writer => async */
-  c = (r) ? _host_connect_sync( h, r ) : _host_connect_async( h );
+  c = (r) ? _host_connect_sync( h, r, rc ) : _host_connect_async( h );
   if (! c)
     return 0;
 
@@ -714,9 +1227,120 @@ _host_connect( host_t *h, eredis_reader_t *r )
   /* Override the maxbuf */
   c->reader->maxbuf = EREDIS_READER_MAX_BUF;
 
+  /* Reader replies from its arena */
+  if (r && h->e->reader_arena && ! _eredis_reader_arena( r, c )) {
+    _P_ERR("connect sync %s: failed to allocate arena", h->target);
+    redisFree( c );
+    r->ctx  = NULL;
+    r->host = NULL;
+    return 0;
+  }
+
+  if (r)
+    _eredis_reader_fd( r, c->fd );
+
   return 1;
 }
 
+/*
+ * Reader connect - "happy eyeballs" over the hosts, in order:
+ * non-blocking connect to the first candidate, the next one is tried in
+ * parallel if none succeeded within HOST_CONNECT_STAGGER ms (or at once
+ * on a failure). The first connected wins, the others are closed.
+ * Candidates: hosts 'from' to 'to' (excluded), 'connected': only the
+ * ones seen connected by the event loop (2: and not degraded).
+ */
+  static int
+_host_connect_race( eredis_reader_t *r, int from, int to, int connected )
+{
+  eredis_t *e = r->e;
+  redisContext *cs[ HOST_CONNECT_PARALLEL ];
+  host_t *hs[ HOST_CONNECT_PARALLEL ];
+  struct pollfd pfds[ HOST_CONNECT_PARALLEL ];
+  long long now, end, next, wait;
+  int i, k, nb = 0, hi = from, win = -1, err;
+  socklen_t errlen;
+
+  now   = _eredis_now_ms();
+  end   = now + e->connect_to;
+  if (r->deadline && r->deadline < end)
+    end = r->deadline;
+  next  = now;
+
+  while (now < end) {
+    /* Next candidate */
+    if (nb < HOST_CONNECT_PARALLEL && now >= next) {
+      for (; hi < to; hi++) {
+        host_t *h = &e->hosts[hi];
+        if (! connected ||
+            ((connected == 1) ? H_IS_CONNECTED(h) : H_IS_HEALTHY(h)))
+          break;
+      }
+      if (hi < to) {
+        host_t *h = &e->hosts[hi++];
+        if ((cs[nb] = _host_connect_nb( h ))) {
+          hs[nb]            = h;
+          pfds[nb].fd       = cs[nb]->fd;
+          pfds[nb].events   = POLLOUT;
+          pfds[nb].revents  = 0;
+          nb ++;
+          next = now + HOST_CONNECT_STAGGER;
+        }
+        continue;
+      }
+      next = end; /* no more candidate */
+    }
+
+    if (! nb)
+      break;
+
+    wait = ((nb < HOST_CONNECT_PARALLEL && next < end) ? next : end) - now;
+    if (poll( pfds, nb, (wait > 0) ? (int)wait : 0 ) < 0 && errno != EINTR)
+      break;
+
+    for (i=0; i<nb; i++) {
+      if (! pfds[i].revents)
+        continue;
+
+      err     = 0;
+      errlen  = sizeof(err);
+      if (getsockopt( pfds[i].fd, SOL_SOCKET, SO_ERROR, &err, &errlen ) == 0
+          && ! err
+          && ! (pfds[i].revents & (POLLERR | POLLHUP))) {
+        win = i;
+        break;
+      }
+
+      /* Failed: next candidate at once */
+      _P_LOG("connect sync failed %s err:%d", hs[i]->target, err);
+      redisFree( cs[i] );
+      for (k=i; k<nb-1; k++) {
+        cs[k]   = cs[k+1];
+        hs[k]   = hs[k+1];
+        pfds[k] = pfds[k+1];
+      }
+      nb --;
+      i --;
+      next = _eredis_now_ms();
+    }
+
+    if (win >= 0)
+      break;
+
+    now = _eredis_now_ms();
+  }
+
+  /* Losers */
+  for (i=0; i<nb; i++)
+    if (i != win)
+      redisFree( cs[i] );
+
+  if (win < 0)
+    return 0;
+
+  return _host_connect( hs[win], r, cs[win] );
+}
+
 /*
  * EV send callback
  *
@@ -728,6 +1352,8 @@ _eredis_ev_send_cb (struct ev_loop *loop, ev_async *w, int revents)
   int i, nb, l;
   char *s;
   eredis_t *e;
+  long long sent;
+  eredis_slowlog_w_t *sw = NULL;
 
   (void) revents;
   (void) loop;
@@ -736,16 +1362,34 @@ _eredis_ev_send_cb (struct ev_loop *loop, ev_async *w, int revents)
 
   e->send_async_pending = 0;
 
+  /* Slow log: replies timed from now */
+  sent = (e->slowlog_us) ? _eredis_now_us() : 0;
+
   while ((s = _eredis_wqueue_shift( e, &l ))) {
+    EREDIS_TRACE3( w_dequeue, s, l, e->wqueue.nb );
+
+    if (sent)
+      sw = _eredis_slowlog_w_new( sent, s, l );
+
     for (nb = 0, i=0; i<e->hosts_nb; i++) {
       host_t *h = &e->hosts[i];
 
       if (H_IS_CONNECTED(h)) {
-        __redisAsyncCommand( h->async_ctx, NULL, NULL, s, l );
+        EREDIS_TRACE3( w_send, i, s, l );
+        if (__redisAsyncCommand( h->async_ctx,
+                                 (sw) ? _eredis_slowlog_w_cb : NULL, sw,
+                                 s, l ) == REDIS_OK && sw)
+          sw->refs ++;
+        h->stats_cmds ++;
+        h->stats_bytes += l;
         nb ++;
       }
     }
 
+    /* Sent nowhere */
+    if (sw && ! sw->refs)
+      free( sw );
+
     if (
       (! nb)  /* failed to deliver to any host */
       &&
@@ -758,6 +1402,14 @@ _eredis_ev_send_cb (struct ev_loop *loop, ev_async *w, int revents)
 
     free( s );
   }
+
+  /* Multiplexed reader commands */
+  _eredis_mux_flush( e );
+
+  /* Pub/sub (un)subscribe */
+  _eredis_sub_flush( e );
+
+  _eredis_stats_obuf( e );
 }
 
 /*
@@ -801,12 +1453,30 @@ _eredis_ev_connect_cb (struct ev_loop *loop, ev_timer *w, int revents)
             redisAsyncDisconnect( h->async_ctx );
           }
         }
+        if (h->inval_ctx)
+          redisAsyncDisconnect( h->inval_ctx );
+        if (h->sub_ctx)
+          redisAsyncDisconnect( h->sub_ctx );
+        if (h->probe_ctx)
+          redisAsyncDisconnect( h->probe_ctx );
       }
       e->hosts_connected = nb;
     }
     else {
       /* Connect timer */
       ev_timer_stop( e->loop, &e->connect_timer );
+      /* Host retry timers */
+      for (i=0; i<e->hosts_nb; i++)
+        ev_timer_stop( e->loop, &e->hosts[i].retry_timer );
+      /* Probe timer */
+      if (e->probe_interval)
+        ev_timer_stop( e->loop, &e->probe_timer );
+      /* Export timer */
+      if (e->export_interval)
+        ev_timer_stop( e->loop, &e->export_timer );
+      /* Slow log dump signal */
+      if (e->slowlog_signum)
+        ev_signal_stop( e->loop, &e->slowlog_signal );
       /* Async send */
       ev_async_stop( e->loop, &e->send_async );
       /* Event break */
@@ -816,6 +1486,9 @@ _eredis_ev_connect_cb (struct ev_loop *loop, ev_timer *w, int revents)
     return;
   }
 
+  /* Loop lag and output buffers */
+  _eredis_stats_tick( e );
+
   /* Normal procedure */
   for (i=0; i<e->hosts_nb; i++) {
     host_t *h = &e->hosts[i];
@@ -827,23 +1500,15 @@ _eredis_ev_connect_cb (struct ev_loop *loop, ev_timer *w, int revents)
 
     switch (H_CONN_STATE( h )) {
       case HOST_F_CONNECTED:
+        /* Invalidation channel follows the host connection */
+        if (e->cache && ! h->inval_ctx)
+          _eredis_cache_inval_connect( h );
         break;
 
       case HOST_F_FAILED:
-        if ((h->failures < HOST_FAILED_RETRY_AFTER)
-            ||
-            (! _host_connect( h, 0 ))) {
-          h->failures %= HOST_FAILED_RETRY_AFTER;
-          h->failures ++;
-        }
-        break;
-
       case HOST_F_DISCONNECTED:
-        if (! _host_connect( h, 0 )) {
-          if ((++ h->failures) > HOST_DISCONNECTED_RETRIES) {
-            H_SET_FAILED( h );
-          }
-        }
+        /* First attempt, later ones by the host retry timer */
+        _host_retry( h );
         break;
 
       default:
@@ -851,21 +1516,48 @@ _eredis_ev_connect_cb (struct ev_loop *loop, ev_timer *w, int revents)
     }
   }
 
-  if (! IS_READY(e)) {
-    /* Ready flag - need a connected host or a connection failure */
-    int nb = 0;
-    /* build ready flag */
-    for (i=0; i<e->hosts_nb; i++) {
-      host_t *h = &e->hosts[i];
-      if (H_IS_INIT( h ))
-        nb ++;
-    }
-    if (nb == e->hosts_nb) {
-      SET_READY(e);
-      e->send_async_pending = 1;
-      ev_async_send( e->loop, &e->send_async );
-    }
+  /* Pub/sub connection follows the host connections */
+  _eredis_sub_check( e );
+
+  _eredis_ready_check( e );
+}
+
+/*
+ * EV host retry callback
+ *
+ * EV_TIMER retry_timer (per host)
+ */
+  static void
+_eredis_ev_retry_cb (struct ev_loop *loop, ev_timer *w, int revents)
+{
+  host_t *h;
+
+  (void) revents;
+  (void) loop;
+
+  h = (host_t*) w->data;
+
+  if (IS_SHUTDOWN(h->e) || H_IS_CONNECTING(h) || H_IS_CONNECTED(h))
+    return;
+
+  if (_host_connect( h, NULL, NULL ))
+    return; /* connect callback follows */
+
+  H_SET_INIT( h );
+
+  switch (H_CONN_STATE( h )) {
+    case HOST_F_DISCONNECTED:
+      if ((++ h->failures) > HOST_DISCONNECTED_RETRIES) {
+        _P_WARN("host to failed: %s", h->target);
+        H_SET_FAILED( h );
+        _eredis_stats_transition( h );
+      }
+      break;
   }
+
+  _eredis_ready_check( h->e );
+
+  _host_retry( h );
 }
 
 /*
@@ -875,11 +1567,19 @@ _eredis_ev_connect_cb (struct ev_loop *loop, ev_timer *w, int revents)
 _eredis_run( eredis_t *e, int flags )
 {
   if (! e->loop) {
+    int i;
     ev_timer *levt;
     ev_async *leva;
 
     e->loop = ev_loop_new( EVFLAG_AUTO );
 
+    /* Host retry timers */
+    for (i=0; i<e->hosts_nb; i++) {
+      levt = &e->hosts[i].retry_timer;
+      ev_timer_init( levt, _eredis_ev_retry_cb, 0., 0. );
+      levt->data = &e->hosts[i];
+    }
+
     /* Connect timer */
     levt = &e->connect_timer;
     ev_timer_init( levt, _eredis_ev_connect_cb, 0., 1. );
@@ -891,6 +1591,33 @@ _eredis_run( eredis_t *e, int flags )
     ev_async_init( leva, _eredis_ev_send_cb );
     leva->data = e;
     ev_async_start( e->loop, leva );
+
+    /* Health probes */
+    if (e->probe_interval) {
+      levt = &e->probe_timer;
+      ev_timer_init( levt, _eredis_ev_probe_cb,
+                     0., e->probe_interval / 1000. );
+      levt->data = e;
+      ev_timer_start( e->loop, levt );
+    }
+
+    /* Statistics exporter */
+    if (e->export_interval && (e->export_path || e->export_cb)) {
+      levt = &e->export_timer;
+      ev_timer_init( levt, _eredis_ev_export_cb,
+                     e->export_interval / 1000.,
+                     e->export_interval / 1000. );
+      levt->data = e;
+      ev_timer_start( e->loop, levt );
+    }
+
+    /* Slow log dump */
+    if (e->slowlog_signum) {
+      ev_signal_init( &e->slowlog_signal, _eredis_ev_slowlog_cb,
+                      e->slowlog_signum );
+      e->slowlog_signal.data = e;
+      ev_signal_start( e->loop, &e->slowlog_signal );
+    }
   }
 
   SET_INRUN(e);
@@ -1080,6 +1807,12 @@ eredis_free( eredis_t *e )
   if (e->hosts) {
     for (i=0; i<e->hosts_nb; i++) {
       host_t *h = &e->hosts[i];
+      if (h->inval_ctx)
+        redisAsyncDisconnect( h->inval_ctx );
+      if (h->sub_ctx)
+        redisAsyncDisconnect( h->sub_ctx );
+      if (h->probe_ctx)
+        redisAsyncDisconnect( h->probe_ctx );
       if (h->async_ctx) {
         redisAsyncDisconnect( h->async_ctx );
         if (! IS_INTHR( e ))
@@ -1102,6 +1835,18 @@ eredis_free( eredis_t *e )
   if (e->hosts) {
     for (i=0; i<e->hosts_nb; i++) {
       host_t *h = &e->hosts[i];
+      if (h->inval_ctx) {
+        redisAsyncFree( h->inval_ctx );
+        h->inval_ctx = NULL;
+      }
+      if (h->sub_ctx) {
+        redisAsyncFree( h->sub_ctx );
+        h->sub_ctx = NULL;
+      }
+      if (h->probe_ctx) {
+        redisAsyncFree( h->probe_ctx );
+        h->probe_ctx = NULL;
+      }
       if (h->async_ctx) {
         redisAsyncFree( h->async_ctx );
         h->async_ctx = NULL;
@@ -1127,9 +1872,21 @@ eredis_free( eredis_t *e )
   while ((s = _eredis_wqueue_shift( e, NULL )))
     free(s);
 
+  /* Multiplexed batches never sent */
+  _eredis_mux_clear( e );
+
+  /* Per-thread statistics and exporter */
+  _eredis_stats_free( e );
+  _eredis_export_free( e );
+  _eredis_slowlog_free( e );
+  _eredis_hk_free( e );
+
   pthread_mutex_destroy( &e->async_lock );
   pthread_mutex_destroy( &e->reader_lock );
   pthread_cond_destroy( &e->reader_cond );
+  pthread_mutex_destroy( &e->mux_lock );
+  pthread_mutex_destroy( &e->sub_lock );
+  pthread_cond_destroy( &e->mux_cond );
 
   /* Clear post-connect commands */
   if (e->cmds_connect) {
@@ -1139,9 +1896,23 @@ eredis_free( eredis_t *e )
     free( e->cmds_connect );
   }
 
+  /* Client-side cache */
+  if (e->cache)
+    _eredis_cache_free( e );
+
+  /* Pub/sub dispatcher */
+  if (e->sub)
+    _eredis_sub_free( e );
+
   free(e);
 }
 
 /* Embedded rw code */
 #include "rw.c"
+/* Embedded view code */
+#include "view.c"
+/* Embedded scan code */
+#include "scan.c"
+/* Embedded pipe code */
+#include "pipe.c"
 
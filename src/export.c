@@ -0,0 +1,463 @@
+/*
+ * Copyright (c) 2016 by Eulerian Technologies SAS
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials
+ *   provided with the distribution.
+ *
+ * * Neither the name of Eulerian Technologies nor the names of its
+ *   contributors may be used to endorse or promote products
+ *   derived from this software without specific prior written
+ *   permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/**
+ * @file export.c
+ * @brief ERedis statistics exporter (event loop)
+ *
+ * The event loop renders the statistics every interval, in Prometheus
+ * text format to a file (written aside and renamed, for the
+ * node_exporter textfile collector) and/or to a user callback, in
+ * Prometheus or StatsD format.
+ *
+ * The render buffer and the host statistics are kept across renders:
+ * nothing is allocated once they have grown to their size.
+ */
+
+/* Render buffer, first size */
+#define EXPORT_BUF_SIZE         16384
+
+/* Host values: gauges (int, size_t) and counters */
+#define EXPORT_T_INT            0
+#define EXPORT_T_SIZE           1
+#define EXPORT_T_COUNTER        2
+
+static const struct {
+  const char  *name;
+  const char  *help;
+  int         type;
+  size_t      off;
+} _eredis_export_host_vals[] = {
+  { "connected",   "Event loop connection up",  EXPORT_T_INT,
+    offsetof( eredis_host_stats_t, connected ) },
+  { "commands",    "Commands sent",             EXPORT_T_COUNTER,
+    offsetof( eredis_host_stats_t, cmds ) },
+  { "bytes",       "Bytes sent",                EXPORT_T_COUNTER,
+    offsetof( eredis_host_stats_t, bytes ) },
+  { "replies",     "Reader replies",            EXPORT_T_COUNTER,
+    offsetof( eredis_host_stats_t, replies ) },
+  { "errors",      "Reader errors",             EXPORT_T_COUNTER,
+    offsetof( eredis_host_stats_t, errors ) },
+  { "connects",    "Event loop connections",    EXPORT_T_COUNTER,
+    offsetof( eredis_host_stats_t, connects ) },
+  { "transitions", "Host state transitions",    EXPORT_T_COUNTER,
+    offsetof( eredis_host_stats_t, transitions ) },
+  { "obuf_bytes",  "Event loop output buffer",  EXPORT_T_SIZE,
+    offsetof( eredis_host_stats_t, obuf ) },
+};
+#define EXPORT_HOST_VALS \
+  (int)(sizeof(_eredis_export_host_vals) / sizeof(_eredis_export_host_vals[0]))
+
+/* Latency quantiles */
+static const double _eredis_export_quantiles[] = { 50., 90., 99., 99.9 };
+#define EXPORT_QUANTILES \
+  (int)(sizeof(_eredis_export_quantiles) / sizeof(_eredis_export_quantiles[0]))
+
+  static inline unsigned long long
+_eredis_export_host_val( const eredis_host_stats_t *hs, int i )
+{
+  const char *p = (const char*)hs + _eredis_export_host_vals[i].off;
+
+  switch (_eredis_export_host_vals[i].type) {
+    case EXPORT_T_INT:
+      return *(const int*)p;
+    case EXPORT_T_SIZE:
+      return *(const size_t*)p;
+  }
+  return *(const unsigned long long*)p;
+}
+
+/*
+ * Append to the render buffer, grown if needed
+ */
+  static void
+_eredis_export_printf( eredis_t *e, const char *fmt, ... )
+{
+  va_list ap;
+  size_t left;
+  char *buf;
+  int n;
+
+  for (;;) {
+    left = e->export_alloc - e->export_len;
+
+    va_start( ap, fmt );
+    n = vsnprintf( e->export_buf + e->export_len, left, fmt, ap );
+    va_end( ap );
+
+    if (n < 0)
+      return;
+    if ((size_t)n < left) {
+      e->export_len += n;
+      return;
+    }
+
+    buf = realloc( e->export_buf, e->export_alloc * 2 );
+    if (! buf)
+      return;
+    e->export_buf    = buf;
+    e->export_alloc *= 2;
+  }
+}
+
+/*
+ * Host name: Prometheus label value (escaped) or StatsD path element
+ */
+  static const char *
+_eredis_export_host_name( const eredis_host_stats_t *hs, char *name,
+                          size_t size, int format )
+{
+  char tmp[ 256 ];
+  size_t i, j;
+
+  if (hs->port)
+    snprintf( tmp, sizeof(tmp), "%s:%d", hs->target, hs->port );
+  else
+    snprintf( tmp, sizeof(tmp), "%s", hs->target );
+
+  for (i=0, j=0; tmp[i] && j + 2 < size; i++) {
+    char c = tmp[i];
+
+    if (format == EREDIS_EXPORT_STATSD) {
+      if (! isalnum( (unsigned char)c ) && c != '-')
+        c = '_';
+    }
+    else if (c == '\\' || c == '"')
+      name[ j++ ] = '\\';
+
+    name[ j++ ] = c;
+  }
+  name[ j ] = '\0';
+
+  return (*name == '_') ? name + 1 : name;
+}
+
+  static void
+_eredis_export_prometheus( eredis_t *e, const eredis_stats_t *st, int nb )
+{
+  char name[ 512 ];
+  int i, j, k;
+
+#define EXPORT_GAUGE(n, h, fmt, v)                                    \
+  _eredis_export_printf( e,                                           \
+                         "# HELP eredis_" n " " h "\n"                \
+                         "# TYPE eredis_" n " gauge\n"                \
+                         "eredis_" n " " fmt "\n", v )
+#define EXPORT_COUNTER(n, h, fmt, v)                                  \
+  _eredis_export_printf( e,                                           \
+                         "# HELP eredis_" n "_total " h "\n"          \
+                         "# TYPE eredis_" n "_total counter\n"        \
+                         "eredis_" n "_total " fmt "\n", v )
+
+  EXPORT_GAUGE( "wqueue", "Writes waiting", "%d", st->wqueue );
+  EXPORT_GAUGE( "readers", "Reader pool", "%d", st->readers );
+  EXPORT_GAUGE( "readers_busy", "Readers in use", "%d", st->readers_busy );
+  EXPORT_COUNTER( "reader_waits", "Waits for a free reader",
+                  "%llu", st->reader_waits );
+  EXPORT_COUNTER( "reader_wait_seconds", "Time waiting for a free reader",
+                  "%.6f", st->reader_wait_us / 1e6 );
+  EXPORT_COUNTER( "lock_waits", "Contended reader pool lock",
+                  "%llu", st->lock_waits );
+  EXPORT_COUNTER( "lock_wait_seconds", "Time waiting for the pool lock",
+                  "%.6f", st->lock_wait_us / 1e6 );
+  EXPORT_GAUGE( "loop_lag_seconds", "Event loop lag",
+                "%.6f", st->loop_lag_us / 1e6 );
+  EXPORT_GAUGE( "loop_lag_max_seconds", "Event loop lag, max",
+                "%.6f", st->loop_lag_max_us / 1e6 );
+
+#undef EXPORT_GAUGE
+#undef EXPORT_COUNTER
+
+  for (k=0; k<EXPORT_HOST_VALS; k++) {
+    const char *vn = _eredis_export_host_vals[k].name;
+    const char *sfx =
+      (_eredis_export_host_vals[k].type == EXPORT_T_COUNTER) ? "_total" : "";
+
+    _eredis_export_printf( e,
+                           "# HELP eredis_host_%s%s %s\n"
+                           "# TYPE eredis_host_%s%s %s\n",
+                           vn, sfx, _eredis_export_host_vals[k].help,
+                           vn, sfx,
+                           (*sfx) ? "counter" : "gauge" );
+
+    for (i=0; i<nb; i++) {
+      _eredis_export_printf( e, "eredis_host_%s%s{host=\"%s\"} %llu\n",
+                             vn, sfx,
+                             _eredis_export_host_name( &e->export_hosts[i],
+                                                       name, sizeof(name),
+                                                       EREDIS_EXPORT_PROMETHEUS ),
+                             _eredis_export_host_val( &e->export_hosts[i], k ));
+    }
+  }
+
+  _eredis_export_printf( e,
+                         "# HELP eredis_host_latency_seconds "
+                         "Reader reply latency\n"
+                         "# TYPE eredis_host_latency_seconds summary\n" );
+  for (i=0; i<nb; i++) {
+    eredis_host_stats_t *hs = &e->export_hosts[i];
+    unsigned long long count = 0;
+
+    _eredis_export_host_name( hs, name, sizeof(name),
+                              EREDIS_EXPORT_PROMETHEUS );
+
+    for (j=0; j<EREDIS_STATS_HIST; j++)
+      count += hs->latency[j];
+
+    for (j=0; j<EXPORT_QUANTILES; j++)
+      _eredis_export_printf( e,
+                             "eredis_host_latency_seconds"
+                             "{host=\"%s\",quantile=\"%g\"} %.6f\n",
+                             name, _eredis_export_quantiles[j] / 100.,
+                             eredis_stats_percentile(
+                               hs->latency,
+                               _eredis_export_quantiles[j] ) / 1e6 );
+
+    _eredis_export_printf( e,
+                           "eredis_host_latency_seconds_count"
+                           "{host=\"%s\"} %llu\n", name, count );
+  }
+}
+
+  static void
+_eredis_export_statsd( eredis_t *e, const eredis_stats_t *st, int nb )
+{
+  char name[ 512 ];
+  const char *n;
+  int i, k;
+
+  _eredis_export_printf( e,
+                         "eredis.wqueue:%d|g\n"
+                         "eredis.readers:%d|g\n"
+                         "eredis.readers_busy:%d|g\n"
+                         "eredis.reader_waits:%llu|g\n"
+                         "eredis.reader_wait_us:%llu|g\n"
+                         "eredis.lock_waits:%llu|g\n"
+                         "eredis.lock_wait_us:%llu|g\n"
+                         "eredis.loop_lag_us:%lld|g\n"
+                         "eredis.loop_lag_max_us:%lld|g\n",
+                         st->wqueue, st->readers, st->readers_busy,
+                         st->reader_waits, st->reader_wait_us,
+                         st->lock_waits, st->lock_wait_us,
+                         st->loop_lag_us, st->loop_lag_max_us );
+
+  for (i=0; i<nb; i++) {
+    eredis_host_stats_t *hs = &e->export_hosts[i];
+
+    n = _eredis_export_host_name( hs, name, sizeof(name),
+                                  EREDIS_EXPORT_STATSD );
+
+    for (k=0; k<EXPORT_HOST_VALS; k++)
+      _eredis_export_printf( e, "eredis.host.%s.%s:%llu|g\n",
+                             n, _eredis_export_host_vals[k].name,
+                             _eredis_export_host_val( hs, k ) );
+
+    _eredis_export_printf( e,
+                           "eredis.host.%s.latency_p50_us:%lld|g\n"
+                           "eredis.host.%s.latency_p99_us:%lld|g\n",
+                           n, eredis_stats_percentile( hs->latency, 50. ),
+                           n, eredis_stats_percentile( hs->latency, 99. ) );
+  }
+}
+
+/*
+ * Prometheus textfile: written aside then renamed
+ */
+  static void
+_eredis_export_write( eredis_t *e )
+{
+  const char *p;
+  size_t left;
+  ssize_t n;
+  int fd;
+
+  fd = open( e->export_tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+  if (fd < 0) {
+    _P_WARN("export: unable to open %s", e->export_tmp);
+    return;
+  }
+
+  for (p = e->export_buf, left = e->export_len; left; ) {
+    n = write( fd, p, left );
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      _P_WARN("export: unable to write %s", e->export_tmp);
+      close( fd );
+      unlink( e->export_tmp );
+      return;
+    }
+    p     += n;
+    left  -= n;
+  }
+
+  close( fd );
+
+  if (rename( e->export_tmp, e->export_path ))
+    _P_WARN("export: unable to rename to %s", e->export_path);
+}
+
+/*
+ * EV export callback
+ *
+ * EV_TIMER export_timer
+ */
+  static void
+_eredis_ev_export_cb (struct ev_loop *loop, ev_timer *w, int revents)
+{
+  eredis_stats_t st;
+  eredis_host_stats_t *hosts;
+  eredis_t *e;
+  int nb;
+
+  (void) revents;
+  (void) loop;
+
+  e = (eredis_t*) w->data;
+
+  /* Warmup, or hosts added */
+  if (e->export_hosts_alloc < e->hosts_nb) {
+    hosts = realloc( e->export_hosts,
+                     e->hosts_nb * sizeof(eredis_host_stats_t) );
+    if (! hosts)
+      return;
+    e->export_hosts       = hosts;
+    e->export_hosts_alloc = e->hosts_nb;
+  }
+  if (! e->export_buf) {
+    if (!(e->export_buf = malloc( EXPORT_BUF_SIZE )))
+      return;
+    e->export_alloc = EXPORT_BUF_SIZE;
+  }
+
+  nb = eredis_stats( e, &st, e->export_hosts, e->export_hosts_alloc );
+  if (nb > e->export_hosts_alloc)
+    nb = e->export_hosts_alloc;
+
+  if (e->export_path) {
+    e->export_len = 0;
+    _eredis_export_prometheus( e, &st, nb );
+    _eredis_export_write( e );
+  }
+
+  if (e->export_cb) {
+    e->export_len = 0;
+    if (e->export_format == EREDIS_EXPORT_STATSD)
+      _eredis_export_statsd( e, &st, nb );
+    else
+      _eredis_export_prometheus( e, &st, nb );
+    e->export_cb( e->export_buf, e->export_len, e->export_data );
+  }
+}
+
+  static void
+_eredis_export_free( eredis_t *e )
+{
+  if (e->export_path)
+    free( e->export_path );
+  if (e->export_tmp)
+    free( e->export_tmp );
+  if (e->export_buf)
+    free( e->export_buf );
+  if (e->export_hosts)
+    free( e->export_hosts );
+}
+
+/**
+ * @brief Export the statistics to a Prometheus textfile
+ *
+ * The event loop writes the file every interval ('path'.tmp renamed
+ * to 'path'). To set before eredis_run(_thr).
+ *
+ * @param e           eredis
+ * @param path        file, NULL to disable
+ * @param interval_ms render interval
+ *
+ * @return EREDIS_OK or EREDIS_ERR
+ */
+  int
+eredis_export_file( eredis_t *e, const char *path, int interval_ms )
+{
+  char *p = NULL, *t = NULL;
+
+  if (path) {
+    p = strdup( path );
+    t = malloc( strlen( path ) + sizeof(".tmp") );
+    if (! p || ! t) {
+      free( p );
+      free( t );
+      return EREDIS_ERR;
+    }
+    sprintf( t, "%s.tmp", path );
+  }
+
+  if (e->export_path)
+    free( e->export_path );
+  if (e->export_tmp)
+    free( e->export_tmp );
+
+  e->export_path = p;
+  e->export_tmp  = t;
+
+  if (interval_ms > 0)
+    e->export_interval = interval_ms;
+
+  return EREDIS_OK;
+}
+
+/**
+ * @brief Export the statistics to a callback
+ *
+ * The event loop calls 'cb' every interval with the rendered buffer,
+ * valid during the call only. To set before eredis_run(_thr).
+ *
+ * @param e           eredis
+ * @param format      EREDIS_EXPORT_PROMETHEUS or EREDIS_EXPORT_STATSD
+ * @param cb          callback, NULL to disable
+ * @param data        callback data
+ * @param interval_ms render interval
+ */
+  void
+eredis_export( eredis_t *e, int format, eredis_export_cb cb, void *data,
+               int interval_ms )
+{
+  e->export_format  = format;
+  e->export_cb      = cb;
+  e->export_data    = data;
+
+  if (interval_ms > 0)
+    e->export_interval = interval_ms;
+}
@@ -0,0 +1,477 @@
+/*
+ * Copyright (c) 2016 by Eulerian Technologies SAS
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials
+ *   provided with the distribution.
+ *
+ * * Neither the name of Eulerian Technologies nor the names of its
+ *   contributors may be used to endorse or promote products
+ *   derived from this software without specific prior written
+ *   permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/**
+ * @file format.c
+ * @brief ERedis reader commands formatting
+ *
+ * Commands of a reader are formatted (RESP) directly into one output
+ * buffer, reused across batches. Only offsets are kept, for retry and
+ * re-subscribe.
+ *
+ * The printf-style format is the hiredis one (redisvFormatCommand):
+ * arguments split on spaces, %s, %b, %% and printf integer and double
+ * conversions.
+ */
+
+/*
+ * Reserve 'n' bytes at the end of the output buffer
+ */
+  static inline int
+_eredis_r_reserve( eredis_reader_t *r, size_t n )
+{
+  char *obuf;
+  size_t alloc;
+
+  if (r->obuf_len + n <= r->obuf_alloc)
+    return EREDIS_OK;
+
+  alloc = r->obuf_alloc ? r->obuf_alloc : 1024;
+  while (alloc < r->obuf_len + n)
+    alloc *= 2;
+
+  obuf = realloc( r->obuf, alloc );
+  if (! obuf)
+    return EREDIS_ERR;
+
+  r->obuf       = obuf;
+  r->obuf_alloc = alloc;
+
+  return EREDIS_OK;
+}
+
+/*
+ * Commit the command formatted at 'off'
+ */
+  static inline int
+_eredis_r_push( eredis_reader_t *r, size_t off )
+{
+  rcmd_t *cmds;
+  int alloc;
+
+  if (r->cmds_nb >= r->cmds_alloc) {
+    alloc = r->cmds_alloc ? r->cmds_alloc * 2 : 8;
+    cmds  = realloc( r->cmds, sizeof(rcmd_t) * alloc );
+    if (! cmds) {
+      r->obuf_len = off;
+      return EREDIS_ERR;
+    }
+    r->cmds       = cmds;
+    r->cmds_alloc = alloc;
+  }
+
+  r->cmds[ r->cmds_nb ].off = off;
+  r->cmds[ r->cmds_nb ].l   = r->obuf_len - off;
+  r->cmds_nb ++;
+
+  return EREDIS_OK;
+}
+
+/*
+ * Release the output buffer of a large batch, reuse it otherwise
+ */
+  static inline void
+_eredis_r_obuf_clear( eredis_reader_t *r )
+{
+  r->obuf_len = 0;
+
+  if (r->obuf_alloc > EREDIS_READER_KEEP_OBUF) {
+    free( r->obuf );
+    r->obuf       = NULL;
+    r->obuf_alloc = 0;
+  }
+}
+
+/*
+ * Already formatted command
+ */
+  static int
+_eredis_r_fcmd( eredis_reader_t *r, const char *cmd, size_t len )
+{
+  size_t off = r->obuf_len;
+
+  if (_eredis_r_reserve( r, len ) != EREDIS_OK)
+    return EREDIS_ERR;
+
+  memcpy( r->obuf + off, cmd, len );
+  r->obuf_len += len;
+
+  return _eredis_r_push( r, off );
+}
+
+/*
+ * RESP header "*N\r\n" or "$N\r\n" at 'p', return its length
+ */
+  static inline size_t
+_eredis_r_header( char *p, char type, size_t n )
+{
+  char tmp[ 24 ];
+  size_t i = sizeof(tmp), l;
+
+  do {
+    tmp[ -- i ] = '0' + (n % 10);
+    n /= 10;
+  } while (n);
+
+  l     = sizeof(tmp) - i;
+  p[0]  = type;
+  memcpy( p + 1, tmp + i, l );
+  p[ l + 1 ] = '\r';
+  p[ l + 2 ] = '\n';
+
+  return l + 3;
+}
+
+/*
+ * argc/argv command
+ */
+  static int
+_eredis_r_argv( eredis_reader_t *r,
+                int argc, const char **argv, const size_t *argvlen )
+{
+  size_t off = r->obuf_len, total, l;
+  char *p;
+  int i;
+
+  if (argc <= 0)
+    return EREDIS_ERRCMD;
+
+  /* headers: type, 20 digits max, CRLF */
+  total = 23;
+  for (i=0; i<argc; i++) {
+    l      = argvlen ? argvlen[i] : strlen( argv[i] );
+    total += 23 + l + 2;
+  }
+
+  if (_eredis_r_reserve( r, total ) != EREDIS_OK)
+    return EREDIS_ERR;
+
+  p  = r->obuf + off;
+  p += _eredis_r_header( p, '*', argc );
+  for (i=0; i<argc; i++) {
+    l  = argvlen ? argvlen[i] : strlen( argv[i] );
+    p += _eredis_r_header( p, '$', l );
+    memcpy( p, argv[i], l );
+    p += l;
+    *p ++ = '\r';
+    *p ++ = '\n';
+  }
+
+  r->obuf_len = p - r->obuf;
+
+  return _eredis_r_push( r, off );
+}
+
+/*
+ * Format scratch: arguments contents, then their lengths
+ */
+  static inline int
+_eredis_r_fbuf( eredis_reader_t *r, size_t n )
+{
+  char *fbuf;
+  size_t alloc;
+
+  if (r->fbuf_len + n <= r->fbuf_alloc)
+    return EREDIS_OK;
+
+  alloc = r->fbuf_alloc ? r->fbuf_alloc : 256;
+  while (alloc < r->fbuf_len + n)
+    alloc *= 2;
+
+  fbuf = realloc( r->fbuf, alloc );
+  if (! fbuf)
+    return EREDIS_ERR;
+
+  r->fbuf       = fbuf;
+  r->fbuf_alloc = alloc;
+
+  return EREDIS_OK;
+}
+
+  static inline int
+_eredis_r_fcat( eredis_reader_t *r, const char *s, size_t l )
+{
+  if (_eredis_r_fbuf( r, l ) != EREDIS_OK)
+    return EREDIS_ERR;
+
+  memcpy( r->fbuf + r->fbuf_len, s, l );
+  r->fbuf_len += l;
+
+  return EREDIS_OK;
+}
+
+  static inline int
+_eredis_r_fcatv( eredis_reader_t *r, const char *fmt, va_list ap )
+{
+  va_list cpy;
+  int l;
+
+  if (_eredis_r_fbuf( r, 64 ) != EREDIS_OK)
+    return EREDIS_ERR;
+
+  va_copy( cpy, ap );
+  l = vsnprintf( r->fbuf + r->fbuf_len,
+                 r->fbuf_alloc - r->fbuf_len, fmt, cpy );
+  va_end( cpy );
+
+  if (l < 0)
+    return EREDIS_ERR;
+
+  if (r->fbuf_len + l >= r->fbuf_alloc) {
+    if (_eredis_r_fbuf( r, l + 1 ) != EREDIS_OK)
+      return EREDIS_ERR;
+    va_copy( cpy, ap );
+    vsnprintf( r->fbuf + r->fbuf_len, l + 1, fmt, cpy );
+    va_end( cpy );
+  }
+
+  r->fbuf_len += l;
+
+  return EREDIS_OK;
+}
+
+/* Close the current argument */
+  static inline int
+_eredis_r_farg( eredis_reader_t *r, size_t start )
+{
+  size_t *args;
+  int alloc;
+
+  if (r->fargs_nb >= r->fargs_alloc) {
+    alloc = r->fargs_alloc ? r->fargs_alloc * 2 : 16;
+    args  = realloc( r->fargs, sizeof(size_t) * alloc );
+    if (! args)
+      return EREDIS_ERR;
+    r->fargs        = args;
+    r->fargs_alloc  = alloc;
+  }
+
+  r->fargs[ r->fargs_nb ++ ] = r->fbuf_len - start;
+
+  return EREDIS_OK;
+}
+
+/*
+ * printf-style command, as redisvFormatCommand
+ */
+  static int
+_eredis_r_vformat( eredis_reader_t *r, const char *format, va_list ap )
+{
+  static const char intfmts[] = "diouxX";
+  static const char flags[]   = "#0-+ ";
+  const char *c = format, *arg, *p;
+  size_t start, size, off, total, l;
+  char fmt[ 16 ], *o;
+  int touched = 0, i;
+  va_list cpy;
+
+  r->fbuf_len = 0;
+  r->fargs_nb = 0;
+  start       = 0;
+
+  for (; *c; c++) {
+    if (*c != '%' || c[1] == '\0') {
+      if (*c == ' ') {
+        if (touched) {
+          if (_eredis_r_farg( r, start ) != EREDIS_OK)
+            return EREDIS_ERR;
+          start   = r->fbuf_len;
+          touched = 0;
+        }
+      }
+      else {
+        if (_eredis_r_fcat( r, c, 1 ) != EREDIS_OK)
+          return EREDIS_ERR;
+        touched = 1;
+      }
+      continue;
+    }
+
+    switch (c[1]) {
+      case 's':
+        arg   = va_arg( ap, char* );
+        size  = strlen( arg );
+        if (_eredis_r_fcat( r, arg, size ) != EREDIS_OK)
+          return EREDIS_ERR;
+        break;
+
+      case 'b':
+        arg   = va_arg( ap, char* );
+        size  = va_arg( ap, size_t );
+        if (_eredis_r_fcat( r, arg, size ) != EREDIS_OK)
+          return EREDIS_ERR;
+        break;
+
+      case '%':
+        if (_eredis_r_fcat( r, "%", 1 ) != EREDIS_OK)
+          return EREDIS_ERR;
+        break;
+
+      default:
+        /* printf conversion: flags, width, precision, size */
+        p = c + 1;
+        while (*p && strchr( flags, *p ))
+          p ++;
+        while (*p && isdigit( *p ))
+          p ++;
+        if (*p == '.') {
+          p ++;
+          while (*p && isdigit( *p ))
+            p ++;
+        }
+
+        va_copy( cpy, ap );
+
+        if (*p && strchr( intfmts, *p ))
+          va_arg( ap, int );
+        else if (*p && strchr( "eEfFgGaA", *p ))
+          va_arg( ap, double );
+        else if (p[0] == 'h' && p[1] == 'h' && p[2] && strchr( intfmts, p[2] )) {
+          p += 2;
+          va_arg( ap, int );
+        }
+        else if (p[0] == 'h' && p[1] && strchr( intfmts, p[1] )) {
+          p += 1;
+          va_arg( ap, int );
+        }
+        else if (p[0] == 'l' && p[1] == 'l' && p[2] && strchr( intfmts, p[2] )) {
+          p += 2;
+          va_arg( ap, long long );
+        }
+        else if (p[0] == 'l' && p[1] && strchr( intfmts, p[1] )) {
+          p += 1;
+          va_arg( ap, long );
+        }
+        else {
+          va_end( cpy );
+          return EREDIS_ERRCMD;
+        }
+
+        l = (p + 1) - c;
+        if (l < sizeof(fmt) - 2) {
+          memcpy( fmt, c, l );
+          fmt[ l ] = '\0';
+          if (_eredis_r_fcatv( r, fmt, cpy ) != EREDIS_OK) {
+            va_end( cpy );
+            return EREDIS_ERR;
+          }
+          /* loop and below increment */
+          c = p - 1;
+        }
+        va_end( cpy );
+        break;
+    }
+
+    touched = 1;
+    c ++;
+  }
+
+  if (touched && _eredis_r_farg( r, start ) != EREDIS_OK)
+    return EREDIS_ERR;
+
+  if (! r->fargs_nb)
+    return EREDIS_ERRCMD;
+
+  /* RESP in the output buffer */
+  total = 23 + r->fbuf_len;
+  for (i=0; i<r->fargs_nb; i++)
+    total += 23 + 2;
+
+  off = r->obuf_len;
+  if (_eredis_r_reserve( r, total ) != EREDIS_OK)
+    return EREDIS_ERR;
+
+  o     = r->obuf + off;
+  arg   = r->fbuf;
+  o    += _eredis_r_header( o, '*', r->fargs_nb );
+  for (i=0; i<r->fargs_nb; i++) {
+    l   = r->fargs[i];
+    o  += _eredis_r_header( o, '$', l );
+    memcpy( o, arg, l );
+    o  += l;
+    arg += l;
+    *o ++ = '\r';
+    *o ++ = '\n';
+  }
+
+  r->obuf_len = o - r->obuf;
+
+  return _eredis_r_push( r, off );
+}
+
+/*
+ * Write the commands from 'from' to the connection, no copy
+ */
+  static int
+_eredis_r_write( eredis_reader_t *r, redisContext *c, int from )
+{
+  const char *p;
+  size_t left;
+  ssize_t n;
+  int done;
+
+  /* hiredis buffer first, if any (tracking..) */
+  if (c->obuf && sdslen( c->obuf )) {
+    do {
+      if (redisBufferWrite( c, &done ) == REDIS_ERR)
+        return EREDIS_ERR;
+    } while (! done);
+  }
+
+  if (from >= r->cmds_nb)
+    return EREDIS_OK;
+
+  p     = r->obuf + r->cmds[ from ].off;
+  left  = r->obuf_len - r->cmds[ from ].off;
+
+  while (left) {
+    n = write( c->fd, p, left );
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      __redisSetError( c, REDIS_ERR_IO, NULL );
+      return EREDIS_ERR;
+    }
+    p     += n;
+    left  -= n;
+  }
+
+  _eredis_stats_sent( r, r->cmds_nb - from,
+                      r->obuf_len - r->cmds[ from ].off );
+
+  return EREDIS_OK;
+}
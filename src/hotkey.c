@@ -0,0 +1,362 @@
+/*
+ * Copyright (c) 2016 by Eulerian Technologies SAS
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials
+ *   provided with the distribution.
+ *
+ * * Neither the name of Eulerian Technologies nor the names of its
+ *   contributors may be used to endorse or promote products
+ *   derived from this software without specific prior written
+ *   permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/**
+ * @file hotkey.c
+ * @brief ERedis hot and big keys
+ *
+ * One in 'rate' commands (per thread) of the writes and reader replies
+ * is sampled: its key (first argument) feeds two count-min sketches,
+ * requests and bytes (write command or reply size), and two top-K
+ * min-heaps of the heaviest keys by requests and by bytes.
+ * Estimates are scaled back by the sampling rate.
+ */
+
+/* Count-min sketch: rows and counters per row (power of 2) */
+#define HK_DEPTH                4
+#define HK_WIDTH                4096
+
+/* Top-K max */
+#define HK_K_MAX                1024
+
+/* Heap entry */
+typedef struct hk_ent_s {
+  uint64_t            hash;
+  unsigned long long  val[2];       /* EREDIS_HOTKEYS_COUNT, _BYTES */
+  int                 len;
+  char                key[ EREDIS_HOTKEY_LEN ];
+} hk_ent_t;
+
+typedef struct eredis_hk_s {
+  pthread_mutex_t     lock;
+  int                 rate;
+  int                 k;
+  unsigned long long  cms[2][ HK_DEPTH ][ HK_WIDTH ];
+  hk_ent_t            *heap[2];     /* min-heaps, 'k' entries */
+  int                 heap_nb[2];
+} eredis_hk_t;
+
+/* eredis_hotkey_t value by 'by' */
+#define HK_OUT_VAL(o, by)                                               \
+  (((by) == EREDIS_HOTKEYS_COUNT) ? (o).count : (o).bytes)
+
+/* Per thread sampling */
+static __thread unsigned int _eredis_hk_tick = 0;
+
+  static inline int
+_eredis_hk_sampled( eredis_t *e )
+{
+  if (! e->hk || ++ _eredis_hk_tick < (unsigned int)e->hk->rate)
+    return 0;
+
+  _eredis_hk_tick = 0;
+  return 1;
+}
+
+/*
+ * Count-min: add to the rows and return the estimate (min)
+ */
+  static unsigned long long
+_eredis_hk_cms( unsigned long long (*cms)[ HK_WIDTH ], uint64_t hash,
+                unsigned long long v )
+{
+  unsigned long long est = ~0ULL;
+  uint32_t h1 = (uint32_t) hash, h2 = (uint32_t)(hash >> 32) | 1;
+  int i;
+
+  for (i=0; i<HK_DEPTH; i++) {
+    unsigned long long *c = &cms[i][ (h1 + i * h2) & (HK_WIDTH - 1) ];
+    *c += v;
+    if (*c < est)
+      est = *c;
+  }
+
+  return est;
+}
+
+/*
+ * Min-heap by 'by'
+ */
+  static void
+_eredis_hk_down( hk_ent_t *heap, int nb, int i, int by )
+{
+  hk_ent_t tmp;
+  int c;
+
+  while ((c = 2 * i + 1) < nb) {
+    if (c + 1 < nb && heap[c + 1].val[by] < heap[c].val[by])
+      c ++;
+    if (heap[i].val[by] <= heap[c].val[by])
+      break;
+    tmp = heap[i]; heap[i] = heap[c]; heap[c] = tmp;
+    i = c;
+  }
+}
+
+  static void
+_eredis_hk_up( hk_ent_t *heap, int i, int by )
+{
+  hk_ent_t tmp;
+  int p;
+
+  while (i && heap[ p = (i - 1) / 2 ].val[by] > heap[i].val[by]) {
+    tmp = heap[i]; heap[i] = heap[p]; heap[p] = tmp;
+    i = p;
+  }
+}
+
+/*
+ * Top-K update with the key estimates
+ */
+  static void
+_eredis_hk_top( eredis_hk_t *hk, int by, uint64_t hash,
+                const char *key, size_t len, unsigned long long *est )
+{
+  hk_ent_t *heap = hk->heap[by], *ent;
+  int i, nb = hk->heap_nb[by];
+
+  for (i=0; i<nb; i++) {
+    ent = &heap[i];
+    if (ent->hash == hash && ent->len == (int)len &&
+        ! memcmp( ent->key, key,
+                  (len < EREDIS_HOTKEY_LEN) ? len : EREDIS_HOTKEY_LEN - 1 )) {
+      ent->val[0] = est[0];
+      ent->val[1] = est[1];
+      _eredis_hk_down( heap, nb, i, by );
+      return;
+    }
+  }
+
+  if (nb < hk->k)
+    i = hk->heap_nb[by] ++;
+  else if (est[by] > heap[0].val[by])
+    i = 0;
+  else
+    return;
+
+  ent = &heap[i];
+  ent->hash   = hash;
+  ent->val[0] = est[0];
+  ent->val[1] = est[1];
+  ent->len    = len;
+  if (len >= EREDIS_HOTKEY_LEN)
+    len = EREDIS_HOTKEY_LEN - 1;
+  memcpy( ent->key, key, len );
+  ent->key[ len ] = '\0';
+
+  if (i)
+    _eredis_hk_up( heap, i, by );
+  else
+    _eredis_hk_down( heap, hk->heap_nb[by], 0, by );
+}
+
+/*
+ * Sampled command 'cmd' of 'bytes'
+ */
+  static void
+_eredis_hk_add( eredis_t *e, const char *cmd, size_t len, size_t bytes )
+{
+  eredis_hk_t *hk = e->hk;
+  unsigned long long est[2];
+  const char *key;
+  size_t kl;
+  uint64_t hash;
+
+  /* Key: first argument */
+  if (_eredis_cmd_arg( cmd, len, 1, &key, &kl ) < 0)
+    return;
+
+  hash = _eredis_hash( key, kl );
+
+  pthread_mutex_lock( &hk->lock );
+
+  est[ EREDIS_HOTKEYS_COUNT ] =
+    _eredis_hk_cms( hk->cms[ EREDIS_HOTKEYS_COUNT ], hash, 1 );
+  est[ EREDIS_HOTKEYS_BYTES ] =
+    _eredis_hk_cms( hk->cms[ EREDIS_HOTKEYS_BYTES ], hash, bytes );
+
+  _eredis_hk_top( hk, EREDIS_HOTKEYS_COUNT, hash, key, kl, est );
+  _eredis_hk_top( hk, EREDIS_HOTKEYS_BYTES, hash, key, kl, est );
+
+  pthread_mutex_unlock( &hk->lock );
+}
+
+/*
+ * Reply size: strings, recursively
+ */
+  static size_t
+_eredis_hk_reply_bytes( const redisReply *reply )
+{
+  size_t i, n;
+
+  if (! reply)
+    return 0;
+
+  if (reply->type != REDIS_REPLY_ARRAY)
+    return reply->len;
+
+  for (i=0, n=0; i<reply->elements; i++)
+    n += _eredis_hk_reply_bytes( reply->element[i] );
+
+  return n;
+}
+
+/* Reader reply of its command 'i' */
+  static inline void
+_eredis_hk_r( eredis_reader_t *r, const redisReply *reply, int i )
+{
+  if (i < r->cmds_nb)
+    _eredis_hk_add( r->e, r->obuf + r->cmds[i].off, r->cmds[i].l,
+                    _eredis_hk_reply_bytes( reply ) );
+}
+
+  static void
+_eredis_hk_free( eredis_t *e )
+{
+  eredis_hk_t *hk = e->hk;
+
+  if (! hk)
+    return;
+
+  e->hk = NULL;
+
+  pthread_mutex_destroy( &hk->lock );
+  free( hk->heap[0] );
+  free( hk->heap[1] );
+  free( hk );
+}
+
+/**
+ * @brief Hot and big keys sampling
+ *
+ * One in 'rate' writes and reader replies is sampled. The 'k' heaviest
+ * keys are kept, by requests and by bytes.
+ * To set before use of writes and readers.
+ *
+ * @param e     eredis
+ * @param rate  sampling: 1 in 'rate' commands (1: all), 0 to disable
+ * @param k     heavy hitters kept (max 1024)
+ *
+ * @return EREDIS_OK or EREDIS_ERR
+ */
+  int
+eredis_hotkeys( eredis_t *e, int rate, int k )
+{
+  eredis_hk_t *hk;
+
+  _eredis_hk_free( e );
+
+  if (rate <= 0)
+    return EREDIS_OK;
+
+  if (k <= 0)
+    k = 1;
+  else if (k > HK_K_MAX)
+    k = HK_K_MAX;
+
+  hk = calloc( 1, sizeof(eredis_hk_t) );
+  if (! hk)
+    return EREDIS_ERR;
+
+  hk->heap[0] = calloc( k, sizeof(hk_ent_t) );
+  hk->heap[1] = calloc( k, sizeof(hk_ent_t) );
+  if (! hk->heap[0] || ! hk->heap[1]) {
+    free( hk->heap[0] );
+    free( hk->heap[1] );
+    free( hk );
+    return EREDIS_ERR;
+  }
+
+  pthread_mutex_init( &hk->lock, NULL );
+  hk->rate  = rate;
+  hk->k     = k;
+
+  e->hk = hk;
+
+  return EREDIS_OK;
+}
+
+/**
+ * @brief Hot and big keys, heaviest first
+ *
+ * Requests and bytes are estimates (count-min sketch, scaled by the
+ * sampling rate): never below the sampled value, possibly above.
+ *
+ * @param e   eredis
+ * @param by  EREDIS_HOTKEYS_COUNT or EREDIS_HOTKEYS_BYTES
+ * @param out keys to fill
+ * @param nb  size of 'out'
+ *
+ * @return number of keys filled
+ */
+  int
+eredis_hotkeys_get( eredis_t *e, int by, eredis_hotkey_t *out, int nb )
+{
+  eredis_hk_t *hk = e->hk;
+  hk_ent_t *heap;
+  int i, j, n;
+
+  if (! hk || (by != EREDIS_HOTKEYS_COUNT && by != EREDIS_HOTKEYS_BYTES))
+    return 0;
+
+  pthread_mutex_lock( &hk->lock );
+
+  heap  = hk->heap[by];
+  n     = 0;
+
+  /* Insertion by scaled value (as in out), descending */
+  for (i=0; i<hk->heap_nb[by]; i++) {
+    hk_ent_t *ent = &heap[i];
+
+    for (j=n; j>0 && HK_OUT_VAL( out[j-1], by ) < ent->val[by] * hk->rate;
+         j--)
+      if (j < nb)
+        out[j] = out[j-1];
+    if (j >= nb)
+      continue;
+
+    memcpy( out[j].key, ent->key, sizeof(out[j].key) );
+    out[j].key_len  = ent->len;
+    out[j].count    = ent->val[ EREDIS_HOTKEYS_COUNT ] * hk->rate;
+    out[j].bytes    = ent->val[ EREDIS_HOTKEYS_BYTES ] * hk->rate;
+    if (n < nb)
+      n ++;
+  }
+
+  pthread_mutex_unlock( &hk->lock );
+
+  return n;
+}
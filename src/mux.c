@@ -0,0 +1,443 @@
+/*
+ * Copyright (c) 2016 by Eulerian Technologies SAS
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials
+ *   provided with the distribution.
+ *
+ * * Neither the name of Eulerian Technologies nor the names of its
+ *   contributors may be used to endorse or promote products
+ *   derived from this software without specific prior written
+ *   permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/**
+ * @file mux.c
+ * @brief ERedis multiplexed readers
+ *
+ * Reader commands are not sent on a reader connection but handed to
+ * the event loop, which sends them on the host async connection
+ * (the writer one). Concurrent readers share a few connections and
+ * their commands are written together by the loop.
+ * Replies are given back in order to the waiting reader, without copy.
+ */
+
+/*
+ * A batch: the commands of a reader sent at once, and their replies.
+ * Owned by the reader and by the event loop until all are replied.
+ */
+typedef struct eredis_mux_s {
+  struct eredis_mux_s *next;      /* event loop queue */
+  struct eredis_mux_s *rnext;     /* reader batches */
+  eredis_t            *e;
+  int                 nb;
+  int                 taken;      /* replies given to the reader */
+  volatile int        got;        /* replies received */
+  volatile int        waiting;    /* reader is sleeping */
+  int                 refs;
+  int                 *lens;
+  redisReply          **replies;
+  char                *buf;
+} eredis_mux_t;
+
+/*
+ * Reply given to a waiting reader: not to be freed by hiredis
+ * after its callback (event loop thread).
+ */
+static __thread void *_eredis_mux_stolen = NULL;
+
+  static void
+_eredis_mux_free_object( void *reply )
+{
+  if (reply == _eredis_mux_stolen) {
+    _eredis_mux_stolen = NULL;
+    return;
+  }
+  freeReplyObject( reply );
+}
+
+static redisReplyObjectFunctions _eredis_mux_fn = {
+  createStringObject,
+  createArrayObject,
+  createIntegerObject,
+  createNilObject,
+  _eredis_mux_free_object
+};
+
+/*
+ * Release a batch: by the reader and by the event loop
+ */
+  static void
+_eredis_mux_unref( eredis_mux_t *b )
+{
+  int i;
+
+  if (__sync_sub_and_fetch( &b->refs, 1 ))
+    return;
+
+  for (i=b->taken; i<b->got; i++)
+    if (b->replies[i])
+      freeReplyObject( b->replies[i] );
+
+  free( b );
+}
+
+#ifdef EREDIS_MUX_FUTEX
+/*
+ * Futex completion: a reader sleeps on the counter of replies
+ */
+  static inline void
+_eredis_mux_wake( eredis_mux_t *b )
+{
+  __sync_synchronize();
+  if (b->waiting)
+    syscall( SYS_futex, &b->got, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0 );
+}
+
+  static int
+_eredis_mux_wait( eredis_reader_t *r, eredis_mux_t *b )
+{
+  struct timespec ts;
+  long long left;
+  int got;
+
+  while ((got = b->got) <= b->taken) {
+    if (r->deadline) {
+      left = r->deadline - _eredis_now_ms();
+      if (left <= 0)
+        return EREDIS_ERRTIMEOUT;
+      ts.tv_sec   = left / 1000;
+      ts.tv_nsec  = (left % 1000) * 1000000;
+    }
+
+    b->waiting = 1;
+    __sync_synchronize();
+    if (b->got == got)
+      syscall( SYS_futex, &b->got, FUTEX_WAIT_PRIVATE, got,
+               (r->deadline) ? &ts : NULL, NULL, 0 );
+    b->waiting = 0;
+  }
+
+  __sync_synchronize();
+  return EREDIS_OK;
+}
+#else
+/*
+ * Condition completion: all readers of the eredis share it
+ */
+  static inline void
+_eredis_mux_wake( eredis_mux_t *b )
+{
+  eredis_t *e = b->e;
+
+  pthread_mutex_lock( &e->mux_lock );
+  pthread_cond_broadcast( &e->mux_cond );
+  pthread_mutex_unlock( &e->mux_lock );
+}
+
+  static int
+_eredis_mux_wait( eredis_reader_t *r, eredis_mux_t *b )
+{
+  struct timespec ts;
+  eredis_t *e = r->e;
+  int err = EREDIS_OK;
+
+  if (r->deadline)
+    _eredis_rqueue_ts( r->deadline, &ts );
+
+  pthread_mutex_lock( &e->mux_lock );
+  while (b->got <= b->taken) {
+    if (! r->deadline)
+      pthread_cond_wait( &e->mux_cond, &e->mux_lock );
+    else if (pthread_cond_timedwait( &e->mux_cond, &e->mux_lock, &ts )
+             == ETIMEDOUT
+             &&
+             b->got <= b->taken) {
+      err = EREDIS_ERRTIMEOUT;
+      break;
+    }
+  }
+  pthread_mutex_unlock( &e->mux_lock );
+
+  return err;
+}
+#endif
+
+/*
+ * Reply callback (event loop), in order.
+ * NULL on a lost connection or for a batch without host.
+ */
+  static void
+_eredis_mux_cb( redisAsyncContext *ac, void *reply, void *privdata )
+{
+  eredis_mux_t *b = privdata;
+  int i = b->got;
+
+  (void) ac;
+
+  b->replies[i] = reply;
+  if (reply)
+    _eredis_mux_stolen = reply;
+
+  __sync_add_and_fetch( &b->got, 1 );
+  _eredis_mux_wake( b );
+
+  if (i + 1 == b->nb)
+    _eredis_mux_unref( b );
+}
+
+/*
+ * Fail the replies not received
+ */
+  static void
+_eredis_mux_fail( eredis_mux_t *b )
+{
+  while (b->got < b->nb)
+    _eredis_mux_cb( NULL, NULL, b );
+}
+
+/*
+ * Host for the batches: the prefered connected one, healthy first
+ */
+  static inline host_t *
+_eredis_mux_host( eredis_t *e )
+{
+  int i;
+  host_t *any = NULL;
+
+  for (i=0; i<e->hosts_nb; i++) {
+    host_t *h = &e->hosts[i];
+    if (H_IS_CONNECTED(h) &&
+        ! (h->async_ctx->c.flags & (REDIS_DISCONNECTING | REDIS_FREEING))) {
+      if (! H_IS_DEGRADED(h))
+        return h;
+      if (! any)
+        any = h;
+    }
+  }
+
+  return any;
+}
+
+/*
+ * Send the queued batches (event loop).
+ * hiredis writes them together on the next loop iteration.
+ */
+  static void
+_eredis_mux_flush( eredis_t *e )
+{
+  eredis_mux_t *b, *next;
+  host_t *h;
+  size_t pos;
+  int i;
+
+  pthread_mutex_lock( &e->mux_lock );
+  b = e->mux_queue.fst;
+  e->mux_queue.fst = e->mux_queue.lst = NULL;
+  pthread_mutex_unlock( &e->mux_lock );
+
+  if (! b)
+    return;
+
+  h = _eredis_mux_host( e );
+
+  for (; b; b = next) {
+    next = b->next;
+
+    if (! h) {
+      _eredis_mux_fail( b );
+      continue;
+    }
+
+    for (pos = 0, i=0; i<b->nb; i++) {
+      __redisAsyncCommand( h->async_ctx, _eredis_mux_cb, b,
+                           b->buf + pos, b->lens[i] );
+      pos += b->lens[i];
+    }
+
+    /* Sent by the event loop: its host counters */
+    h->stats_cmds  += b->nb;
+    h->stats_bytes += pos;
+  }
+}
+
+/*
+ * Commands changing the connection state or blocking it: never on the
+ * shared writer connection, the reader uses its own one.
+ */
+static const char *_eredis_mux_denied[] = {
+  "SELECT", "SWAPDB", "MULTI", "EXEC", "DISCARD", "WATCH", "UNWATCH",
+  "CLIENT", "HELLO", "AUTH", "RESET", "QUIT", "READONLY", "READWRITE",
+  "ASKING", "MONITOR", "SYNC", "PSYNC", "WAIT", "WAITAOF",
+  "SUBSCRIBE", "PSUBSCRIBE", "SSUBSCRIBE",
+  "UNSUBSCRIBE", "PUNSUBSCRIBE", "SUNSUBSCRIBE",
+  "BLPOP", "BRPOP", "BRPOPLPUSH", "BLMOVE", "BLMPOP",
+  "BZPOPMIN", "BZPOPMAX", "BZMPOP", "XREAD", "XREADGROUP",
+  NULL
+};
+
+/*
+ * Reader - 1 if its commands not sent yet can be multiplexed
+ */
+  static int
+_eredis_mux_allowed( eredis_reader_t *r )
+{
+  const char *name;
+  size_t name_l;
+  int i, j;
+
+  for (i=r->cmds_requested; i<r->cmds_nb; i++) {
+    if (_eredis_cmd_arg( r->obuf + r->cmds[i].off, r->cmds[i].l,
+                         0, &name, &name_l ) < 0)
+      return 0;
+
+    for (j=0; _eredis_mux_denied[j]; j++)
+      if (strlen( _eredis_mux_denied[j] ) == name_l &&
+          ! strncasecmp( _eredis_mux_denied[j], name, name_l ))
+        return 0;
+  }
+
+  return 1;
+}
+
+/*
+ * Reader - queue its pending commands as a batch for the event loop
+ */
+  static int
+_eredis_mux_send( eredis_reader_t *r )
+{
+  eredis_t *e = r->e;
+  eredis_mux_t *b;
+  size_t off, len;
+  int i, nb;
+
+  if (! IS_READY(e) || IS_SHUTDOWN(e))
+    return EREDIS_ERR;
+
+  nb  = r->cmds_nb - r->cmds_requested;
+  off = r->cmds[ r->cmds_requested ].off;
+  len = r->obuf_len - off;
+
+  b = malloc( sizeof(*b) + nb * (sizeof(redisReply*) + sizeof(int)) + len );
+  if (! b)
+    return EREDIS_ERR;
+
+  memset( b, 0, sizeof(*b) );
+  b->e        = e;
+  b->nb       = nb;
+  b->refs     = 2;
+  b->replies  = (redisReply**)(b + 1);
+  b->lens     = (int*)(b->replies + nb);
+  b->buf      = (char*)(b->lens + nb);
+
+  for (i=0; i<nb; i++)
+    b->lens[i] = r->cmds[ r->cmds_requested + i ].l;
+  memcpy( b->buf, r->obuf + off, len );
+
+  /* Reader batches, in order */
+  if (r->mux_lst)
+    r->mux_lst->rnext = b;
+  else
+    r->mux_fst = b;
+  r->mux_lst = b;
+
+  r->cmds_requested = r->cmds_nb;
+
+  /* Event loop queue */
+  pthread_mutex_lock( &e->mux_lock );
+  if (e->mux_queue.lst)
+    e->mux_queue.lst->next = b;
+  else
+    e->mux_queue.fst = b;
+  e->mux_queue.lst = b;
+  pthread_mutex_unlock( &e->mux_lock );
+
+  ev_async_send( e->loop, &e->send_async );
+
+  return EREDIS_OK;
+}
+
+/*
+ * Reader - next reply, waiting for it.
+ * The reply is owned by the reader.
+ */
+  static int
+_eredis_mux_get( eredis_reader_t *r, redisReply **reply )
+{
+  eredis_mux_t *b;
+  int err;
+
+  *reply = NULL;
+
+  b = r->mux_fst;
+  if (! b)
+    return EREDIS_ERR;
+
+  if ((err = _eredis_mux_wait( r, b )) != EREDIS_OK)
+    return err;
+
+  *reply = b->replies[ b->taken ];
+  b->replies[ b->taken ++ ] = NULL;
+
+  if (b->taken == b->nb) {
+    r->mux_fst = b->rnext;
+    if (! r->mux_fst)
+      r->mux_lst = NULL;
+    _eredis_mux_unref( b );
+  }
+
+  return (*reply) ? EREDIS_OK : EREDIS_ERR;
+}
+
+/*
+ * Reader - drop its batches still in flight
+ */
+  static void
+_eredis_mux_abandon( eredis_reader_t *r )
+{
+  eredis_mux_t *b;
+
+  while ((b = r->mux_fst)) {
+    r->mux_fst = b->rnext;
+    _eredis_mux_unref( b );
+  }
+  r->mux_lst = NULL;
+}
+
+/*
+ * Shutdown - fail the batches never sent
+ */
+  static void
+_eredis_mux_clear( eredis_t *e )
+{
+  eredis_mux_t *b;
+
+  while ((b = e->mux_queue.fst)) {
+    e->mux_queue.fst = b->next;
+    _eredis_mux_fail( b );
+  }
+  e->mux_queue.lst = NULL;
+}
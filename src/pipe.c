@@ -0,0 +1,336 @@
+/*
+ * Copyright (c) 2016 by Eulerian Technologies SAS
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials
+ *   provided with the distribution.
+ *
+ * * Neither the name of Eulerian Technologies nor the names of its
+ *   contributors may be used to endorse or promote products
+ *   derived from this software without specific prior written
+ *   permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/**
+ * @file pipe.c
+ * @brief ERedis reader windowed pipelines
+ *
+ * Unbounded batches of commands with a bounded number of them
+ * outstanding (formatted, not yet replied): once the window is full,
+ * commands are sent while replies are drained, down to half the
+ * window. Replies are given to a callback, in order.
+ * Memory of both sides stays constant.
+ */
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL            0
+#endif
+
+/* Read size, as hiredis */
+#define PIPE_READ_SIZE          (1024 * 16)
+
+/*
+ * Poll timeout: deadline or default timeout
+ */
+  static inline int
+_eredis_r_pipe_timeout( eredis_reader_t *r )
+{
+  long long left;
+  struct timeval *tv = &r->e->sync_to;
+
+  if (r->deadline) {
+    left = r->deadline - _eredis_now_ms();
+    return (left > 0) ? (int)left : 0;
+  }
+
+  if (tv->tv_sec || tv->tv_usec)
+    return tv->tv_sec * 1000 + tv->tv_usec / 1000;
+
+  return -1;
+}
+
+/*
+ * Drop replied commands from the output buffer
+ */
+  static void
+_eredis_r_pipe_compact( eredis_reader_t *r )
+{
+  size_t base;
+  int i, k = r->cmds_replied;
+
+  if (! k)
+    return;
+
+  base = (k < r->cmds_nb) ? r->cmds[k].off : r->obuf_len;
+
+  memmove( r->obuf, r->obuf + base, r->obuf_len - base );
+  r->obuf_len   -= base;
+  r->pipe_sent  -= base;
+
+  for (i=k; i<r->cmds_nb; i++) {
+    r->cmds[ i - k ]     = r->cmds[i];
+    r->cmds[ i - k ].off -= base;
+  }
+
+  r->cmds_nb        -= k;
+  r->cmds_requested -= k;
+  r->cmds_replied    = 0;
+}
+
+/*
+ * Send and receive until at most 'max' commands are outstanding
+ */
+  static int
+_eredis_r_pipe_pump( eredis_reader_t *r, int max )
+{
+  redisContext *c;
+  struct pollfd pfd;
+  char buf[ PIPE_READ_SIZE ];
+  void *reply;
+  size_t unsent;
+  ssize_t n;
+  int timeout = 0;
+
+  if (r->pipe_err)
+    return EREDIS_ERR;
+
+  if (!(c = _eredis_r_ctx( r, 0 )))
+    goto err;
+
+  while (r->cmds_nb - r->cmds_replied > max) {
+    unsent      = r->obuf_len - r->pipe_sent;
+    pfd.fd      = c->fd;
+    pfd.events  = (unsent ? POLLOUT : 0) |
+                  ((r->cmds_requested > r->cmds_replied) ? POLLIN : 0);
+    pfd.revents = 0;
+
+    n = poll( &pfd, 1, _eredis_r_pipe_timeout( r ) );
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      goto err;
+    }
+    if (n == 0) {
+      timeout = 1;
+      goto err;
+    }
+
+    /* Send what the socket takes */
+    if (pfd.revents & POLLOUT) {
+      n = send( c->fd, r->obuf + r->pipe_sent, unsent,
+                MSG_DONTWAIT | MSG_NOSIGNAL );
+      if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        goto err;
+      if (n > 0) {
+        r->pipe_sent += n;
+        while (r->cmds_requested < r->cmds_nb &&
+               r->cmds[ r->cmds_requested ].off +
+               r->cmds[ r->cmds_requested ].l <= r->pipe_sent)
+          r->cmds_requested ++;
+      }
+    }
+
+    /* Drain replies */
+    if (pfd.revents & (POLLIN | POLLERR | POLLHUP)) {
+      n = recv( c->fd, buf, sizeof(buf), MSG_DONTWAIT );
+      if (n == 0)
+        goto err;
+      if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+          continue;
+        goto err;
+      }
+      if (redisReaderFeed( c->reader, buf, n ) != REDIS_OK)
+        goto err;
+
+      for (;;) {
+        reply = NULL;
+        if (redisReaderGetReply( c->reader, &reply ) != REDIS_OK)
+          goto err;
+        if (! reply)
+          break;
+        r->cmds_replied ++;
+        if (r->pipe_cb)
+          r->pipe_cb( reply, r->pipe_data );
+        _eredis_reader_drop( r, reply );
+      }
+      if (r->arena)
+        _eredis_arena_reset( r->arena );
+    }
+  }
+
+  _eredis_r_pipe_compact( r );
+
+  return EREDIS_OK;
+
+err:
+  /* Outstanding commands are lost */
+  _P_ERR("pipe: %s, %d command(s) lost",
+         timeout ? "timeout" : "connection error",
+         r->cmds_nb - r->cmds_replied);
+  if (r->err == EREDIS_OK)
+    r->err = timeout ? EREDIS_ERRTIMEOUT : EREDIS_ERR;
+  _eredis_r_ctx( r, 1 );
+  r->pipe_err = 1;
+  r->pipe_sent = r->obuf_len = 0;
+  r->cmds_nb = r->cmds_requested = r->cmds_replied = 0;
+  return EREDIS_ERR;
+}
+
+/*
+ * After an append: flow control
+ */
+  static inline int
+_eredis_r_pipe_flow( eredis_reader_t *r, int ret )
+{
+  if (ret != EREDIS_OK)
+    return ret;
+
+  if (r->cmds_nb - r->cmds_replied >= r->pipe_window)
+    return _eredis_r_pipe_pump( r, r->pipe_window / 2 );
+
+  return EREDIS_OK;
+}
+
+/**
+ * @brief eredis reader pipeline mode
+ *
+ * Commands appended via eredis_r_pipe_* are sent by windows, their
+ * replies are given to the callback (released after the call).
+ * Other reader calls are not allowed before eredis_r_pipe_end.
+ *
+ * On error, outstanding commands are lost and next appends fail until
+ * eredis_r_pipe_end. No retry.
+ *
+ * @param r       eredis reader
+ * @param window  max outstanding commands (0: 1024)
+ * @param cb      reply callback, can be NULL
+ * @param data    callback data
+ */
+  void
+eredis_r_pipe( eredis_reader_t *r, int window,
+               eredis_pipe_cb cb, void *data )
+{
+  /* Previous commands */
+  eredis_r_clear( r );
+
+  r->pipe_window  = (window > 0) ? window : 1024;
+  r->pipe_cb      = cb;
+  r->pipe_data    = data;
+  r->pipe_sent    = 0;
+  r->pipe_err     = 0;
+}
+
+/**
+ * @brief eredis reader pipeline append vargs command
+ *
+ * @param r       eredis reader
+ * @param format  format
+ * @param ap      list
+ *
+ * @return EREDIS_ERRCMD, EREDIS_ERR, EREDIS_OK
+ */
+  int
+eredis_r_pipe_vcmd( eredis_reader_t *r, const char *format, va_list ap )
+{
+  if (r->pipe_err)
+    return EREDIS_ERR;
+
+  return _eredis_r_pipe_flow( r, eredis_r_append_vcmd( r, format, ap ) );
+}
+
+/**
+ * @brief eredis reader pipeline append 'printf' style command
+ *
+ * @param r       eredis reader
+ * @param format  format
+ * @param ...     list
+ *
+ * @return EREDIS_ERRCMD, EREDIS_ERR, EREDIS_OK
+ */
+  int
+eredis_r_pipe_cmd( eredis_reader_t *r, const char *format, ... )
+{
+  va_list ap;
+  int ret;
+
+  va_start(ap,format);
+  ret = eredis_r_pipe_vcmd( r, format, ap );
+  va_end(ap);
+
+  return ret;
+}
+
+/**
+ * @brief eredis reader pipeline append argc/argv command
+ *
+ * @param r       eredis reader
+ * @param argc    argument count
+ * @param argv    argument vector
+ * @param argvlen argument length vector
+ *
+ * @return EREDIS_ERRCMD, EREDIS_ERR, EREDIS_OK
+ */
+  int
+eredis_r_pipe_cmdargv( eredis_reader_t *r,
+                       int argc, const char **argv, const size_t *argvlen )
+{
+  if (r->pipe_err)
+    return EREDIS_ERR;
+
+  return _eredis_r_pipe_flow( r,
+                              eredis_r_append_cmdargv( r, argc, argv,
+                                                       argvlen ) );
+}
+
+/**
+ * @brief eredis reader pipeline end
+ *
+ * Wait for all the replies and leave the pipeline mode.
+ *
+ * @param r       eredis reader
+ *
+ * @return EREDIS_OK, EREDIS_ERR if commands were lost
+ */
+  int
+eredis_r_pipe_end( eredis_reader_t *r )
+{
+  int ret;
+
+  ret = _eredis_r_pipe_pump( r, 0 );
+
+  r->pipe_window  = 0;
+  r->pipe_cb      = NULL;
+  r->pipe_data    = NULL;
+  r->pipe_sent    = 0;
+  r->pipe_err     = 0;
+
+  _eredis_r_obuf_clear( r );
+  r->cmds_nb = r->cmds_requested = r->cmds_replied = 0;
+
+  return ret;
+}
@@ -0,0 +1,312 @@
+/*
+ * Copyright (c) 2016 by Eulerian Technologies SAS
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials
+ *   provided with the distribution.
+ *
+ * * Neither the name of Eulerian Technologies nor the names of its
+ *   contributors may be used to endorse or promote products
+ *   derived from this software without specific prior written
+ *   permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/**
+ * @file probe.c
+ * @brief ERedis host health probes (event loop)
+ *
+ * Each connected host gets a lightweight probe connection, a PING is
+ * sent every interval and its round trip measured. A host without
+ * reply within the timeout is degraded: readers, multiplexed commands
+ * and subscriptions go to the healthy hosts first. A timed out PING is
+ * counted once and a new one is sent at the next interval (a late
+ * reply is ignored). After PROBE_FAIL_AFTER timed out PINGs in a row,
+ * its connections are dropped (no more mirrored writes) until it
+ * reconnects and answers in time.
+ */
+
+/* Consecutive timeouts before dropping the host connections */
+#define PROBE_FAIL_AFTER        3
+
+/*
+ * Probe connection callbacks (event loop)
+ */
+  static void
+_eredis_probe_lost( host_t *h )
+{
+  h->probe_ctx    = NULL;
+  h->probe_sent   = 0;
+  h->probe_stable = 0;
+}
+
+  static void
+_eredis_probe_connect_cb( const redisAsyncContext *c, int status )
+{
+  if (status != REDIS_OK)
+    _eredis_probe_lost( (host_t*) c->data );
+}
+
+  static void
+_eredis_probe_disconnect_cb( const redisAsyncContext *c, int status )
+{
+  (void) status;
+  _eredis_probe_lost( (host_t*) c->data );
+}
+
+/*
+ * PING reply: round trip. 'privdata' is the send time: the reply of a
+ * timed out PING is ignored.
+ */
+  static void
+_eredis_probe_reply_cb( redisAsyncContext *c, void *vreply, void *privdata )
+{
+  host_t *h = (host_t*) c->data;
+  redisReply *reply = vreply;
+  long long rtt;
+
+  if (! reply || ! h->probe_sent ||
+      (intptr_t)h->probe_sent != (intptr_t)privdata)
+    return;
+
+  rtt = _eredis_now_us() - h->probe_sent;
+  h->probe_sent = 0;
+
+  h->probe_last = rtt;
+  if (! h->probe_srtt) {
+    h->probe_srtt = rtt;
+    h->probe_min  = rtt;
+  }
+  else
+    h->probe_srtt += (rtt - h->probe_srtt) / 8;
+  if (rtt < h->probe_min)
+    h->probe_min = rtt;
+  if (rtt > h->probe_max)
+    h->probe_max = rtt;
+
+  /* Back in time */
+  if (reply->type != REDIS_REPLY_ERROR &&
+      rtt < (long long)h->e->probe_timeout * 1000) {
+    if (H_IS_DEGRADED(h)) {
+      _P_WARN("probe: %s healthy (%lld us)", h->target, rtt);
+      H_UNSET_DEGRADED( h );
+      _eredis_stats_transition( h );
+    }
+    h->probe_fails = 0;
+
+    /* Stable: close to the smoothed latency */
+    if (rtt <= 2 * h->probe_srtt)
+      h->probe_stable ++;
+    else
+      h->probe_stable = 0;
+  }
+  else
+    h->probe_stable = 0;
+}
+
+/*
+ * Connect the probe connection of a host (event loop)
+ */
+  static void
+_eredis_probe_connect( host_t *h )
+{
+  int i;
+  eredis_t *e = h->e;
+  redisAsyncContext *ac;
+
+  ac = (h->port) ?
+    redisAsyncConnect( h->target, h->port )
+    :
+    redisAsyncConnectUnix( h->target );
+
+  if (! ac) {
+    _P_ERR( "probe: connect async %s undef", h->target);
+    return;
+  }
+  if (ac->err) {
+    _P_LOG( "probe: connect async failed %s err:%d", h->target, ac->err);
+    redisAsyncFree( ac );
+    return;
+  }
+
+  h->probe_ctx  = ac;
+  h->probe_sent = 0;
+  ac->data      = h;
+
+  redisLibevAttach( e->loop, ac );
+
+  redisAsyncSetDisconnectCallback( ac, _eredis_probe_disconnect_cb );
+  redisAsyncSetConnectCallback( ac, _eredis_probe_connect_cb );
+
+  /* Post-connect commands first (AUTH...) */
+  for (i=0; i<e->cmds_connect_nb; i++)
+    __redisAsyncCommand( ac, NULL, NULL,
+                         e->cmds_connect[i].s, e->cmds_connect[i].l );
+}
+
+/*
+ * Hung host: drop its connections, reconnected by the connect timer
+ */
+  static void
+_eredis_probe_fail( host_t *h )
+{
+  redisAsyncContext *ac;
+
+  _P_WARN("probe: %s not responding, disconnecting", h->target);
+
+  h->probe_fails = 0;
+
+  /* Disconnect callbacks are only called if connected: unlink */
+  if ((ac = h->probe_ctx)) {
+    redisAsyncFree( ac );
+    _eredis_probe_lost( h );
+  }
+  if ((ac = h->sub_ctx)) {
+    redisAsyncFree( ac );
+    _eredis_sub_lost( h );
+  }
+  if ((ac = h->inval_ctx)) {
+    redisAsyncFree( ac );
+    _eredis_cache_inval_lost( h );
+  }
+  if (h->async_ctx && H_IS_CONNECTED(h))
+    redisAsyncFree( h->async_ctx );
+}
+
+/*
+ * EV probe callback
+ *
+ * EV_TIMER probe_timer
+ */
+  static void
+_eredis_ev_probe_cb (struct ev_loop *loop, ev_timer *w, int revents)
+{
+  int i;
+  long long now;
+  eredis_t *e;
+
+  (void) revents;
+  (void) loop;
+
+  e = (eredis_t*) w->data;
+
+  if (IS_SHUTDOWN(e))
+    return;
+
+  now = _eredis_now_us();
+
+  for (i=0; i<e->hosts_nb; i++) {
+    host_t *h = &e->hosts[i];
+
+    if (! h->probe_ctx) {
+      if (H_IS_CONNECTED(h))
+        _eredis_probe_connect( h );
+      continue;
+    }
+
+    if (h->probe_sent) {
+      /* Still in flight */
+      if (now - h->probe_sent < (long long)e->probe_timeout * 1000)
+        continue;
+
+      /* Timed out: counted once, a new one is sent */
+      h->probe_sent = 0;
+      h->probe_timeouts ++;
+      h->probe_stable = 0;
+      if (! H_IS_DEGRADED(h)) {
+        _P_WARN("probe: %s degraded", h->target);
+        H_SET_DEGRADED( h );
+        _eredis_stats_transition( h );
+      }
+
+      if (++ h->probe_fails >= PROBE_FAIL_AFTER) {
+        _eredis_probe_fail( h );
+        continue;
+      }
+    }
+
+    h->probe_sent = now;
+    h->probes ++;
+    redisAsyncCommand( h->probe_ctx, _eredis_probe_reply_cb,
+                       (void*)(intptr_t)now, "PING" );
+  }
+}
+
+/**
+ * @brief Set active health checks of the hosts
+ *
+ * A PING is sent every 'interval_ms' on a probe connection per host.
+ * Without reply after 'timeout_ms', the host is degraded and avoided
+ * by readers, multiplexed commands and subscriptions, and a new PING
+ * is sent. After PROBE_FAIL_AFTER timed out PINGs in a row (about
+ * PROBE_FAIL_AFTER times the timeout), its connections are dropped.
+ *
+ * Default is 0 (off). Must be called before eredis_run(_thr).
+ *
+ * @param e           eredis
+ * @param interval_ms interval between probes, 0 to disable
+ * @param timeout_ms  probe timeout
+ */
+  void
+eredis_probe( eredis_t *e, int interval_ms, int timeout_ms )
+{
+  e->probe_interval = interval_ms;
+  e->probe_timeout  = timeout_ms;
+}
+
+/**
+ * @brief Host health and latency
+ *
+ * Values are updated by the event loop, read without lock.
+ *
+ * @param e       eredis
+ * @param i       host index (order of addition)
+ * @param health  filled
+ *
+ * @return EREDIS_OK, EREDIS_ERR if no such host
+ */
+  int
+eredis_host_health( eredis_t *e, int i, eredis_host_health_t *health )
+{
+  host_t *h;
+
+  if (i < 0 || i >= e->hosts_nb)
+    return EREDIS_ERR;
+
+  h = &e->hosts[i];
+
+  health->target    = h->target;
+  health->port      = h->port;
+  health->connected = H_IS_CONNECTED(h) ? 1 : 0;
+  health->degraded  = H_IS_DEGRADED(h) ? 1 : 0;
+  health->last_us   = h->probe_last;
+  health->srtt_us   = h->probe_srtt;
+  health->min_us    = h->probe_min;
+  health->max_us    = h->probe_max;
+  health->probes    = h->probes;
+  health->timeouts  = h->probe_timeouts;
+
+  return EREDIS_OK;
+}
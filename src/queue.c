@@ -239,25 +239,50 @@ _eredis_rqueue_release( eredis_reader_t *r )
 {
   eredis_t *e = r->e;
 
-  pthread_mutex_lock( &e->reader_lock );
+  _eredis_reader_lock( e );
 
   _eredis_reader_touch_inlock( e, r );
   r->free  = 1;
 
+  EREDIS_TRACE1( r_release, r );
+
   pthread_cond_signal( &e->reader_cond );
 
   pthread_mutex_unlock( &e->reader_lock );
 }
 
+/*
+ * Deadline (ms, monotonic) to reader_cond clock
+ */
+  static inline void
+_eredis_rqueue_ts( long long deadline, struct timespec *ts )
+{
+  long long left = deadline - _eredis_now_ms();
+
+  if (left < 0)
+    left = 0;
+
+  clock_gettime( EREDIS_COND_CLOCK, ts );
+  ts->tv_sec  += left / 1000;
+  ts->tv_nsec += (left % 1000) * 1000000;
+  if (ts->tv_nsec >= 1000000000) {
+    ts->tv_sec  ++;
+    ts->tv_nsec -= 1000000000;
+  }
+}
+
 /*
  * Get a reader from the queue
+ * Wait for a free one until 'deadline', if any.
  */
   static inline eredis_reader_t *
-_eredis_rqueue_get( eredis_t *e )
+_eredis_rqueue_get( eredis_t *e, long long deadline )
 {
   eredis_reader_t *r = NULL;
+  struct timespec ts;
+  long long t0 = 0;
 
-  pthread_mutex_lock( &e->reader_lock );
+  _eredis_reader_lock( e );
 
   if (e->rqueue.fst && e->rqueue.fst->free) {
     r = e->rqueue.fst;
@@ -265,20 +290,35 @@ _eredis_rqueue_get( eredis_t *e )
   }
 
   if (e->rqueue.nb >= e->reader_max) {
-    while (e->rqueue.fst->free == 0)
-      pthread_cond_wait( &e->reader_cond, &e->reader_lock );
+    if (deadline)
+      _eredis_rqueue_ts( deadline, &ts );
+    if (e->rqueue.fst->free == 0) {
+      EREDIS_TRACE1( r_wait, e->rqueue.nb );
+      t0 = _eredis_now_us();
+    }
+    while (e->rqueue.fst->free == 0) {
+      if (! deadline)
+        pthread_cond_wait( &e->reader_cond, &e->reader_lock );
+      else if (pthread_cond_timedwait( &e->reader_cond, &e->reader_lock,
+                                       &ts ) == ETIMEDOUT &&
+               e->rqueue.fst->free == 0) {
+        _eredis_stats_pool_wait( e, t0 );
+        goto unlock;
+      }
+    }
+    if (t0)
+      _eredis_stats_pool_wait( e, t0 );
     r = e->rqueue.fst;
     goto unlock;
   }
 
   r = _eredis_reader_new( e );
-  if (! r)
-    return NULL;
 
 unlock:
   if (r) {
     r->free = 0;
     _eredis_reader_untouch_inlock( e, r );
+    EREDIS_TRACE2( r_acquire, r, (t0) ? _eredis_now_us() - t0 : 0 );
   }
 
   pthread_mutex_unlock( &e->reader_lock );
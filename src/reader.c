@@ -42,6 +42,267 @@
  * @date 2016-03-29
  */
 
+/*
+ * Reply arena
+ *
+ * Replies of a reader are allocated from its arena via custom hiredis
+ * reply functions, and released in one step with the arena reset.
+ */
+
+/* Chunks kept across resets */
+#define ARENA_KEEP_CHUNKS       4
+
+#define ARENA_ALIGN(l)          (((l) + 7) & ~((size_t)7))
+
+typedef struct arena_chunk_s {
+  struct arena_chunk_s  *next;
+  size_t                size;
+  size_t                used;
+  char                  data[];
+} arena_chunk_t;
+
+typedef struct eredis_arena_s {
+  arena_chunk_t         *fst;
+  arena_chunk_t         *cur;
+  size_t                chunk;
+} eredis_arena_t;
+
+  static void *
+_eredis_arena_alloc( eredis_arena_t *a, size_t l )
+{
+  arena_chunk_t *ch;
+  void *p;
+
+  l = ARENA_ALIGN( l );
+
+  /* Current chunk, or the next one kept from a previous reset */
+  for (ch = a->cur; ch; ch = ch->next)
+    if (ch->used + l <= ch->size)
+      break;
+
+  if (! ch) {
+    size_t size = (l > a->chunk) ? l : a->chunk;
+
+    ch = malloc( sizeof(arena_chunk_t) + size );
+    if (! ch)
+      return NULL;
+    ch->next = NULL;
+    ch->size = size;
+    ch->used = 0;
+
+    if (a->cur) {
+      while (a->cur->next)
+        a->cur = a->cur->next;
+      a->cur->next = ch;
+    }
+    else
+      a->fst = ch;
+  }
+
+  a->cur    = ch;
+  p         = ch->data + ch->used;
+  ch->used += l;
+
+  return p;
+}
+
+  static void
+_eredis_arena_reset( eredis_arena_t *a )
+{
+  int nb = 0;
+  arena_chunk_t *ch, **pch = &a->fst;
+
+  /* Keep a few regular chunks, drop the others */
+  while ((ch = *pch)) {
+    if (nb < ARENA_KEEP_CHUNKS && ch->size == a->chunk) {
+      ch->used = 0;
+      pch = &ch->next;
+      nb ++;
+    }
+    else {
+      *pch = ch->next;
+      free( ch );
+    }
+  }
+
+  a->cur = a->fst;
+}
+
+  static void
+_eredis_arena_free( eredis_arena_t *a )
+{
+  arena_chunk_t *ch;
+
+  while ((ch = a->fst)) {
+    a->fst = ch->next;
+    free( ch );
+  }
+  free( a );
+}
+
+  static redisReply *
+_eredis_arena_reply( const redisReadTask *task, int type )
+{
+  redisReply *reply;
+
+  reply = _eredis_arena_alloc( task->privdata, sizeof(redisReply) );
+  if (! reply)
+    return NULL;
+
+  memset( reply, 0, sizeof(redisReply) );
+  reply->type = type;
+
+  if (task->parent) {
+    redisReply *parent = task->parent->obj;
+    parent->element[ task->idx ] = reply;
+  }
+
+  return reply;
+}
+
+  static void *
+_eredis_arena_string( const redisReadTask *task, char *str, size_t len )
+{
+  redisReply *reply;
+  char *buf;
+
+  buf = _eredis_arena_alloc( task->privdata, len + 1 );
+  if (! buf)
+    return NULL;
+  memcpy( buf, str, len );
+  buf[ len ] = '\0';
+
+  reply = _eredis_arena_reply( task, task->type );
+  if (! reply)
+    return NULL;
+
+  reply->str = buf;
+  reply->len = len;
+
+  return reply;
+}
+
+  static void *
+_eredis_arena_array( const redisReadTask *task, int elements )
+{
+  redisReply *reply;
+  redisReply **element = NULL;
+
+  if (elements > 0) {
+    element = _eredis_arena_alloc( task->privdata,
+                                   elements * sizeof(redisReply*) );
+    if (! element)
+      return NULL;
+    memset( element, 0, elements * sizeof(redisReply*) );
+  }
+
+  reply = _eredis_arena_reply( task, REDIS_REPLY_ARRAY );
+  if (! reply)
+    return NULL;
+
+  reply->element  = element;
+  reply->elements = (elements > 0) ? elements : 0;
+
+  return reply;
+}
+
+  static void *
+_eredis_arena_integer( const redisReadTask *task, long long value )
+{
+  redisReply *reply;
+
+  reply = _eredis_arena_reply( task, REDIS_REPLY_INTEGER );
+  if (reply)
+    reply->integer = value;
+
+  return reply;
+}
+
+  static void *
+_eredis_arena_nil( const redisReadTask *task )
+{
+  return _eredis_arena_reply( task, REDIS_REPLY_NIL );
+}
+
+  static void
+_eredis_arena_free_object( void *reply )
+{
+  /* released by the arena reset */
+  (void) reply;
+}
+
+static redisReplyObjectFunctions _eredis_arena_fn = {
+  _eredis_arena_string,
+  _eredis_arena_array,
+  _eredis_arena_integer,
+  _eredis_arena_nil,
+  _eredis_arena_free_object
+};
+
+/*
+ * Attach the reader arena to a new connection
+ */
+  static inline int
+_eredis_reader_arena( eredis_reader_t *r, redisContext *c )
+{
+  if (! r->arena) {
+    r->arena = calloc( 1, sizeof(eredis_arena_t) );
+    if (! r->arena)
+      return 0;
+    r->arena->chunk = r->e->reader_arena;
+  }
+
+  c->reader->fn       = &_eredis_arena_fn;
+  c->reader->privdata = r->arena;
+
+  return 1;
+}
+
+/*
+ * Drop a reply got from the reader connection
+ */
+  static inline void
+_eredis_reader_drop( eredis_reader_t *r, void *reply )
+{
+  if (reply && ! r->arena)
+    freeReplyObject( reply );
+}
+
+/*
+ * Reader socket, seen by the event loop: not closed while
+ * _eredis_reader_interrupt walks the readers
+ */
+  static inline void
+_eredis_reader_fd( eredis_reader_t *r, int fd )
+{
+  pthread_mutex_lock( &r->e->reader_lock );
+  r->fd = fd;
+  pthread_mutex_unlock( &r->e->reader_lock );
+}
+
+/*
+ * Host lost (event loop): shut down the sockets of its readers,
+ * blocked reads fail at once.
+ */
+  static void
+_eredis_reader_interrupt( host_t *h )
+{
+  eredis_reader_t *r;
+  eredis_t *e = h->e;
+  int i;
+
+  pthread_mutex_lock( &e->reader_lock );
+
+  for (i=0, r=e->rqueue.fst; i<e->rqueue.nb; i++, r=r->next) {
+    if (r->host == h && r->fd >= 0) {
+      _P_LOG("reader interrupted on %s", h->target);
+      shutdown( r->fd, SHUT_RDWR );
+    }
+  }
+
+  pthread_mutex_unlock( &e->reader_lock );
+}
+
   static inline eredis_reader_t *
 _eredis_reader_new( eredis_t *e )
 {
@@ -50,6 +311,7 @@ _eredis_reader_new( eredis_t *e )
   if (r) {
     r->next = r->prev = r;
     r->e    = e;
+    r->fd   = -1;
   }
   return r;
 }
@@ -57,12 +319,22 @@ _eredis_reader_new( eredis_t *e )
   static inline void
 _eredis_reader_free( eredis_reader_t *r )
 {
-  if (r->reply)
+  if (r->reply && ! r->reply_arena)
     freeReplyObject( r->reply );
   if (r->ctx)
     redisFree( r->ctx );
+  if (r->arena)
+    _eredis_arena_free( r->arena );
   if (r->cmds)
     free( r->cmds );
+  if (r->obuf)
+    free( r->obuf );
+  if (r->fbuf)
+    free( r->fbuf );
+  if (r->fargs)
+    free( r->fargs );
+  if (r->views)
+    free( r->views );
   free(r);
 }
 
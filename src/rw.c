@@ -69,7 +69,11 @@ eredis_w_fcmd( eredis_t *e, const char *cmd, size_t len )
 {
   SAN_CMD();
 
+  if (_eredis_hk_sampled( e ))
+    _eredis_hk_add( e, cmd, len, len );
+
   _eredis_wqueue_push( e, (char*)cmd, len );
+  EREDIS_TRACE3( w_enqueue, cmd, len, e->wqueue.nb );
   _eredis_ev_send_trigger( e );
 
   return EREDIS_OK;
@@ -162,27 +166,79 @@ eredis_w_pending( eredis_t *e )
 /*
  * free reader's reply.
  * Obviously the previous processed reply.
+ * With an arena, all replies got so far are released at once.
  */
   static inline void
 _eredis_r_free_reply( eredis_reader_t *r )
 {
   if (r->reply) {
-    freeReplyObject( r->reply );
+    if (! r->reply_arena)
+      freeReplyObject( r->reply );
     r->reply = NULL;
   }
+  if (r->arena)
+    _eredis_arena_reset( r->arena );
+}
+
+/*
+ * Reader socket timeout: what is left before the deadline, or back
+ * to the default one.
+ */
+  static inline void
+_eredis_r_timeout( eredis_reader_t *r, long long left )
+{
+  struct timeval tv = { 0, 0 };
+
+  if (left > 0) {
+    redisSetTimeout( r->ctx, _eredis_ms_tv( left ) );
+    r->timed = 1;
+  }
+  else if (r->timed) {
+#ifdef HOST_TCP_KEEPALIVE
+    if (r->host && r->host->port)
+      tv = r->e->sync_to;
+#endif
+    redisSetTimeout( r->ctx, tv );
+    r->timed = 0;
+  }
+}
+
+/*
+ * Reader host lost by the event loop since connected
+ */
+  static inline int
+_eredis_r_stale( eredis_reader_t *r )
+{
+  return r->host && r->host_gen != r->host->gen;
 }
 
 /*
  * get or disconnect the reader context
  * Manage the reconnection to the prefered host.
+ * Fail fast on an expired deadline.
  */
   static redisContext*
 _eredis_r_ctx( eredis_reader_t *r, int disconnect )
 {
-  int i;
-  host_t *h;
+  long long left = 0;
   eredis_t *e = r->e;
 
+  if (! disconnect && r->deadline &&
+      (left = r->deadline - _eredis_now_ms()) <= 0) {
+    r->err = EREDIS_ERRTIMEOUT;
+    return NULL;
+  }
+  if (! disconnect)
+    r->err = EREDIS_OK;
+
+  /* Host lost by the event loop since connected, and no reply
+   * pending: reconnect now rather than on the next I/O error */
+  if (r->ctx && ! disconnect && _eredis_r_stale( r ) &&
+      r->cmds_requested <= r->cmds_replied) {
+    _P_LOG("reader: %s lost, reconnecting", r->host->target);
+    _eredis_r_ctx( r, 1 );
+  }
+
   /* Got one already connected */
   if (r->ctx)
     goto out;
@@ -191,21 +247,19 @@ _eredis_r_ctx( eredis_reader_t *r, int disconnect )
   if (disconnect)
     goto out;
 
-  /* Check for an active server in async_ctx and connect */
-  if (IS_READY( e )) {
-    for (i=0; i<e->hosts_nb; i++) {
-      h = &e->hosts[i];
-      if (H_IS_CONNECTED(h) && _host_connect( h, r ))
-        goto out;
-    }
-  }
+  /* Check for an active server in async_ctx and connect,
+   * healthy ones first */
+  if (IS_READY( e ) &&
+      (_host_connect_race( r, 0, e->hosts_nb, 2 ) ||
+       _host_connect_race( r, 0, e->hosts_nb, 1 )))
+    goto out;
 
   /* Fallback, try to connect anyway */
-  for (i=0; i<e->hosts_nb; i++) {
-    h = &e->hosts[i];
-    if (_host_connect( h, r ))
-      goto out;
-  }
+  if (_host_connect_race( r, 0, e->hosts_nb, 0 ))
+    goto out;
+
+  r->err = (r->deadline && r->deadline <= _eredis_now_ms()) ?
+    EREDIS_ERRTIMEOUT : EREDIS_ERR;
 
   return NULL;
 
@@ -216,14 +270,45 @@ out:
   _eredis_r_free_reply( r );
 
   if (disconnect) {
+    _eredis_reader_fd( r, -1 );
     redisFree( r->ctx );
-    r->ctx   = NULL;
-    r->host  = NULL;
+    r->ctx        = NULL;
+    r->host       = NULL;
+    r->tracked    = 0;
+    r->track_gen  = 0;
+    r->stream_left = 0;
+    r->timed      = 0;
   }
+  else if (r->deadline || r->timed)
+    _eredis_r_timeout( r, left );
 
   return r->ctx;
 }
 
+/*
+ * Reader failure: drop the connection.
+ * Return 1 if a retry is allowed.
+ */
+  static int
+_eredis_r_failed( eredis_reader_t *r, redisContext *c )
+{
+  int err = c->err;
+  /* Socket timeout from the deadline (ms rounded) */
+  int expired = (r->timed && err == REDIS_ERR_IO &&
+                 (errno == EAGAIN || errno == EWOULDBLOCK));
+
+  _eredis_r_ctx( r, 1 );
+
+  if (expired || (r->deadline && r->deadline <= _eredis_now_ms())) {
+    r->err = EREDIS_ERRTIMEOUT;
+    return 0;
+  }
+
+  r->err = EREDIS_ERR;
+
+  return (err == REDIS_ERR_IO || err == REDIS_ERR_EOF);
+}
+
 /*
  * get one reader
  */
@@ -240,27 +325,91 @@ out:
   eredis_reader_t *
 eredis_r( eredis_t *e )
 {
-  return _eredis_rqueue_get( e );
+  eredis_reader_t *r;
+
+  r = _eredis_rqueue_get( e, 0 );
+
+  /* Host lost while in the queue */
+  if (r && r->ctx && _eredis_r_stale( r ))
+    _eredis_r_ctx( r, 1 );
+
+  return r;
 }
 
-/*
- * Add one cmd in reader
+/**
+ * @brief Deadline from now
+ *
+ * @param timeout_ms  timeout in ms
+ *
+ * @return deadline for eredis_r_timed and eredis_r_deadline
  */
-  static inline int
-_eredis_r_add( eredis_reader_t *r, char *s, int l )
+  long long
+eredis_deadline( int timeout_ms )
 {
-  cmd_t *cmd;
+  return _eredis_now_ms() + timeout_ms;
+}
 
-  if (r->cmds_nb>=r->cmds_alloc) {
-    r->cmds_alloc += 8;
-    r->cmds = realloc( r->cmds, sizeof(cmd_t) * r->cmds_alloc );
+/**
+ * @brief eredis reader pop, with a deadline
+ *
+ * Fail if no reader is free before the deadline.
+ * The deadline is kept by the reader for its commands
+ * (see eredis_r_deadline).
+ *
+ * @param e         eredis
+ * @param deadline  from eredis_deadline, 0: none
+ *
+ * @return eredis reader, NULL on timeout
+ */
+  eredis_reader_t *
+eredis_r_timed( eredis_t *e, long long deadline )
+{
+  eredis_reader_t *r;
+
+  if (deadline && deadline <= _eredis_now_ms())
+    return NULL;
+
+  r = _eredis_rqueue_get( e, deadline );
+  if (r) {
+    r->deadline = deadline;
+    /* Host lost while in the queue */
+    if (r->ctx && _eredis_r_stale( r ))
+      _eredis_r_ctx( r, 1 );
   }
 
-  cmd = &r->cmds[ r->cmds_nb ++ ];
-  cmd->s = s;
-  cmd->l = l;
+  return r;
+}
 
-  return EREDIS_OK;
+/**
+ * @brief eredis reader deadline
+ *
+ * Connect, send and receive of the next replies must be done before
+ * the deadline. Replies then fail fast with eredis_r_error returning
+ * EREDIS_ERRTIMEOUT.
+ * An expired request drops the connection (reply still in flight).
+ *
+ * Reset on release.
+ *
+ * @param r         eredis reader
+ * @param deadline  from eredis_deadline, 0: none
+ */
+  void
+eredis_r_deadline( eredis_reader_t *r, long long deadline )
+{
+  r->deadline = deadline;
+}
+
+/**
+ * @brief eredis reader error of the last failed reply
+ *
+ * @param r         eredis reader
+ *
+ * @return EREDIS_OK, EREDIS_ERR, EREDIS_ERRTIMEOUT
+ */
+  int
+eredis_r_error( eredis_reader_t *r )
+{
+  return r->err;
 }
 
 /**
@@ -277,16 +426,68 @@ eredis_r_clear( eredis_reader_t *r )
 {
   int i;
 
-  for (i=r->cmds_replied; i<r->cmds_nb; i++)
-    if (eredis_r_reply( r ) != EREDIS_OK)
-      break;
+  /* Unfinished stream */
+  eredis_r_stream_end( r );
 
-  for (i=0; i<r->cmds_nb; i++)
-    free(r->cmds[i].s);
+  /* Replies in flight */
+  if (r->cmds_requested) {
+    for (i=r->cmds_replied; i<r->cmds_nb; i++)
+      if (! eredis_r_reply( r )) {
+        _eredis_r_ctx( r, 1 );
+        break;
+      }
+  }
+
+  /* Multiplexed replies not taken */
+  if (r->mux_fst)
+    _eredis_mux_abandon( r );
+
+  _eredis_r_obuf_clear( r );
 
   r->cmds_nb = r->cmds_requested = r->cmds_replied = 0;
 }
 
+/*
+ * Reader allowed back to the prefered host 'h':
+ * stable probes if asked, and a credit of migrate_rate per second.
+ */
+  static int
+_eredis_r_migrate_ok( eredis_t *e, host_t *h )
+{
+  long long now, burst;
+  int ok = 0;
+
+  pthread_mutex_lock( &e->reader_lock );
+
+  if (e->probe_interval && h->probe_stable < e->migrate_stable)
+    ok = 0;
+  else if (! e->migrate_rate)
+    ok = 1;
+  else {
+    now   = _eredis_now_ms();
+    burst = (long long)e->migrate_rate * 1000;
+
+    e->migrate_credit += (now - e->migrate_ts) * e->migrate_rate;
+    e->migrate_ts      = now;
+    if (e->migrate_credit > burst)
+      e->migrate_credit = burst;
+
+    if (e->migrate_credit >= 1000) {
+      e->migrate_credit -= 1000;
+      ok = 1;
+    }
+  }
+
+  if (ok)
+    e->migrated ++;
+  else
+    e->migrate_deferred ++;
+
+  pthread_mutex_unlock( &e->reader_lock );
+
+  return ok;
+}
+
 /**
  * @brief eredis reader release
  *
@@ -302,18 +503,49 @@ eredis_r_release( eredis_reader_t *r )
   /* Clear */
   eredis_r_clear( r );
 
-  /* Disconnect if the prefered host is available.
+  r->deadline = 0;
+
+  /* Disconnect if the prefered host is available (rate limited),
+   * or if its host is degraded.
    * Flag is triggered by event loop */
   if ((h = &r->e->hosts[0]) &&
       r->host &&
       r->host != h &&
-      H_IS_CONNECTED(h))
+      H_IS_HEALTHY(h) &&
+      _eredis_r_migrate_ok( r->e, h ))
+    _eredis_r_ctx( r, 1 );
+  else if (r->host && H_IS_DEGRADED(r->host))
     _eredis_r_ctx( r, 1 );
 
   /* Release in queue */
   _eredis_rqueue_release( r );
 }
 
+/**
+ * @brief Reader migration counters (see eredis_r_migrate)
+ *
+ * @param e   eredis
+ * @param st  counters to fill
+ */
+  void
+eredis_r_migrate_stats( eredis_t *e, eredis_migrate_stats_t *st )
+{
+  eredis_reader_t *r;
+  int i;
+
+  pthread_mutex_lock( &e->reader_lock );
+
+  st->migrated  = e->migrated;
+  st->deferred  = e->migrate_deferred;
+  st->away      = 0;
+
+  for (i=0, r=e->rqueue.fst; i<e->rqueue.nb; i++, r=r->next)
+    if (r->host && r->host != &e->hosts[0])
+      st->away ++;
+
+  pthread_mutex_unlock( &e->reader_lock );
+}
+
 /**
  * @brief eredis read append formatted command (pipelining)
  *
@@ -328,9 +560,16 @@ eredis_r_release( eredis_reader_t *r )
   int
 eredis_r_append_fcmd( eredis_reader_t *r, const char *cmd, size_t len )
 {
+  int ret;
+
   SAN_CMD();
 
-  return _eredis_r_add( r, (char*)cmd, len );
+  /* Copied in the reader output buffer */
+  ret = _eredis_r_fcmd( r, cmd, len );
+  if (ret == EREDIS_OK)
+    free( (char*)cmd );
+
+  return ret;
 }
 
 /**
@@ -345,14 +584,10 @@ eredis_r_append_fcmd( eredis_reader_t *r, const char *cmd, size_t len )
   int
 eredis_r_append_vcmd( eredis_reader_t *r, const char *format, va_list ap )
 {
-  int len;
-  char *cmd = NULL;
+  if (! format)
+    return EREDIS_ERRCMD;
 
-  len = redisvFormatCommand( &cmd, format, ap );
-
-  SAN_CMD_FREE();
-
-  return _eredis_r_add( r, cmd, len );
+  return _eredis_r_vformat( r, format, ap );
 }
 
 /**
@@ -391,13 +626,10 @@ eredis_r_append_cmd( eredis_reader_t *r, const char *format, ... )
 eredis_r_append_cmdargv( eredis_reader_t *r,
                          int argc, const char **argv, const size_t *argvlen)
 {
-  size_t len;
-  char *cmd = NULL;
-
-  len = redisFormatCommandArgv(&cmd,argc,argv,argvlen);
-  SAN_CMD_FREE();
+  if (! argv)
+    return EREDIS_ERRCMD;
 
-  return eredis_r_append_fcmd( r, cmd, len );
+  return _eredis_r_argv( r, argc, argv, argvlen );
 }
 
 /* with reply */
@@ -408,39 +640,31 @@ eredis_r_append_cmdargv( eredis_reader_t *r,
   static inline int
 _eredis_r_send( eredis_reader_t *r, redisContext **pc )
 {
-  int i;
   redisContext *c;
 
   if (!(c = _eredis_r_ctx(r, 0)))
     return EREDIS_ERR;
 
   *pc = c;
-  for (i=r->cmds_requested; i<r->cmds_nb; i++)
-    redisAppendFormattedCommand( c, r->cmds[i].s, r->cmds[i].l );
+
+  /* From the output buffer to the socket */
+  if (r->cmds_requested < r->cmds_nb &&
+      _eredis_r_write( r, c, r->cmds_requested ) != EREDIS_OK)
+    return EREDIS_OK; /* failure in c->err: handled by the reply */
 
   return EREDIS_OK;
 }
 
-/**
- * @brief eredis reader reply
- *
- * @param r     eredis reader
- *
- * @return reply (redisReply)
+/*
+ * eredis reader reply - send pending commands and get one reply
  */
-  eredis_reply_t *
-eredis_r_reply( eredis_reader_t *r )
+  static eredis_reply_t *
+_eredis_r_reply( eredis_reader_t *r )
 {
   redisContext *c;
   eredis_reply_t *reply;
   int retry, err;
-
-  if (r->cmds_replied >= r->cmds_nb) {
-    fprintf(stderr,
-            "eredis: api misuse: all cmds are already replied: %d/%d\n",
-            r->cmds_replied, r->cmds_nb);
-    return NULL;
-  }
+  long long us;
 
   /* Retry allowed if already connected */
   retry = (r->ctx) ? r->e->reader_retry : 0;
@@ -451,30 +675,39 @@ eredis_r_reply( eredis_reader_t *r )
     if (_eredis_r_send( r, &c ) == EREDIS_ERR)
       break;
 
+    EREDIS_TRACE3( r_reply_start, r, EREDIS_TRACE_HOST(r->host),
+                   r->cmds_nb - r->cmds_replied );
+
+    us  = _eredis_now_us();
     err = redisGetReply( c, (void**)&reply );
+    us  = _eredis_now_us() - us;
+
+    _eredis_stats_reply( r, us, (err != EREDIS_OK ||
+                                 reply->type == REDIS_REPLY_ERROR) );
+
+    EREDIS_TRACE4( r_reply_end, r, EREDIS_TRACE_HOST(r->host), err, us );
 
     if (err == EREDIS_OK) {
       /* Good */
+      if (r->e->slowlog_us && us >= r->e->slowlog_us)
+        _eredis_slowlog_r( r, us, reply, r->cmds_replied );
+      if (_eredis_hk_sampled( r->e ))
+        _eredis_hk_r( r, reply, r->cmds_replied );
       /* Pipelining - we consider all cmds are well requested */
       r->cmds_requested = r->cmds_nb;
-      /* Previous to clean? */
-      _eredis_r_free_reply( r );
-      /* New reply */
-      r->reply = reply;
+      /* New reply - previous one released by _eredis_r_send */
+      r->reply        = reply;
+      r->reply_arena  = (r->arena != NULL);
       /* Mark it as replied */
       r->cmds_replied ++;
       break;
     }
 
     /* Bad */
-    if (reply)
-      freeReplyObject( reply );
-
-    err = c->err;
-    _eredis_r_ctx(r, 1);
+    _eredis_reader_drop( r, reply );
 
     /* retry? */
-    if (err != REDIS_ERR_IO && err != REDIS_ERR_EOF)
+    if (! _eredis_r_failed( r, c ))
       break;
 
   } while ( retry -- >0 );
@@ -482,6 +715,200 @@ eredis_r_reply( eredis_reader_t *r )
   return reply;
 }
 
+/*
+ * eredis reader reply - multiplexed on the event loop connections
+ */
+  static eredis_reply_t *
+_eredis_r_reply_mux( eredis_reader_t *r )
+{
+  redisReply *reply;
+
+  _eredis_r_free_reply( r );
+
+  /* Denied ones wait for the batches in flight (reader connection) */
+  if (r->cmds_requested < r->cmds_nb &&
+      _eredis_mux_allowed( r ) &&
+      _eredis_mux_send( r ) != EREDIS_OK) {
+    r->err = EREDIS_ERR;
+    goto drop;
+  }
+
+  r->err = _eredis_mux_get( r, &reply );
+  if (r->err == EREDIS_ERRTIMEOUT)
+    goto drop;
+
+  r->reply        = reply;
+  r->reply_arena  = 0;
+  r->cmds_replied ++;
+
+  return reply;
+
+drop:
+  /* Not sent or timed out: all pending commands fail */
+  _eredis_mux_abandon( r );
+  r->cmds_requested = r->cmds_replied = r->cmds_nb;
+  return NULL;
+}
+
+/*
+ * Reader - enable tracking on its connection, redirected to the
+ * invalidation connection of its host.
+ * Return 1 if the reader is tracked.
+ */
+  static int
+_eredis_cache_r_track( eredis_reader_t *r )
+{
+  int i, argc, gen, err;
+  long long id;
+  char sid[32];
+  eredis_cache_t *ec = r->e->cache;
+  redisReply *reply;
+  const char *argv[ 6 + 2 * ec->prefixes_nb ];
+
+  id  = r->host->inval_id;
+  gen = r->host->inval_gen;
+
+  if (! id)
+    return 0;
+
+  if (r->track_gen == gen)
+    return r->tracked;
+
+  snprintf( sid, sizeof(sid), "%lld", id );
+
+  argc = 0;
+  argv[ argc++ ] = "CLIENT";
+  argv[ argc++ ] = "TRACKING";
+  argv[ argc++ ] = "on";
+  argv[ argc++ ] = "REDIRECT";
+  argv[ argc++ ] = sid;
+  if (ec->flags & EREDIS_CACHE_BCAST) {
+    argv[ argc++ ] = "BCAST";
+    for (i=0; i<ec->prefixes_nb; i++) {
+      argv[ argc++ ] = "PREFIX";
+      argv[ argc++ ] = ec->prefixes[i];
+    }
+  }
+
+  /* Switching redirection needs tracking off first */
+  redisAppendCommand( r->ctx, "CLIENT TRACKING off" );
+  redisAppendCommandArgv( r->ctx, argc, argv, NULL );
+
+  r->tracked    = 0;
+  r->track_gen  = gen;
+
+  for (i=0; i<2; i++) {
+    reply = NULL;
+    err = redisGetReply( r->ctx, (void**)&reply );
+    if (err != EREDIS_OK) {
+      _eredis_reader_drop( r, reply );
+      _eredis_r_ctx( r, 1 );
+      return 0;
+    }
+    if (i == 1 && reply->type == REDIS_REPLY_STATUS)
+      r->tracked = 1;
+    _eredis_reader_drop( r, reply );
+  }
+
+  if (! r->tracked)
+    _P_WARN("cache: CLIENT TRACKING refused by %s", r->host->target);
+
+  return r->tracked;
+}
+
+  static inline int
+_eredis_cache_r_tracked( eredis_reader_t *r )
+{
+  return
+    r->ctx && r->tracked &&
+    r->host->inval_id &&
+    r->track_gen == r->host->inval_gen;
+}
+
+/*
+ * Lone command in reader: try the client-side cache first
+ */
+  static eredis_reply_t *
+_eredis_r_reply_cached( eredis_reader_t *r )
+{
+  eredis_cache_t *ec = r->e->cache;
+  rcmd_t *cmd = &r->cmds[ r->cmds_replied ];
+  eredis_reply_t *reply;
+  const char *k;
+  size_t kl;
+  uint64_t hash;
+  unsigned int seq;
+  int tracked;
+
+  if (! _eredis_cache_cmd_key( ec, r->obuf + cmd->off, cmd->l, &k, &kl ))
+    return _eredis_r_reply( r );
+
+  hash  = _eredis_hash( k, kl );
+  reply = _eredis_cache_get( ec, hash, k, kl, r->obuf + cmd->off, cmd->l, &seq );
+  if (reply) {
+    /* Hit - never sent */
+    _eredis_r_free_reply( r );
+    r->reply        = reply;
+    r->reply_arena  = 0;
+    r->cmds_requested = r->cmds_nb;
+    r->cmds_replied ++;
+    return reply;
+  }
+
+  /* Miss - fill only from a tracked connection */
+  tracked = (_eredis_r_ctx( r, 0 ) && _eredis_cache_r_track( r ));
+
+  reply = _eredis_r_reply( r );
+
+  if (reply
+      &&
+      reply->type != REDIS_REPLY_ERROR
+      &&
+      tracked
+      &&
+      _eredis_cache_r_tracked( r ))
+    _eredis_cache_set( ec, hash, k, kl, r->obuf + cmd->off, cmd->l, reply, seq );
+
+  return reply;
+}
+
+/**
+ * @brief eredis reader reply
+ *
+ * @param r     eredis reader
+ *
+ * @return reply (redisReply)
+ */
+  eredis_reply_t *
+eredis_r_reply( eredis_reader_t *r )
+{
+  if (r->cmds_replied >= r->cmds_nb) {
+    fprintf(stderr,
+            "eredis: api misuse: all cmds are already replied: %d/%d\n",
+            r->cmds_replied, r->cmds_nb);
+    return NULL;
+  }
+
+  /* Multiplexed on the event loop connections: batches in flight,
+   * new commands unless stateful or blocking */
+  if (r->e->mux
+      &&
+      (r->mux_fst
+       ||
+       (r->cmds_requested < r->cmds_nb && _eredis_mux_allowed( r ))))
+    return _eredis_r_reply_mux( r );
+
+  /* Client-side cache: nothing in flight and a lone command */
+  if (r->e->cache
+      &&
+      r->cmds_requested == r->cmds_replied
+      &&
+      r->cmds_replied == r->cmds_nb - 1)
+    return _eredis_r_reply_cached( r );
+
+  return _eredis_r_reply( r );
+}
+
 /**
  * @brief reader subscribe and read
  *  Need at least one appended SUBSCRIBE/PSUBSCRIBED cmd
@@ -520,10 +947,8 @@ eredis_r_subscribe( eredis_reader_t *r )
         if (err != EREDIS_OK)
           goto reconnect;
 
-        if (reply) {
-          freeReplyObject( reply );
-          reply = NULL;
-        }
+        _eredis_reader_drop( r, reply );
+        reply = NULL;
 
         r->cmds_replied ++;
       } while (r->cmds_replied < r->cmds_nb);
@@ -536,28 +961,24 @@ eredis_r_subscribe( eredis_reader_t *r )
 
     if (err == EREDIS_OK) {
       /* Good */
-      /* Previous to clean? */
-      _eredis_r_free_reply( r );
-      /* New reply */
-      r->reply = reply;
+      /* New reply - previous one released by _eredis_r_send */
+      r->reply        = reply;
+      r->reply_arena  = (r->arena != NULL);
       break;
     }
 
 reconnect:
     /* Bad */
-    if (reply) {
-      freeReplyObject( reply );
-      reply = NULL;
-    }
+    _eredis_reader_drop( r, reply );
+    reply = NULL;
 
-    err = c->err;
-    _eredis_r_ctx(r, 1);
+    err = _eredis_r_failed( r, c );
 
     /* Reset cmds_requested to ensure re-subscribe */
     r->cmds_requested = r->cmds_replied = 0;
 
     /* retry? */
-    if (err != REDIS_ERR_IO && err != REDIS_ERR_EOF)
+    if (! err)
       break;
 
   } while ( retry -- >0 );
@@ -589,6 +1010,10 @@ eredis_r_reply_detach( eredis_reader_t *r )
   reply     = r->reply;
   r->reply  = NULL;
 
+  /* Out of the arena: deep copy (arena released on next reply) */
+  if (reply && r->reply_arena)
+    reply = _eredis_reply_dup( reply );
+
   return reply;
 }
 
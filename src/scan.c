@@ -0,0 +1,578 @@
+/*
+ * Copyright (c) 2016 by Eulerian Technologies SAS
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials
+ *   provided with the distribution.
+ *
+ * * Neither the name of Eulerian Technologies nor the names of its
+ *   contributors may be used to endorse or promote products
+ *   derived from this software without specific prior written
+ *   permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/**
+ * @file scan.c
+ * @brief ERedis SCAN iterator
+ *
+ * SCAN, HSCAN, SSCAN and ZSCAN iterations with pipelined follow-up
+ * commands per key (TTL, TYPE, MEMORY USAGE..).
+ *
+ * Each round, a worker sends in one pipeline the next SCAN of each
+ * of its cursors and the follow-up commands of the keys got at the
+ * previous round.
+ *
+ * Cursors: one per MATCH pattern (partition). Partitions are spread
+ * over worker threads, each one with its own reader, optionally bound
+ * to one of the mirrored hosts.
+ */
+
+/* Max follow-up commands per key */
+#define SCAN_MAX_FOLLOW         8
+
+/* Max words in one follow-up command (key appended) */
+#define SCAN_MAX_FOLLOW_ARGS    8
+
+/* Default SCAN COUNT */
+#define SCAN_DEFAULT_COUNT      1000
+
+typedef struct scan_follow_s {
+  int       argc;
+  char      *argv[ SCAN_MAX_FOLLOW_ARGS ];
+  size_t    argvlen[ SCAN_MAX_FOLLOW_ARGS ];
+} scan_follow_t;
+
+typedef struct scan_part_s {
+  char            cursor[ 32 ];
+  char            *match;
+  int             done;
+  eredis_reply_t  *keys;              /* SCAN reply, follow-ups to get */
+  eredis_reply_t  *next;              /* SCAN reply of this round */
+} scan_part_t;
+
+struct eredis_scan_s {
+  eredis_t        *e;
+  char            *cmd;               /* SCAN, HSCAN, SSCAN, ZSCAN */
+  char            *key;               /* HSCAN, SSCAN, ZSCAN */
+  int             count;
+  int             mirrors;
+
+  scan_part_t     *parts;
+  int             parts_nb;
+
+  scan_follow_t   follow[ SCAN_MAX_FOLLOW ];
+  int             follow_nb;
+
+  eredis_scan_cb  cb;
+  void            *data;
+  volatile int    stop;
+};
+
+typedef struct scan_worker_s {
+  eredis_scan_t   *s;
+  int             id;
+  int             nb;                 /* number of workers */
+  pthread_t       thr;
+  long long       keys;
+  int             err;
+} scan_worker_t;
+
+/**
+ * @brief Create a SCAN iterator
+ *
+ * @param e     eredis
+ * @param cmd   "SCAN", "HSCAN", "SSCAN" or "ZSCAN"
+ * @param key   key to iterate for HSCAN, SSCAN, ZSCAN - NULL for SCAN
+ *
+ * @return iterator, NULL on error
+ */
+  eredis_scan_t *
+eredis_scan_new( eredis_t *e, const char *cmd, const char *key )
+{
+  eredis_scan_t *s;
+  int with_key;
+
+  if (! strcasecmp( cmd, "SCAN" ))
+    with_key = 0;
+  else if (! strcasecmp( cmd, "HSCAN" ) ||
+           ! strcasecmp( cmd, "SSCAN" ) ||
+           ! strcasecmp( cmd, "ZSCAN" ))
+    with_key = 1;
+  else
+    return NULL;
+
+  if (with_key != (key != NULL))
+    return NULL;
+
+  s = calloc( 1, sizeof(eredis_scan_t) );
+  if (! s)
+    return NULL;
+
+  s->e      = e;
+  s->cmd    = strdup( cmd );
+  s->key    = key ? strdup( key ) : NULL;
+  s->count  = SCAN_DEFAULT_COUNT;
+
+  return s;
+}
+
+/**
+ * @brief SCAN iterator MATCH pattern
+ *
+ * Each pattern is one partition with its own cursor. Partitions are
+ * iterated in parallel.
+ * Each one is a full iteration for the server (MATCH filters after),
+ * worth to spread over mirrored hosts (see eredis_scan_mirrors).
+ *
+ * @param s       iterator
+ * @param pattern MATCH pattern
+ *
+ * @return EREDIS_OK, EREDIS_ERR
+ */
+  int
+eredis_scan_match( eredis_scan_t *s, const char *pattern )
+{
+  scan_part_t *parts;
+
+  if (! pattern)
+    return EREDIS_ERR;
+
+  parts = realloc( s->parts, sizeof(scan_part_t) * (s->parts_nb + 1) );
+  if (! parts)
+    return EREDIS_ERR;
+  s->parts = parts;
+
+  memset( &parts[ s->parts_nb ], 0, sizeof(scan_part_t) );
+  parts[ s->parts_nb ++ ].match = strdup( pattern );
+
+  return EREDIS_OK;
+}
+
+/**
+ * @brief SCAN iterator COUNT hint - default 1000
+ *
+ * @param s       iterator
+ * @param count   COUNT
+ */
+  void
+eredis_scan_count( eredis_scan_t *s, int count )
+{
+  if (count > 0)
+    s->count = count;
+}
+
+/**
+ * @brief SCAN iterator: use one mirrored host per worker thread
+ *
+ * @param s       iterator
+ * @param on      0 or 1
+ */
+  void
+eredis_scan_mirrors( eredis_scan_t *s, int on )
+{
+  s->mirrors = on;
+}
+
+/**
+ * @brief SCAN iterator follow-up command, per key
+ *
+ * The key (or field, member) is appended as last argument:
+ * "TTL", "TYPE", "MEMORY USAGE", "UNLINK"...
+ * Replies are given to the callback, in the order of declaration.
+ *
+ * Follow-up writes only reach the reader's host. For mirrors, use
+ * eredis_w_cmd in the callback.
+ *
+ * @param s       iterator
+ * @param cmd     command words, separated by spaces
+ *
+ * @return EREDIS_OK, EREDIS_ERR
+ */
+  int
+eredis_scan_follow( eredis_scan_t *s, const char *cmd )
+{
+  scan_follow_t *f;
+  char *dup, *w, *save = NULL;
+
+  if (s->follow_nb >= SCAN_MAX_FOLLOW)
+    return EREDIS_ERR;
+
+  f = &s->follow[ s->follow_nb ];
+  memset( f, 0, sizeof(scan_follow_t) );
+
+  dup = strdup( cmd );
+  for (w = strtok_r( dup, " ", &save ); w; w = strtok_r( NULL, " ", &save )) {
+    if (f->argc >= SCAN_MAX_FOLLOW_ARGS)
+      break;
+    f->argvlen[ f->argc ] = strlen( w );
+    f->argv[ f->argc ++ ] = strdup( w );
+  }
+  free( dup );
+
+  if (! f->argc || w) {
+    while (f->argc)
+      free( f->argv[ -- f->argc ] );
+    return EREDIS_ERR;
+  }
+
+  s->follow_nb ++;
+
+  return EREDIS_OK;
+}
+
+/*
+ * Cursors to start, replies left by a stopped iteration
+ */
+  static void
+_eredis_scan_reset( eredis_scan_t *s )
+{
+  int i;
+
+  for (i=0; i<s->parts_nb; i++) {
+    scan_part_t *p = &s->parts[i];
+    if (p->keys)
+      eredis_reply_free( p->keys );
+    if (p->next)
+      eredis_reply_free( p->next );
+    p->keys = p->next = NULL;
+    p->done = 0;
+    strcpy( p->cursor, "0" );
+  }
+}
+
+/**
+ * @brief Release a SCAN iterator
+ *
+ * @param s       iterator
+ */
+  void
+eredis_scan_free( eredis_scan_t *s )
+{
+  int i, j;
+
+  _eredis_scan_reset( s );
+
+  for (i=0; i<s->parts_nb; i++)
+    free( s->parts[i].match );
+  free( s->parts );
+
+  for (i=0; i<s->follow_nb; i++)
+    for (j=0; j<s->follow[i].argc; j++)
+      free( s->follow[i].argv[j] );
+
+  free( s->key );
+  free( s->cmd );
+  free( s );
+}
+
+/*
+ * Append the next SCAN of one partition
+ */
+  static int
+_eredis_scan_append( eredis_scan_t *s, eredis_reader_t *r, scan_part_t *p )
+{
+  const char *argv[ 7 ];
+  size_t argvlen[ 7 ];
+  char count[ 16 ];
+  int argc = 0;
+
+#define SCAN_ARG( str ) do {                  \
+    argv[ argc ]    = (str);                  \
+    argvlen[ argc ] = strlen( argv[ argc ] ); \
+    argc ++;                                  \
+  } while (0)
+
+  SCAN_ARG( s->cmd );
+  if (s->key)
+    SCAN_ARG( s->key );
+  SCAN_ARG( p->cursor );
+  if (p->match) {
+    SCAN_ARG( "MATCH" );
+    SCAN_ARG( p->match );
+  }
+  snprintf( count, sizeof(count), "%d", s->count );
+  SCAN_ARG( "COUNT" );
+  SCAN_ARG( count );
+
+#undef SCAN_ARG
+
+  return eredis_r_append_cmdargv( r, argc, argv, argvlen );
+}
+
+/*
+ * Keys of a SCAN reply: [cursor, [k1, k2..]]
+ */
+  static inline eredis_reply_t *
+_eredis_scan_keys( eredis_reply_t *reply )
+{
+  if (! reply ||
+      reply->type != REDIS_REPLY_ARRAY ||
+      reply->elements != 2 ||
+      reply->element[0]->type != REDIS_REPLY_STRING ||
+      reply->element[1]->type != REDIS_REPLY_ARRAY)
+    return NULL;
+
+  return reply->element[1];
+}
+
+/*
+ * Use the host 'i' (modulo) for this reader, if connected
+ */
+  static void
+_eredis_scan_bind( eredis_reader_t *r, int i )
+{
+  eredis_t *e = r->e;
+  host_t *h;
+
+  if (! e->hosts_nb)
+    return;
+
+  i %= e->hosts_nb;
+  h = &e->hosts[ i ];
+  if (r->host == h || ! H_IS_CONNECTED(h))
+    return;
+
+  _eredis_r_ctx( r, 1 );
+  _host_connect_race( r, i, i + 1, 0 );
+}
+
+/*
+ * Keys of a SCAN reply, follow-up replies and callback.
+ * Return 0 to stop.
+ */
+  static int
+_eredis_scan_process( eredis_scan_t *s, eredis_reader_t *r,
+                      eredis_reply_t *keys, int step, long long *nb )
+{
+  eredis_reply_t *follow[ SCAN_MAX_FOLLOW ], *val;
+  size_t k;
+  int f, ret = 1;
+
+  for (k=0; k<keys->elements; k+=step) {
+    /* Replies are detached: one at a time in reader */
+    for (f=0; f<s->follow_nb; f++) {
+      if (! eredis_r_reply( r ))
+        break;
+      follow[f] = eredis_r_reply_detach( r );
+    }
+
+    if (f == s->follow_nb) {
+      val = (step == 2 && k + 1 < keys->elements) ? keys->element[k+1] : NULL;
+      (*nb) ++;
+      if (s->cb( keys->element[k], val, follow, s->data ))
+        s->stop = 1;
+    }
+    else {
+      ret = 0;
+    }
+
+    while (f --)
+      eredis_reply_free( follow[f] );
+
+    if (! ret || s->stop)
+      return 0;
+  }
+
+  return ret;
+}
+
+/*
+ * Worker: partitions id, id+nb, id+2nb..
+ */
+  static void *
+_eredis_scan_worker( void *arg )
+{
+  scan_worker_t *w = arg;
+  eredis_scan_t *s = w->s;
+  eredis_reader_t *r;
+  eredis_reply_t *reply, *keys, *key;
+  scan_part_t *p;
+  const char *argv[ SCAN_MAX_FOLLOW_ARGS + 1 ];
+  size_t argvlen[ SCAN_MAX_FOLLOW_ARGS + 1 ], k;
+  int i, f, step, sent, pending;
+
+  /* HSCAN, ZSCAN: field value, member score */
+  step = (! strcasecmp( s->cmd, "HSCAN" ) ||
+          ! strcasecmp( s->cmd, "ZSCAN" )) ? 2 : 1;
+
+  r = eredis_r( s->e );
+  if (s->mirrors)
+    _eredis_scan_bind( r, w->id );
+
+  while (! s->stop) {
+    /* One pipeline: next cursors, then follow-ups of previous keys */
+    sent = pending = 0;
+    for (i=w->id; i<s->parts_nb; i+=w->nb) {
+      p = &s->parts[i];
+      if (! p->done) {
+        if (_eredis_scan_append( s, r, p ) != EREDIS_OK)
+          goto err;
+        sent ++;
+      }
+      if (! p->keys)
+        continue;
+      pending ++;
+      keys = p->keys->element[1];
+      for (k=0; k<keys->elements; k+=step) {
+        key = keys->element[k];
+        for (f=0; f<s->follow_nb; f++) {
+          /* Shared by workers: key appended in a local copy */
+          scan_follow_t *fl = &s->follow[f];
+          memcpy( argv, fl->argv, sizeof(char*) * fl->argc );
+          memcpy( argvlen, fl->argvlen, sizeof(size_t) * fl->argc );
+          argv[ fl->argc ]    = key->str;
+          argvlen[ fl->argc ] = key->len;
+          if (eredis_r_append_cmdargv( r, fl->argc + 1,
+                                       argv, argvlen ) != EREDIS_OK)
+            goto err;
+        }
+      }
+    }
+
+    if (! sent && ! pending)
+      break;
+
+    /* Replies, in the same order */
+    for (i=w->id; i<s->parts_nb; i+=w->nb) {
+      p = &s->parts[i];
+      if (! p->done) {
+        if (! eredis_r_reply( r ))
+          goto err;
+        reply = eredis_r_reply_detach( r );
+        if (! _eredis_scan_keys( reply )) {
+          _P_ERR("scan: not compliant reply to %s", s->cmd);
+          eredis_reply_free( reply );
+          goto err;
+        }
+        snprintf( p->cursor, sizeof(p->cursor), "%s",
+                  reply->element[0]->str );
+        if (! strcmp( p->cursor, "0" ))
+          p->done = 1;
+        p->next = reply;
+      }
+      if (p->keys) {
+        if (! _eredis_scan_process( s, r, p->keys->element[1], step,
+                                    &w->keys ) && ! s->stop)
+          goto err;
+        eredis_reply_free( p->keys );
+        p->keys = NULL;
+      }
+      if (s->stop)
+        break;
+      p->keys = p->next;
+      p->next = NULL;
+    }
+
+    /* Got all replies, or stopped: drain */
+    eredis_r_clear( r );
+  }
+
+  eredis_r_release( r );
+  return NULL;
+
+err:
+  w->err  = 1;
+  s->stop = 1;
+  eredis_r_release( r );
+  return NULL;
+}
+
+/**
+ * @brief Run a SCAN iteration
+ *
+ * The callback is called once per key (HSCAN: field and value,
+ * ZSCAN: member and score, SSCAN: member) with the follow-up replies.
+ * With threads, it is called concurrently and must be thread-safe.
+ * Replies are released after the call.
+ *
+ * A key can be returned more than once (SCAN guarantee).
+ *
+ * @param s       iterator
+ * @param threads number of worker threads, one reader each (0: 1)
+ * @param cb      callback, returns non-zero to stop the iteration
+ * @param data    callback data
+ *
+ * @return number of keys processed, -1 on error
+ */
+  long long
+eredis_scan_run( eredis_scan_t *s, int threads,
+                 eredis_scan_cb cb, void *data )
+{
+  scan_worker_t *w;
+  long long keys = 0;
+  int i, err = 0;
+
+  /* One partition without MATCH by default */
+  if (! s->parts_nb) {
+    if (! (s->parts = calloc( 1, sizeof(scan_part_t) )))
+      return -1;
+    s->parts_nb = 1;
+  }
+
+  _eredis_scan_reset( s );
+
+  if (threads < 1)
+    threads = 1;
+  if (threads > s->parts_nb)
+    threads = s->parts_nb;
+
+  w = calloc( threads, sizeof(scan_worker_t) );
+  if (! w)
+    return -1;
+
+  s->cb   = cb;
+  s->data = data;
+  s->stop = 0;
+
+  for (i=0; i<threads; i++) {
+    w[i].s  = s;
+    w[i].id = i;
+    w[i].nb = threads;
+  }
+
+  /* Caller thread is the first worker */
+  for (i=1; i<threads; i++) {
+    if (pthread_create( &w[i].thr, NULL, _eredis_scan_worker, &w[i] )) {
+      _P_ERR("scan: unable to create thread %d", i);
+      w[i].err = 1;
+      w[i].nb  = 0;
+    }
+  }
+
+  _eredis_scan_worker( &w[0] );
+
+  for (i=0; i<threads; i++) {
+    if (i && w[i].nb)
+      pthread_join( w[i].thr, NULL );
+    keys += w[i].keys;
+    err  |= w[i].err;
+  }
+
+  free( w );
+
+  return err ? -1 : keys;
+}
@@ -0,0 +1,400 @@
+/*
+ * Copyright (c) 2016 by Eulerian Technologies SAS
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials
+ *   provided with the distribution.
+ *
+ * * Neither the name of Eulerian Technologies nor the names of its
+ *   contributors may be used to endorse or promote products
+ *   derived from this software without specific prior written
+ *   permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/**
+ * @file slowlog.c
+ * @brief ERedis slow command log
+ *
+ * Reader replies and mirrored writes slower than a threshold are kept
+ * in a ring of the last entries: time, host, latency, reply size and
+ * the beginning of the command.
+ *
+ * The ring is lock-free: a writer takes a position with an atomic
+ * increment, and each entry has a sequence number, odd while it is
+ * written. Readers copy an entry and drop it if its sequence changed.
+ * A writer a lap behind or ahead (more concurrent writers than
+ * entries) finds the slot odd and drops its entry instead of tearing
+ * it.
+ * Nothing is done when no command is slow but a compare, and for the
+ * mirrored writes a copy of the beginning of the command at send.
+ */
+
+typedef struct eredis_slowlog_s {
+  volatile unsigned long long seq;  /* 2 * (pos + 1), odd: writing */
+  eredis_slowlog_entry_t      entry;
+} eredis_slowlog_t;
+
+/* Mirrored write in flight: formatted command beginning */
+#define SLOWLOG_W_RAW   (EREDIS_SLOWLOG_CMD * 2)
+
+typedef struct eredis_slowlog_w_s {
+  long long   sent;                 /* us */
+  int         refs;                 /* hosts sent to */
+  int         cmd_len;
+  int         raw_len;
+  char        raw[ SLOWLOG_W_RAW ];
+} eredis_slowlog_w_t;
+
+/*
+ * Formatted command (RESP) to text: arguments separated by spaces,
+ * truncated. The command may be truncated too.
+ */
+  static void
+_eredis_slowlog_cmd( char *dst, const char *s, int l )
+{
+  const char *end = s + l;
+  char *o = dst, *oend = dst + EREDIS_SLOWLOG_CMD - 1;
+  long n;
+
+  /* '*<argc>' */
+  if (s < end && *s == '*')
+    s = memchr( s, '\n', end - s );
+
+  while (s && ++s < end && *s == '$' && o < oend) {
+    n = strtol( s + 1, NULL, 10 );
+    if (!(s = memchr( s, '\n', end - s )) || ++s >= end)
+      break;
+    if (n > end - s)
+      n = end - s;
+    if (o != dst)
+      *o++ = ' ';
+    if (n > oend - o)
+      n = oend - o;
+    memcpy( o, s, n );
+    o += n;
+    s += n + 1; /* \r, \n next */
+  }
+
+  *o = '\0';
+}
+
+/*
+ * Reply size: string length or elements
+ */
+  static inline size_t
+_eredis_slowlog_reply_size( const redisReply *reply )
+{
+  if (! reply)
+    return 0;
+
+  switch (reply->type) {
+    case REDIS_REPLY_STRING:
+    case REDIS_REPLY_STATUS:
+    case REDIS_REPLY_ERROR:
+      return reply->len;
+    case REDIS_REPLY_ARRAY:
+      return reply->elements;
+  }
+
+  return 0;
+}
+
+/*
+ * Record an entry (any thread)
+ */
+  static void
+_eredis_slowlog_add( eredis_t *e, host_t *h, long long us,
+                     const redisReply *reply, const char *cmd, int l,
+                     int cmd_len, int write )
+{
+  eredis_slowlog_t *sl;
+  unsigned long long pos, seq;
+  struct timeval tv;
+
+  pos = __sync_fetch_and_add( &e->slowlog_pos, 1 );
+  sl  = &e->slowlog[ pos & (e->slowlog_nb - 1) ];
+
+  /* Slot being written (a lap away): dropped */
+  seq = sl->seq;
+  if ((seq & 1) ||
+      ! __sync_bool_compare_and_swap( &sl->seq, seq, 2 * pos + 1 ))
+    return;
+
+  gettimeofday( &tv, NULL );
+  sl->entry.ts_us       = (long long)tv.tv_sec * 1000000 + tv.tv_usec;
+  sl->entry.host        = EREDIS_TRACE_HOST(h);
+  sl->entry.latency_us  = us;
+  sl->entry.reply_size  = _eredis_slowlog_reply_size( reply );
+  sl->entry.cmd_len     = cmd_len;
+  sl->entry.write       = write;
+  if (cmd)
+    _eredis_slowlog_cmd( sl->entry.cmd, cmd, l );
+  else
+    sl->entry.cmd[0] = '\0';
+
+  __sync_synchronize();
+  sl->seq = 2 * pos + 2;
+}
+
+/* Reader reply of its command 'i' */
+  static inline void
+_eredis_slowlog_r( eredis_reader_t *r, long long us,
+                   const redisReply *reply, int i )
+{
+  const char *cmd = NULL;
+  int l = 0;
+
+  if (i < r->cmds_nb) {
+    cmd = r->obuf + r->cmds[i].off;
+    l   = r->cmds[i].l;
+  }
+
+  _eredis_slowlog_add( r->e, r->host, us, reply, cmd, l, l, 0 );
+}
+
+/*
+ * Mirrored write sent at 'now' (event loop): beginning of the command
+ * for its replies, NULL on error
+ */
+  static eredis_slowlog_w_t *
+_eredis_slowlog_w_new( long long now, const char *s, int l )
+{
+  eredis_slowlog_w_t *sw;
+
+  if (!(sw = malloc( sizeof(eredis_slowlog_w_t) )))
+    return NULL;
+
+  sw->sent    = now;
+  sw->refs    = 0;
+  sw->cmd_len = l;
+  sw->raw_len = (l < SLOWLOG_W_RAW) ? l : SLOWLOG_W_RAW;
+  memcpy( sw->raw, s, sw->raw_len );
+
+  return sw;
+}
+
+/*
+ * Mirrored write reply (event loop), 'privdata' is the write in flight.
+ * Called with a NULL reply if the connection is dropped.
+ */
+  static void
+_eredis_slowlog_w_cb( redisAsyncContext *ac, void *reply, void *privdata )
+{
+  host_t *h = (host_t*) ac->data;
+  eredis_slowlog_w_t *sw = privdata;
+  long long us;
+
+  if (reply) {
+    us = _eredis_now_us() - sw->sent;
+    if (us >= h->e->slowlog_us)
+      _eredis_slowlog_add( h->e, h, us, reply, sw->raw, sw->raw_len,
+                           sw->cmd_len, 1 );
+  }
+
+  if (! -- sw->refs)
+    free( sw );
+}
+
+/**
+ * @brief Slow command log
+ *
+ * Reader replies and mirrored writes taking 'threshold_us' or more
+ * are recorded, the last 'entries' are kept. To set before use of
+ * readers and eredis_run(_thr).
+ * With fewer entries than threads recording at once, an entry written
+ * while its slot is still in use is dropped.
+ *
+ * @param e             eredis
+ * @param threshold_us  latency threshold, 0 to disable
+ * @param entries       ring size (rounded up to a power of 2)
+ *
+ * @return EREDIS_OK or EREDIS_ERR
+ */
+  int
+eredis_slowlog( eredis_t *e, long long threshold_us, int entries )
+{
+  eredis_slowlog_t *sl = NULL;
+  int nb = 1;
+
+  if (threshold_us > 0) {
+    while (nb < entries)
+      nb <<= 1;
+    if (!(sl = calloc( nb, sizeof(eredis_slowlog_t) )))
+      return EREDIS_ERR;
+  }
+
+  if (e->slowlog)
+    free( e->slowlog );
+
+  e->slowlog      = sl;
+  e->slowlog_nb   = nb;
+  e->slowlog_pos  = 0;
+  e->slowlog_us   = (sl) ? threshold_us : 0;
+
+  return EREDIS_OK;
+}
+
+/*
+ * Copy of the entry at 'pos', 0 if being written or overwritten
+ */
+  static int
+_eredis_slowlog_read( eredis_t *e, unsigned long long pos,
+                      eredis_slowlog_entry_t *ent )
+{
+  eredis_slowlog_t *sl = &e->slowlog[ pos & (e->slowlog_nb - 1) ];
+  unsigned long long seq = sl->seq;
+
+  if (seq != 2 * pos + 2)
+    return 0;
+  __sync_synchronize();
+
+  *ent = sl->entry;
+
+  __sync_synchronize();
+  return (sl->seq == seq);
+}
+
+/**
+ * @brief Slow command log entries, newest first
+ *
+ * @param e   eredis
+ * @param out entries to fill
+ * @param nb  size of 'out'
+ *
+ * @return number of entries filled
+ */
+  int
+eredis_slowlog_get( eredis_t *e, eredis_slowlog_entry_t *out, int nb )
+{
+  unsigned long long pos;
+  int i, n = 0;
+
+  if (! e->slowlog)
+    return 0;
+
+  for (i=0, pos=e->slowlog_pos; i<e->slowlog_nb && pos && n<nb; i++)
+    if (_eredis_slowlog_read( e, -- pos, &out[ n ] ))
+      n ++;
+
+  return n;
+}
+
+/**
+ * @brief Dump the slow command log, newest first
+ *
+ * @param e eredis
+ * @param f output
+ */
+  void
+eredis_slowlog_dump( eredis_t *e, FILE *f )
+{
+  eredis_slowlog_entry_t ent;
+  unsigned long long pos;
+  int i;
+
+  if (! e->slowlog)
+    return;
+
+  for (i=0, pos=e->slowlog_pos; i<e->slowlog_nb && pos; i++) {
+    if (! _eredis_slowlog_read( e, -- pos, &ent ))
+      continue;
+
+    fprintf( f, "%lld.%06lld host:%s latency:%lldus reply:%zu%s cmd:%s\n",
+             ent.ts_us / 1000000, ent.ts_us % 1000000,
+             (ent.host >= 0 && ent.host < e->hosts_nb) ?
+             e->hosts[ ent.host ].target : "-",
+             ent.latency_us, ent.reply_size,
+             (ent.write) ? " write" : "", ent.cmd );
+  }
+
+  fflush( f );
+}
+
+/*
+ * EV signal callback: dump
+ *
+ * EV_SIGNAL slowlog_signal
+ */
+  static void
+_eredis_ev_slowlog_cb (struct ev_loop *loop, ev_signal *w, int revents)
+{
+  eredis_t *e;
+  FILE *f;
+
+  (void) revents;
+  (void) loop;
+
+  e = (eredis_t*) w->data;
+
+  if (! e->slowlog_path)
+    f = stderr;
+  else if (!(f = fopen( e->slowlog_path, "a" ))) {
+    _P_WARN("slowlog: unable to open %s", e->slowlog_path);
+    return;
+  }
+
+  eredis_slowlog_dump( e, f );
+
+  if (f != stderr)
+    fclose( f );
+}
+
+/**
+ * @brief Dump the slow command log on a signal (event loop)
+ *
+ * To set before eredis_run(_thr).
+ *
+ * @param e       eredis
+ * @param signum  signal (SIGUSR1, SIGUSR2...), 0 to disable
+ * @param path    file to append to, NULL for stderr
+ *
+ * @return EREDIS_OK or EREDIS_ERR
+ */
+  int
+eredis_slowlog_signal( eredis_t *e, int signum, const char *path )
+{
+  char *p = NULL;
+
+  if (path && !(p = strdup( path )))
+    return EREDIS_ERR;
+
+  if (e->slowlog_path)
+    free( e->slowlog_path );
+
+  e->slowlog_path   = p;
+  e->slowlog_signum = signum;
+
+  return EREDIS_OK;
+}
+
+  static void
+_eredis_slowlog_free( eredis_t *e )
+{
+  if (e->slowlog)
+    free( e->slowlog );
+  if (e->slowlog_path)
+    free( e->slowlog_path );
+}
@@ -0,0 +1,605 @@
+/*
+ * Copyright (c) 2016 by Eulerian Technologies SAS
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials
+ *   provided with the distribution.
+ *
+ * * Neither the name of Eulerian Technologies nor the names of its
+ *   contributors may be used to endorse or promote products
+ *   derived from this software without specific prior written
+ *   permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/**
+ * @file stats.c
+ * @brief ERedis runtime statistics
+ *
+ * Reader side counters are kept in per-thread blocks, written by their
+ * thread only without lock or atomic operation. A block has one slot
+ * per host, allocated on first use. Blocks are linked to the eredis
+ * and only summed by eredis_stats.
+ * On thread exit (thread-specific key destructor), the counters of its
+ * blocks are added to the retired ones and the blocks are recycled for
+ * the next new threads.
+ * Event loop counters are in the hosts and eredis, written by the
+ * event loop only.
+ *
+ * Latencies are recorded in a log-linear histogram: 8 buckets per
+ * power of two (12.5% precision), from 1us to 2^30us.
+ */
+
+/* Histogram: sub-buckets per power of two (bits) */
+#define STATS_HIST_SUB_BITS     3
+#define STATS_HIST_SUB          (1 << STATS_HIST_SUB_BITS)
+
+/* Event loop tick (connect_timer) in us */
+#define STATS_TICK_US           1000000
+
+/*
+ * Per-thread counters
+ */
+typedef struct eredis_tstats_host_s {
+  unsigned long long  cmds;
+  unsigned long long  bytes;
+  unsigned long long  replies;
+  unsigned long long  errors;
+  unsigned long long  latency[ EREDIS_STATS_HIST ];
+} eredis_tstats_host_t;
+
+typedef struct eredis_tstats_s {
+  struct eredis_tstats_s  *next;
+  eredis_t                *e;
+  pthread_t               thr;
+  unsigned long long      pool_waits;
+  unsigned long long      pool_wait_us;
+  unsigned long long      lock_waits;
+  unsigned long long      lock_wait_us;
+  int                     hosts_nb;
+  eredis_tstats_host_t    * volatile hosts[];
+} eredis_tstats_t;
+
+/* Last block used by this thread (checked against the eredis stats_id) */
+static __thread struct {
+  eredis_t            *e;
+  unsigned int        id;
+  eredis_tstats_t     *ts;
+} _eredis_tstats_tls;
+
+  static void
+_eredis_tstats_free( eredis_tstats_t *ts )
+{
+  eredis_tstats_t *next;
+  int i;
+
+  for (; ts; ts = next) {
+    next = ts->next;
+    for (i=0; i<ts->hosts_nb; i++)
+      if (ts->hosts[i])
+        free( ts->hosts[i] );
+    free( ts );
+  }
+}
+
+  static void
+_eredis_stats_free( eredis_t *e )
+{
+  /* No more destructor call */
+  if (e->stats_key_ok)
+    pthread_key_delete( e->stats_key );
+
+  _eredis_tstats_free( e->tstats );
+  _eredis_tstats_free( e->tstats_free );
+  _eredis_tstats_free( e->tstats_retired );
+
+  pthread_mutex_destroy( &e->stats_lock );
+}
+
+/*
+ * Add the counters of 'ts' to the retired ones and zero them.
+ * Under stats_lock, 'ts' not written (its thread is gone).
+ */
+  static int
+_eredis_tstats_retire( eredis_t *e, eredis_tstats_t *ts )
+{
+  eredis_tstats_t *rt = e->tstats_retired;
+  eredis_tstats_host_t *hs, *rhs;
+  int i, j;
+
+  /* Retired block with as many host slots */
+  if (! rt || rt->hosts_nb < ts->hosts_nb) {
+    rt = calloc( 1, sizeof(eredis_tstats_t) +
+                 ts->hosts_nb * sizeof(eredis_tstats_host_t*) );
+    if (! rt)
+      return EREDIS_ERR;
+
+    rt->hosts_nb = ts->hosts_nb;
+    if (e->tstats_retired) {
+      rt->pool_waits    = e->tstats_retired->pool_waits;
+      rt->pool_wait_us  = e->tstats_retired->pool_wait_us;
+      rt->lock_waits    = e->tstats_retired->lock_waits;
+      rt->lock_wait_us  = e->tstats_retired->lock_wait_us;
+      for (i=0; i<e->tstats_retired->hosts_nb; i++)
+        rt->hosts[i] = e->tstats_retired->hosts[i];
+      free( e->tstats_retired );
+    }
+    e->tstats_retired = rt;
+  }
+
+  rt->pool_waits    += ts->pool_waits;
+  rt->pool_wait_us  += ts->pool_wait_us;
+  rt->lock_waits    += ts->lock_waits;
+  rt->lock_wait_us  += ts->lock_wait_us;
+  ts->pool_waits = ts->pool_wait_us = ts->lock_waits = ts->lock_wait_us = 0;
+
+  for (i=0; i<ts->hosts_nb; i++) {
+    if (!(hs = ts->hosts[i]))
+      continue;
+
+    /* First one: the slot is moved */
+    if (!(rhs = rt->hosts[i])) {
+      rt->hosts[i] = hs;
+      ts->hosts[i] = NULL;
+      continue;
+    }
+
+    rhs->cmds     += hs->cmds;
+    rhs->bytes    += hs->bytes;
+    rhs->replies  += hs->replies;
+    rhs->errors   += hs->errors;
+    for (j=0; j<EREDIS_STATS_HIST; j++)
+      rhs->latency[j] += hs->latency[j];
+
+    memset( hs, 0, sizeof(eredis_tstats_host_t) );
+  }
+
+  return EREDIS_OK;
+}
+
+/*
+ * Thread exit: its blocks are retired and recycled
+ */
+  static void
+_eredis_tstats_exit( void *v )
+{
+  eredis_tstats_t *ts = v, **pts;
+  eredis_t *e = ts->e;
+  pthread_t thr = ts->thr;
+
+  pthread_mutex_lock( &e->stats_lock );
+
+  pts = &e->tstats;
+  while ((ts = *pts)) {
+    /* Kept (and counted) if the retired block can not grow */
+    if (! pthread_equal( ts->thr, thr ) ||
+        _eredis_tstats_retire( e, ts ) != EREDIS_OK) {
+      pts = &ts->next;
+      continue;
+    }
+
+    *pts            = ts->next;
+    ts->next        = e->tstats_free;
+    e->tstats_free  = ts;
+    e->tstats_nb    --;
+  }
+
+  pthread_mutex_unlock( &e->stats_lock );
+}
+
+/*
+ * Block of this thread with at least 'hosts_min' host slots.
+ * A thread gets a new block when hosts were added since.
+ */
+  static eredis_tstats_t *
+_eredis_tstats_get( eredis_t *e, int hosts_min )
+{
+  eredis_tstats_t *ts, **pts;
+  pthread_t self = pthread_self();
+  int nb;
+
+  pthread_mutex_lock( &e->stats_lock );
+
+  /* Destructor of the thread blocks, on first use */
+  if (! e->stats_key_ok &&
+      ! pthread_key_create( &e->stats_key, _eredis_tstats_exit ))
+    e->stats_key_ok = 1;
+
+  /* Newest first */
+  for (ts = e->tstats; ts; ts = ts->next)
+    if (pthread_equal( ts->thr, self ))
+      break;
+
+  if (! ts || ts->hosts_nb < hosts_min) {
+    nb = (e->hosts_nb > hosts_min) ? e->hosts_nb : hosts_min;
+
+    /* Recycled from an exited thread (zeroed), or new */
+    for (pts = &e->tstats_free; (ts = *pts); pts = &ts->next)
+      if (ts->hosts_nb >= nb) {
+        *pts = ts->next;
+        break;
+      }
+    if (! ts) {
+      ts = calloc( 1, sizeof(eredis_tstats_t) +
+                   nb * sizeof(eredis_tstats_host_t*) );
+      if (ts)
+        ts->hosts_nb = nb;
+    }
+
+    if (ts) {
+      ts->e         = e;
+      ts->thr       = self;
+      ts->next      = e->tstats;
+      e->tstats     = ts;
+      e->tstats_nb  ++;
+      if (e->stats_key_ok)
+        pthread_setspecific( e->stats_key, ts );
+    }
+  }
+
+  pthread_mutex_unlock( &e->stats_lock );
+
+  if (ts) {
+    _eredis_tstats_tls.e  = e;
+    _eredis_tstats_tls.id = e->stats_id;
+    _eredis_tstats_tls.ts = ts;
+  }
+
+  return ts;
+}
+
+  static inline eredis_tstats_t *
+_eredis_tstats( eredis_t *e, int hosts_min )
+{
+  if (_eredis_tstats_tls.e == e &&
+      _eredis_tstats_tls.id == e->stats_id &&
+      _eredis_tstats_tls.ts->hosts_nb >= hosts_min)
+    return _eredis_tstats_tls.ts;
+
+  return _eredis_tstats_get( e, hosts_min );
+}
+
+/*
+ * Host slot of the reader thread, allocated on first use
+ */
+  static inline eredis_tstats_host_t *
+_eredis_tstats_host( eredis_reader_t *r )
+{
+  eredis_tstats_t *ts;
+  eredis_tstats_host_t *hs;
+  int i;
+
+  if (! r->host)
+    return NULL;
+
+  i = r->host - r->e->hosts;
+
+  if (!(ts = _eredis_tstats( r->e, i + 1 )))
+    return NULL;
+
+  if (!(hs = ts->hosts[i])) {
+    if (!(hs = calloc( 1, sizeof(eredis_tstats_host_t) )))
+      return NULL;
+    /* Zeroed before published */
+    __sync_synchronize();
+    ts->hosts[i] = hs;
+  }
+
+  return hs;
+}
+
+/*
+ * Histogram bucket of a value
+ */
+  static inline int
+_eredis_stats_hist_idx( long long v )
+{
+  int b, i;
+
+  if (v < STATS_HIST_SUB)
+    return (v < 0) ? 0 : (int)v;
+
+  b = 63 - __builtin_clzll( (unsigned long long)v );
+  i = ((b - STATS_HIST_SUB_BITS + 1) << STATS_HIST_SUB_BITS) +
+    (int)((v >> (b - STATS_HIST_SUB_BITS)) & (STATS_HIST_SUB - 1));
+
+  return (i < EREDIS_STATS_HIST) ? i : EREDIS_STATS_HIST - 1;
+}
+
+/*
+ * Reader records
+ */
+  static inline void
+_eredis_stats_sent( eredis_reader_t *r, int cmds, size_t bytes )
+{
+  eredis_tstats_host_t *hs;
+
+  if ((hs = _eredis_tstats_host( r ))) {
+    hs->cmds  += cmds;
+    hs->bytes += bytes;
+  }
+}
+
+/* Reply got after waiting 'us' */
+  static inline void
+_eredis_stats_reply( eredis_reader_t *r, long long us, int error )
+{
+  eredis_tstats_host_t *hs;
+
+  if ((hs = _eredis_tstats_host( r ))) {
+    if (error)
+      hs->errors ++;
+    else {
+      hs->replies ++;
+      hs->latency[ _eredis_stats_hist_idx( us ) ] ++;
+    }
+  }
+}
+
+/*
+ * reader_lock, waits accounted when contended
+ */
+  static inline void
+_eredis_reader_lock( eredis_t *e )
+{
+  eredis_tstats_t *ts;
+  long long t0;
+
+  if (! pthread_mutex_trylock( &e->reader_lock ))
+    return;
+
+  t0 = _eredis_now_us();
+
+  pthread_mutex_lock( &e->reader_lock );
+
+  if ((ts = _eredis_tstats( e, 0 ))) {
+    ts->lock_waits    ++;
+    ts->lock_wait_us  += _eredis_now_us() - t0;
+  }
+}
+
+/* Waited for a free reader since 't0' (us) */
+  static inline void
+_eredis_stats_pool_wait( eredis_t *e, long long t0 )
+{
+  eredis_tstats_t *ts;
+
+  if ((ts = _eredis_tstats( e, 0 ))) {
+    ts->pool_waits    ++;
+    ts->pool_wait_us  += _eredis_now_us() - t0;
+  }
+}
+
+/*
+ * Event loop records
+ */
+
+/* Host state transition */
+  static inline void
+_eredis_stats_transition( host_t *h )
+{
+  h->stats_transitions ++;
+
+  EREDIS_TRACE3( host_state, EREDIS_TRACE_HOST(h), h->status,
+                 h->e->hosts_connected );
+}
+
+/* Output buffers of the async connections */
+  static void
+_eredis_stats_obuf( eredis_t *e )
+{
+  int i;
+
+  for (i=0; i<e->hosts_nb; i++) {
+    host_t *h = &e->hosts[i];
+    h->stats_obuf = (h->async_ctx && h->async_ctx->c.obuf) ?
+      sdslen( h->async_ctx->c.obuf ) : 0;
+  }
+}
+
+/* Loop lag: delay of the connect_timer ticks */
+  static void
+_eredis_stats_tick( eredis_t *e )
+{
+  long long now = _eredis_now_us();
+
+  if (e->loop_tick) {
+    e->loop_lag = now - e->loop_tick;
+    if (e->loop_lag < 0)
+      e->loop_lag = 0;
+    if (e->loop_lag > e->loop_lag_max)
+      e->loop_lag_max = e->loop_lag;
+  }
+
+  e->loop_tick = now + STATS_TICK_US;
+
+  _eredis_stats_obuf( e );
+}
+
+/*
+ * Add the counters of a block to the eredis_stats output
+ */
+  static void
+_eredis_tstats_add( eredis_tstats_t *ts, eredis_stats_t *st,
+                    eredis_host_stats_t *hosts, int nb )
+{
+  int i, j;
+
+  if (st) {
+    st->reader_waits    += ts->pool_waits;
+    st->reader_wait_us  += ts->pool_wait_us;
+    st->lock_waits      += ts->lock_waits;
+    st->lock_wait_us    += ts->lock_wait_us;
+  }
+
+  for (i=0; i<nb && i<ts->hosts_nb; i++) {
+    eredis_tstats_host_t *hs = ts->hosts[i];
+    eredis_host_stats_t *hst = &hosts[i];
+
+    if (! hs)
+      continue;
+
+    hst->cmds     += hs->cmds;
+    hst->bytes    += hs->bytes;
+    hst->replies  += hs->replies;
+    hst->errors   += hs->errors;
+    for (j=0; j<EREDIS_STATS_HIST; j++)
+      hst->latency[j] += hs->latency[j];
+  }
+}
+
+/**
+ * @brief Runtime statistics
+ *
+ * Sum of the per-thread counters and event loop values. Counters are
+ * read without stopping their writers: a snapshot is consistent per
+ * counter, not across counters.
+ *
+ * @param e         eredis
+ * @param st        global values to fill (or NULL)
+ * @param hosts     per-host values to fill (or NULL)
+ * @param hosts_nb  size of 'hosts'
+ *
+ * @return number of hosts of eredis
+ */
+  int
+eredis_stats( eredis_t *e, eredis_stats_t *st,
+              eredis_host_stats_t *hosts, int hosts_nb )
+{
+  eredis_tstats_t *ts;
+  eredis_reader_t *r;
+  int i, nb;
+
+  nb = (hosts && hosts_nb < e->hosts_nb) ? hosts_nb : e->hosts_nb;
+  if (! hosts)
+    nb = 0;
+
+  for (i=0; i<nb; i++) {
+    host_t *h = &e->hosts[i];
+    eredis_host_stats_t *hst = &hosts[i];
+
+    memset( hst, 0, sizeof(eredis_host_stats_t) );
+    hst->target       = h->target;
+    hst->port         = h->port;
+    hst->connected    = H_IS_CONNECTED(h) ? 1 : 0;
+    hst->cmds         = h->stats_cmds;
+    hst->bytes        = h->stats_bytes;
+    hst->connects     = h->stats_connects;
+    hst->transitions  = h->stats_transitions;
+    hst->obuf         = h->stats_obuf;
+  }
+
+  if (st) {
+    memset( st, 0, sizeof(eredis_stats_t) );
+    st->wqueue          = e->wqueue.nb;
+    st->loop_lag_us     = e->loop_lag;
+    st->loop_lag_max_us = e->loop_lag_max;
+  }
+
+  pthread_mutex_lock( &e->stats_lock );
+
+  if (st)
+    st->threads = e->tstats_nb;
+
+  /* Live blocks, then the retired counters */
+  for (ts = e->tstats; ts; ts = ts->next)
+    _eredis_tstats_add( ts, st, hosts, nb );
+  if (e->tstats_retired)
+    _eredis_tstats_add( e->tstats_retired, st, hosts, nb );
+
+  pthread_mutex_unlock( &e->stats_lock );
+
+  /* Reader pool */
+  if (st) {
+    pthread_mutex_lock( &e->reader_lock );
+    st->readers = e->rqueue.nb;
+    for (i=0, r=e->rqueue.fst; i<e->rqueue.nb; i++, r=r->next)
+      if (! r->free)
+        st->readers_busy ++;
+    pthread_mutex_unlock( &e->reader_lock );
+  }
+
+  return e->hosts_nb;
+}
+
+/**
+ * @brief Latency histogram: lowest value (us) of a bucket
+ *
+ * @param i bucket index (0 to EREDIS_STATS_HIST-1)
+ *
+ * @return value in us
+ */
+  long long
+eredis_stats_hist_value( int i )
+{
+  int b;
+
+  if (i < STATS_HIST_SUB)
+    return (i < 0) ? 0 : i;
+
+  b = (i >> STATS_HIST_SUB_BITS) + STATS_HIST_SUB_BITS - 1;
+
+  return (long long)(STATS_HIST_SUB + (i & (STATS_HIST_SUB - 1)))
+    << (b - STATS_HIST_SUB_BITS);
+}
+
+/**
+ * @brief Latency histogram: percentile
+ *
+ * @param hist  histogram (EREDIS_STATS_HIST buckets)
+ * @param p     percentile (0 to 100)
+ *
+ * @return highest value (us) of the bucket reaching the percentile,
+ *         0 if empty
+ */
+  long long
+eredis_stats_percentile( const unsigned long long *hist, double p )
+{
+  unsigned long long total = 0, sum = 0, target;
+  int i;
+
+  for (i=0; i<EREDIS_STATS_HIST; i++)
+    total += hist[i];
+
+  if (! total)
+    return 0;
+
+  target = (unsigned long long)(total * p / 100.);
+  if (target < 1)
+    target = 1;
+  if (target > total)
+    target = total;
+
+  for (i=0; i<EREDIS_STATS_HIST - 1; i++) {
+    sum += hist[i];
+    if (sum >= target)
+      break;
+  }
+
+  if (i == EREDIS_STATS_HIST - 1)
+    return eredis_stats_hist_value( i );
+
+  return eredis_stats_hist_value( i + 1 ) - 1;
+}
@@ -0,0 +1,800 @@
+/*
+ * Copyright (c) 2016 by Eulerian Technologies SAS
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials
+ *   provided with the distribution.
+ *
+ * * Neither the name of Eulerian Technologies nor the names of its
+ *   contributors may be used to endorse or promote products
+ *   derived from this software without specific prior written
+ *   permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/**
+ * @file sub.c
+ * @brief ERedis pub/sub dispatcher (event loop)
+ *
+ * Channels and patterns are subscribed on one connection, on the
+ * prefered connected host, shared by all subscriptions. Messages are
+ * dispatched to a callback per channel (or pattern), looked up in a
+ * hash table. Everything is subscribed again after a reconnect.
+ *
+ * Mirrors mode: subscribed on every connected host, each message is
+ * delivered once. Receptions are counted per host and per message
+ * digest (subscription, channel, payload) over a time window: a message
+ * is delivered when a host got it more times than delivered so far.
+ * A host outage does not lose messages, and a payload published again
+ * is still delivered.
+ */
+
+/* Initial buckets (power of 2) */
+#define SUB_BUCKETS_MIN         64
+
+/* Channels per (P)SUBSCRIBE command on resubscribe */
+#define SUB_ARGV_MAX            512
+
+/* Initial slots of a mirrors digest set (power of 2) */
+#define SUB_SEEN_MIN            1024
+
+/*
+ * One channel or pattern
+ */
+typedef struct sub_ent_s {
+  struct sub_ent_s    *next;          /* bucket chain */
+  uint64_t            hash;
+  eredis_sub_cb       cb;
+  void                *data;
+  int                 pattern;
+  size_t              l;
+  char                s[];
+} sub_ent_t;
+
+/*
+ * (P)(UN)SUBSCRIBE commands to send (event loop)
+ */
+typedef struct sub_op_s {
+  struct sub_op_s     *next;
+  char                *s;
+  int                 l;
+} sub_op_t;
+
+/*
+ * Mirrors - message digests of a time window (open addressing)
+ * Counts per slot: delivered, then received per host.
+ */
+typedef struct sub_seen_s {
+  uint64_t            *digests;       /* 0: free slot */
+  uint32_t            *counts;
+  size_t              nb;
+  size_t              alloc;
+} sub_seen_t;
+
+typedef struct eredis_sub_s {
+  sub_ent_t           **buckets;
+  size_t              buckets_nb;
+  size_t              nb;
+
+  sub_op_t            *ops_fst, *ops_lst;
+
+  host_t              *host;          /* carrying the subscriptions */
+
+  /* Mirrors mode (event loop) */
+  sub_seen_t          seen[2];        /* current, previous window */
+  long long           seen_ts;        /* current window start */
+  int                 stride;         /* counts per slot */
+} eredis_sub_t;
+
+/*
+ * Table - with e->sub_lock
+ */
+  static sub_ent_t **
+_eredis_sub_lookup( eredis_sub_t *es, int pattern, uint64_t hash,
+                    const char *s, size_t l )
+{
+  sub_ent_t **pse;
+
+  for (pse = &es->buckets[ hash & (es->buckets_nb - 1) ];
+       *pse;
+       pse = &(*pse)->next) {
+    sub_ent_t *se = *pse;
+    if (se->hash == hash && se->pattern == pattern &&
+        se->l == l && ! memcmp( se->s, s, l ))
+      break;
+  }
+
+  return pse;
+}
+
+  static void
+_eredis_sub_grow( eredis_sub_t *es )
+{
+  size_t i, nb = es->buckets_nb << 1;
+  sub_ent_t **buckets, *se;
+
+  buckets = calloc( nb, sizeof(sub_ent_t*) );
+  if (! buckets)
+    return; /* longer chains */
+
+  for (i=0; i<es->buckets_nb; i++) {
+    while ((se = es->buckets[i])) {
+      es->buckets[i] = se->next;
+      se->next = buckets[ se->hash & (nb - 1) ];
+      buckets[ se->hash & (nb - 1) ] = se;
+    }
+  }
+
+  free( es->buckets );
+  es->buckets     = buckets;
+  es->buckets_nb  = nb;
+}
+
+/*
+ * Queue a command for the subscribe connection - with e->sub_lock
+ */
+  static int
+_eredis_sub_op( eredis_sub_t *es, const char *cmd, const char *s, size_t l )
+{
+  sub_op_t *op;
+
+  op = malloc( sizeof(sub_op_t) );
+  if (! op)
+    return EREDIS_ERR;
+
+  op->next  = NULL;
+  op->l     = redisFormatCommand( &op->s, "%s %b", cmd, s, l );
+  if (op->l <= 0) {
+    free( op );
+    return EREDIS_ERR;
+  }
+
+  if (es->ops_lst)
+    es->ops_lst->next = op;
+  else
+    es->ops_fst = op;
+  es->ops_lst = op;
+
+  return EREDIS_OK;
+}
+
+  static void
+_eredis_sub_ops_clear( eredis_sub_t *es )
+{
+  sub_op_t *op;
+
+  while ((op = es->ops_fst)) {
+    es->ops_fst = op->next;
+    free( op->s );
+    free( op );
+  }
+  es->ops_lst = NULL;
+}
+
+/*
+ * Mirrors - digest sets (event loop)
+ */
+  static inline size_t
+_eredis_sub_seen_slot( sub_seen_t *ss, uint64_t d )
+{
+  size_t i = d & (ss->alloc - 1);
+
+  while (ss->digests[i] && ss->digests[i] != d)
+    i = (i + 1) & (ss->alloc - 1);
+
+  return i;
+}
+
+  static int
+_eredis_sub_seen_grow( sub_seen_t *ss, int stride )
+{
+  sub_seen_t n;
+  size_t i, j;
+
+  n.alloc   = (ss->alloc) ? ss->alloc << 1 : SUB_SEEN_MIN;
+  n.nb      = ss->nb;
+  n.digests = calloc( n.alloc, sizeof(uint64_t) );
+  n.counts  = calloc( n.alloc * stride, sizeof(uint32_t) );
+  if (! n.digests || ! n.counts) {
+    free( n.digests );
+    free( n.counts );
+    return EREDIS_ERR;
+  }
+
+  for (i=0; i<ss->alloc; i++) {
+    if (! ss->digests[i])
+      continue;
+    j = _eredis_sub_seen_slot( &n, ss->digests[i] );
+    n.digests[j] = ss->digests[i];
+    memcpy( &n.counts[ j * stride ], &ss->counts[ i * stride ],
+            stride * sizeof(uint32_t) );
+  }
+
+  free( ss->digests );
+  free( ss->counts );
+  *ss = n;
+
+  return EREDIS_OK;
+}
+
+  static void
+_eredis_sub_seen_clear( sub_seen_t *ss, int stride )
+{
+  if (! ss->nb)
+    return;
+
+  memset( ss->digests, 0, ss->alloc * sizeof(uint64_t) );
+  memset( ss->counts, 0, ss->alloc * stride * sizeof(uint32_t) );
+  ss->nb = 0;
+}
+
+/*
+ * Mirrors - is it a new message (from host 'hi')?
+ */
+  static int
+_eredis_sub_seen( eredis_t *e, int hi, int pattern,
+                  redisReply *name, redisReply *chan, redisReply *msg )
+{
+  eredis_sub_t *es = e->sub;
+  sub_seen_t *cur, *prev;
+  uint32_t *counts;
+  uint64_t d;
+  long long now;
+  size_t i, j;
+  sub_seen_t tmp;
+
+  if (! es->stride)
+    es->stride = 1 + e->hosts_nb;
+
+  /* Rotate the window */
+  now = _eredis_now_ms();
+  if (now - es->seen_ts >= e->sub_window) {
+    if (now - es->seen_ts >= 2 * (long long)e->sub_window)
+      _eredis_sub_seen_clear( &es->seen[0], es->stride );
+    _eredis_sub_seen_clear( &es->seen[1], es->stride );
+    tmp         = es->seen[1];
+    es->seen[1] = es->seen[0];
+    es->seen[0] = tmp;
+    es->seen_ts = now;
+  }
+
+  cur   = &es->seen[0];
+  prev  = &es->seen[1];
+
+  /* Digest */
+  d = _eredis_hash( name->str, name->len ) ^ pattern;
+  d = (d ^ _eredis_hash( chan->str, chan->len )) * 0x100000001b3ULL;
+  if (msg->type == REDIS_REPLY_STRING)
+    d = (d ^ _eredis_hash( msg->str, msg->len )) * 0x100000001b3ULL;
+  if (! d)
+    d = 1;
+
+  if ((cur->nb + 1) * 2 > cur->alloc &&
+      _eredis_sub_seen_grow( cur, es->stride ) != EREDIS_OK)
+    return 1; /* deliver */
+
+  i = _eredis_sub_seen_slot( cur, d );
+  counts = &cur->counts[ i * es->stride ];
+
+  if (! cur->digests[i]) {
+    cur->digests[i] = d;
+    cur->nb ++;
+
+    /* Counts of the previous window */
+    if (prev->nb) {
+      j = _eredis_sub_seen_slot( prev, d );
+      if (prev->digests[j])
+        memcpy( counts, &prev->counts[ j * es->stride ],
+                es->stride * sizeof(uint32_t) );
+    }
+  }
+
+  /* counts[0]: delivered, counts[1+hi]: received from host */
+  if (++ counts[ 1 + hi ] <= counts[0])
+    return 0;
+
+  counts[0] = counts[ 1 + hi ];
+  return 1;
+}
+
+/*
+ * Message callback (event loop)
+ */
+  static void
+_eredis_sub_msg_cb( redisAsyncContext *c, void *vreply, void *privdata )
+{
+  redisReply *reply = vreply, *name, *chan, *msg;
+  eredis_sub_t *es;
+  sub_ent_t *se;
+  eredis_sub_cb cb = NULL;
+  void *data = NULL;
+  eredis_t *e;
+  int pattern;
+
+  (void) privdata;
+
+  if (! reply
+      ||
+      reply->type != REDIS_REPLY_ARRAY
+      ||
+      reply->elements < 3
+      ||
+      reply->element[0]->type != REDIS_REPLY_STRING)
+    return;
+
+  if (! strcmp( reply->element[0]->str, "message" ))
+    pattern = 0;
+  else if (reply->elements == 4 &&
+           ! strcmp( reply->element[0]->str, "pmessage" ))
+    pattern = 1;
+  else
+    return; /* (un)subscribe replies */
+
+  name  = reply->element[1];
+  chan  = reply->element[ 1 + pattern ];
+  msg   = reply->element[ 2 + pattern ];
+
+  if (name->type != REDIS_REPLY_STRING || chan->type != REDIS_REPLY_STRING)
+    return;
+
+  e   = ((host_t*) c->data)->e;
+  es  = e->sub;
+
+  /* Mirrors: already delivered from another host */
+  if (e->sub_window &&
+      ! _eredis_sub_seen( e, (host_t*) c->data - e->hosts,
+                          pattern, name, chan, msg ))
+    return;
+
+  pthread_mutex_lock( &e->sub_lock );
+  se = *_eredis_sub_lookup( es, pattern, _eredis_hash( name->str, name->len ),
+                            name->str, name->len );
+  if (se) {
+    cb    = se->cb;
+    data  = se->data;
+  }
+  pthread_mutex_unlock( &e->sub_lock );
+
+  /* Not under lock: the callback may (un)subscribe */
+  if (cb)
+    cb( chan->str, (msg->type == REDIS_REPLY_STRING) ? msg->str : NULL,
+        (msg->type == REDIS_REPLY_STRING) ? msg->len : 0, data );
+}
+
+/*
+ * Send the pending commands to the subscribe connections
+ * - with e->sub_lock (event loop)
+ */
+  static void
+_eredis_sub_ops_send( eredis_t *e )
+{
+  eredis_sub_t *es = e->sub;
+  sub_op_t *op;
+  int i;
+
+  while ((op = es->ops_fst)) {
+    es->ops_fst = op->next;
+
+    for (i=0; i<e->hosts_nb; i++) {
+      host_t *h = &e->hosts[i];
+      if (h->sub_ctx)
+        __redisAsyncCommand( h->sub_ctx, _eredis_sub_msg_cb, NULL,
+                             op->s, op->l );
+    }
+
+    free( op->s );
+    free( op );
+  }
+  es->ops_lst = NULL;
+}
+
+/*
+ * Subscribe connection callbacks (event loop)
+ */
+  static void
+_eredis_sub_lost( host_t *h )
+{
+  eredis_sub_t *es = h->e->sub;
+
+  if (h->sub_ctx)
+    _P_WARN("sub: connection lost: %s", h->target);
+
+  h->sub_ctx = NULL;
+
+  if (es->host == h)
+    es->host = NULL;
+}
+
+  static void
+_eredis_sub_connect_cb( const redisAsyncContext *c, int status )
+{
+  if (status != REDIS_OK)
+    _eredis_sub_lost( (host_t*) c->data );
+}
+
+/* Reconnection on a lost established connection, else connect timer */
+static void _eredis_sub_check( eredis_t *e );
+
+  static void
+_eredis_sub_disconnect_cb( const redisAsyncContext *c, int status )
+{
+  host_t *h = (host_t*) c->data;
+
+  (void) status;
+  _eredis_sub_lost( h );
+
+  /* Single connection: move to another host at once. Mirrors: the
+   * others still deliver, the connect timer reconnects this one */
+  if (! h->e->sub_window)
+    _eredis_sub_check( h->e );
+}
+
+/*
+ * (P)SUBSCRIBE all the table - with e->sub_lock
+ */
+  static void
+_eredis_sub_all( eredis_sub_t *es, redisAsyncContext *ac, int pattern )
+{
+  const char *argv[ SUB_ARGV_MAX ];
+  size_t argvlen[ SUB_ARGV_MAX ];
+  sub_ent_t *se;
+  size_t i;
+  int argc;
+
+  argv[0]     = (pattern) ? "PSUBSCRIBE" : "SUBSCRIBE";
+  argvlen[0]  = strlen( argv[0] );
+  argc        = 1;
+
+  for (i=0; i<es->buckets_nb; i++) {
+    for (se = es->buckets[i]; se; se = se->next) {
+      if (se->pattern != pattern)
+        continue;
+
+      argv[ argc ]    = se->s;
+      argvlen[ argc ] = se->l;
+      if (++ argc == SUB_ARGV_MAX) {
+        redisAsyncCommandArgv( ac, _eredis_sub_msg_cb, NULL,
+                               argc, argv, argvlen );
+        argc = 1;
+      }
+    }
+  }
+
+  if (argc > 1)
+    redisAsyncCommandArgv( ac, _eredis_sub_msg_cb, NULL,
+                           argc, argv, argvlen );
+}
+
+/*
+ * Connect the subscribe connection of a host and subscribe
+ * everything (event loop)
+ */
+  static int
+_eredis_sub_connect( host_t *h )
+{
+  int i;
+  eredis_t *e = h->e;
+  eredis_sub_t *es = e->sub;
+  redisAsyncContext *ac;
+
+  ac = (h->port) ?
+    redisAsyncConnect( h->target, h->port )
+    :
+    redisAsyncConnectUnix( h->target );
+
+  if (! ac) {
+    _P_ERR( "sub: connect async %s undef", h->target);
+    return 0;
+  }
+  if (ac->err) {
+    _P_LOG( "sub: connect async failed %s err:%d", h->target, ac->err);
+    redisAsyncFree( ac );
+    return 0;
+  }
+
+#ifdef HOST_TCP_KEEPALIVE
+  if (h->port)
+    redisEnableKeepAlive( &ac->c );
+#endif
+
+  ac->data    = h;
+
+  redisLibevAttach( e->loop, ac );
+
+  redisAsyncSetDisconnectCallback( ac, _eredis_sub_disconnect_cb );
+  redisAsyncSetConnectCallback( ac, _eredis_sub_connect_cb );
+
+  /* Post-connect commands first (AUTH, SELECT...) */
+  for (i=0; i<e->cmds_connect_nb; i++)
+    __redisAsyncCommand( ac, NULL, NULL,
+                         e->cmds_connect[i].s, e->cmds_connect[i].l );
+
+  /* Pending commands to the others (mirrors), the table is the
+   * reference for this one */
+  pthread_mutex_lock( &e->sub_lock );
+  _eredis_sub_ops_send( e );
+  h->sub_ctx = ac;
+  _eredis_sub_all( es, ac, 0 );
+  _eredis_sub_all( es, ac, 1 );
+  pthread_mutex_unlock( &e->sub_lock );
+
+  es->host = h;
+
+  _P_LOG("sub: %zu subscriptions on %s", es->nb, h->target);
+
+  return 1;
+}
+
+/*
+ * Subscribe connection on the prefered connected host, or on all the
+ * connected hosts for mirrors (event loop)
+ */
+  static void
+_eredis_sub_check( eredis_t *e )
+{
+  int i;
+
+  if (! e->sub || IS_SHUTDOWN(e))
+    return;
+
+  if (! e->sub_window && e->sub->host)
+    return;
+
+  /* Mirrors: all - or the prefered healthy one, else connected */
+  for (i=0; i<e->hosts_nb; i++) {
+    host_t *h = &e->hosts[i];
+    if (H_IS_CONNECTED(h) && ! h->sub_ctx &&
+        (e->sub_window || ! H_IS_DEGRADED(h)) &&
+        _eredis_sub_connect( h ) && ! e->sub_window)
+      return;
+  }
+
+  if (e->sub_window)
+    return;
+
+  for (i=0; i<e->hosts_nb; i++) {
+    host_t *h = &e->hosts[i];
+    if (H_IS_CONNECTED(h) && ! h->sub_ctx && _eredis_sub_connect( h ))
+      return;
+  }
+}
+
+/*
+ * Send the pending (un)subscribe commands (event loop)
+ */
+  static void
+_eredis_sub_flush( eredis_t *e )
+{
+  if (! e->sub)
+    return;
+
+  pthread_mutex_lock( &e->sub_lock );
+  _eredis_sub_ops_send( e );
+  pthread_mutex_unlock( &e->sub_lock );
+
+  /* None yet: everything subscribed on connect, by the connect timer
+   * (not here: a failing host would be reconnected on every write) */
+}
+
+  static void
+_eredis_sub_free( eredis_t *e )
+{
+  size_t i;
+  sub_ent_t *se;
+  eredis_sub_t *es = e->sub;
+
+  for (i=0; i<es->buckets_nb; i++) {
+    while ((se = es->buckets[i])) {
+      es->buckets[i] = se->next;
+      free( se );
+    }
+  }
+  free( es->buckets );
+
+  _eredis_sub_ops_clear( es );
+
+  for (i=0; i<2; i++) {
+    free( es->seen[i].digests );
+    free( es->seen[i].counts );
+  }
+
+  free( es );
+  e->sub = NULL;
+}
+
+/*
+ * Add or remove a channel or a pattern
+ */
+  static int
+_eredis_sub_set( eredis_t *e, int pattern, const char *name,
+                 eredis_sub_cb cb, void *data )
+{
+  eredis_sub_t *es;
+  sub_ent_t **pse, *se;
+  size_t l = strlen( name );
+  uint64_t hash = _eredis_hash( name, l );
+  int err = EREDIS_OK;
+
+  pthread_mutex_lock( &e->sub_lock );
+
+  if (! (es = e->sub)) {
+    if (! cb)
+      goto err;
+    es = calloc( 1, sizeof(eredis_sub_t) );
+    if (! es)
+      goto err;
+    es->buckets = calloc( SUB_BUCKETS_MIN, sizeof(sub_ent_t*) );
+    if (! es->buckets) {
+      free( es );
+      goto err;
+    }
+    es->buckets_nb = SUB_BUCKETS_MIN;
+    e->sub = es;
+  }
+
+  pse = _eredis_sub_lookup( es, pattern, hash, name, l );
+
+  if (! cb) {
+    /* Unsubscribe */
+    if (! (se = *pse))
+      goto err;
+    *pse = se->next;
+    free( se );
+    es->nb --;
+    _eredis_sub_op( es, (pattern) ? "PUNSUBSCRIBE" : "UNSUBSCRIBE",
+                    name, l );
+    goto out;
+  }
+
+  if ((se = *pse)) {
+    /* Already subscribed: new callback */
+    se->cb    = cb;
+    se->data  = data;
+    goto out;
+  }
+
+  se = malloc( sizeof(sub_ent_t) + l + 1 );
+  if (! se)
+    goto err;
+
+  se->hash    = hash;
+  se->cb      = cb;
+  se->data    = data;
+  se->pattern = pattern;
+  se->l       = l;
+  memcpy( se->s, name, l + 1 );
+
+  se->next  = *pse;
+  *pse      = se;
+  if (++ es->nb > es->buckets_nb)
+    _eredis_sub_grow( es );
+
+  _eredis_sub_op( es, (pattern) ? "PSUBSCRIBE" : "SUBSCRIBE", name, l );
+
+out:
+  pthread_mutex_unlock( &e->sub_lock );
+
+  if (IS_READY(e) && !IS_SHUTDOWN(e))
+    ev_async_send( e->loop, &e->send_async );
+
+  return err;
+
+err:
+  pthread_mutex_unlock( &e->sub_lock );
+  return EREDIS_ERR;
+}
+
+/**
+ * @brief Subscribe to a channel (event loop)
+ *
+ * The callback is called from the event loop for each message.
+ * Subscriptions are shared on one connection and restored after a
+ * reconnect. A new callback replaces the previous one.
+ * The event loop must run (eredis_run_thr).
+ *
+ * @param e       eredis
+ * @param channel channel
+ * @param cb      message callback
+ * @param data    callback data
+ *
+ * @return EREDIS_OK, EREDIS_ERR
+ */
+  int
+eredis_sub( eredis_t *e, const char *channel, eredis_sub_cb cb, void *data )
+{
+  if (! cb)
+    return EREDIS_ERR;
+  return _eredis_sub_set( e, 0, channel, cb, data );
+}
+
+/**
+ * @brief Subscribe to a pattern (event loop)
+ *
+ * As eredis_sub, with PSUBSCRIBE.
+ *
+ * @param e       eredis
+ * @param pattern glob-style pattern
+ * @param cb      message callback, got the matching channel
+ * @param data    callback data
+ *
+ * @return EREDIS_OK, EREDIS_ERR
+ */
+  int
+eredis_psub( eredis_t *e, const char *pattern, eredis_sub_cb cb, void *data )
+{
+  if (! cb)
+    return EREDIS_ERR;
+  return _eredis_sub_set( e, 1, pattern, cb, data );
+}
+
+/**
+ * @brief Subscribe on all the mirrors
+ *
+ * Subscriptions are on every connected host and messages are
+ * delivered once: a host outage loses nothing.
+ * Receptions are counted over 'window_ms' (at least the replication
+ * delay between hosts); a message published again with the same
+ * payload is delivered again.
+ *
+ * Default is 0 (off, one host). Must be called before eredis_run_thr.
+ *
+ * @param e         eredis
+ * @param window_ms duplicate window in ms, 0 to disable
+ */
+  void
+eredis_sub_mirrors( eredis_t *e, int window_ms )
+{
+  e->sub_window = window_ms;
+}
+
+/**
+ * @brief Unsubscribe from a channel
+ *
+ * A message already in dispatch may still reach the callback.
+ *
+ * @param e       eredis
+ * @param channel channel
+ *
+ * @return EREDIS_OK, EREDIS_ERR if not subscribed
+ */
+  int
+eredis_unsub( eredis_t *e, const char *channel )
+{
+  return _eredis_sub_set( e, 0, channel, NULL, NULL );
+}
+
+/**
+ * @brief Unsubscribe from a pattern
+ *
+ * @param e       eredis
+ * @param pattern pattern
+ *
+ * @return EREDIS_OK, EREDIS_ERR if not subscribed
+ */
+  int
+eredis_punsub( eredis_t *e, const char *pattern )
+{
+  return _eredis_sub_set( e, 1, pattern, NULL, NULL );
+}
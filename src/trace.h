@@ -0,0 +1,89 @@
+/*
+ * Copyright (c) 2016 by Eulerian Technologies SAS
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials
+ *   provided with the distribution.
+ *
+ * * Neither the name of Eulerian Technologies nor the names of its
+ *   contributors may be used to endorse or promote products
+ *   derived from this software without specific prior written
+ *   permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/**
+ * @file trace.h
+ * @brief ERedis static tracepoints (USDT)
+ *
+ * Built with EREDIS_USDT (sys/sdt.h), each probe is a nop in the code
+ * and a note in the binary for perf, bpftrace, systemtap...
+ * Otherwise, they are compiled out.
+ *
+ * Provider 'eredis', probes and arguments:
+ *
+ *   w_enqueue     cmd, len, queue length     eredis_w_fcmd (any thread)
+ *   w_dequeue     cmd, len, queue length     event loop, before sending
+ *   w_send        host, cmd, len             event loop, per host
+ *   r_wait        readers                    no free reader, waiting
+ *   r_acquire     reader, waited (us)        eredis_r, eredis_r_timed
+ *   r_release     reader
+ *   r_reply_start reader, host, cmds         before waiting for a reply
+ *   r_reply_end   reader, host, err, us      reply got or failed
+ *   host_state    host, status, connected    state transition
+ *
+ * 'host' is the host index, 'cmd' the address of the formatted command
+ * (same from w_enqueue to w_send: queueing delay).
+ * Events are timestamped by the tracer, e.g. with bpftrace:
+ *
+ *   usdt:./liberedis.so:eredis:w_enqueue { @t[arg0] = nsecs; }
+ *   usdt:./liberedis.so:eredis:w_dequeue /@t[arg0]/ {
+ *     @queued_us = hist((nsecs - @t[arg0]) / 1000); delete(@t[arg0]); }
+ */
+
+#ifndef EREDIS_TRACE_H
+#define EREDIS_TRACE_H
+
+#if defined(EREDIS_USDT)
+#include <sys/sdt.h>
+
+#define EREDIS_TRACE1(n, a)           DTRACE_PROBE1( eredis, n, a )
+#define EREDIS_TRACE2(n, a, b)        DTRACE_PROBE2( eredis, n, a, b )
+#define EREDIS_TRACE3(n, a, b, c)     DTRACE_PROBE3( eredis, n, a, b, c )
+#define EREDIS_TRACE4(n, a, b, c, d)  DTRACE_PROBE4( eredis, n, a, b, c, d )
+
+#else
+
+#define EREDIS_TRACE1(n, a)           do { } while (0)
+#define EREDIS_TRACE2(n, a, b)        do { } while (0)
+#define EREDIS_TRACE3(n, a, b, c)     do { } while (0)
+#define EREDIS_TRACE4(n, a, b, c, d)  do { } while (0)
+
+#endif
+
+/* Host index, -1 if none */
+#define EREDIS_TRACE_HOST(h)          ((h) ? (int)((h) - (h)->e->hosts) : -1)
+
+#endif /* EREDIS_TRACE_H */
@@ -0,0 +1,727 @@
+/*
+ * Copyright (c) 2016 by Eulerian Technologies SAS
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials
+ *   provided with the distribution.
+ *
+ * * Neither the name of Eulerian Technologies nor the names of its
+ *   contributors may be used to endorse or promote products
+ *   derived from this software without specific prior written
+ *   permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/**
+ * @file view.c
+ * @brief ERedis zero-copy reply views
+ *
+ * A view is an index over the reader's input buffer: one node per
+ * element, nodes stored in a per-reader array reused across replies.
+ * Strings are not copied, they point into the buffer.
+ *
+ * Views of a reply are valid until the next command or reply on the
+ * same reader, or its release.
+ */
+
+/* Max nested arrays in a view (hiredis reader allows 9) */
+#define VIEW_MAX_DEPTH          16
+
+/* Compact the reader buffer when that much is consumed (as hiredis) */
+#define VIEW_COMPACT_AFTER      1024
+
+/* Parsing status */
+#define VIEW_NEED_MORE          1
+
+struct eredis_view_s {
+  int                   type;
+  long long             integer;
+  size_t                len;      /* string length or array elements */
+  const char            *str;
+  struct eredis_view_s  *element;
+
+  /* offsets while parsing (buffer may move on read) */
+  size_t                off;
+  size_t                child;
+};
+
+/*
+ * Reserve 'nb' consecutive nodes
+ */
+  static int
+_eredis_view_reserve( eredis_reader_t *r, size_t nb )
+{
+  eredis_view_t *views;
+  size_t alloc;
+
+  if (r->views_nb + nb <= r->views_alloc)
+    return EREDIS_OK;
+
+  alloc = r->views_alloc ? r->views_alloc : 64;
+  while (alloc < r->views_nb + nb)
+    alloc *= 2;
+
+  views = realloc( r->views, sizeof(eredis_view_t) * alloc );
+  if (! views)
+    return EREDIS_ERR;
+
+  r->views        = views;
+  r->views_alloc  = alloc;
+
+  return EREDIS_OK;
+}
+
+/*
+ * Line at 'p': return the position after CRLF, 0 if incomplete
+ */
+  static inline size_t
+_eredis_view_line( const char *buf, size_t p, size_t end, size_t *peol )
+{
+  const char *s;
+
+  s = memchr( buf + p, '\r', end - p );
+  if (! s || (size_t)(s - buf) + 1 >= end)
+    return 0;
+
+  *peol = s - buf;
+  return *peol + 2;
+}
+
+  static inline long long
+_eredis_view_integer( const char *s, const char *end )
+{
+  long long v = 0;
+  int neg = 0;
+
+  if (s < end && *s == '-') {
+    neg = 1;
+    s ++;
+  }
+  while (s < end && isdigit(*s))
+    v = v * 10 + (*s++ - '0');
+
+  return neg ? -v : v;
+}
+
+/*
+ * Parse one reply from reader->pos into r->views.
+ * Resumable: the caller reads more data and calls again with the same
+ * 'ps' state until EREDIS_OK.
+ */
+typedef struct view_parse_s {
+  size_t    p;                          /* parse offset in buffer */
+  size_t    slot;                       /* next node to fill */
+  int       depth;
+  struct {
+    size_t  next;                       /* next child slot */
+    size_t  left;                       /* children left */
+  }         stack[ VIEW_MAX_DEPTH ];
+} view_parse_t;
+
+  static int
+_eredis_view_parse( eredis_reader_t *r, redisReader *rr, view_parse_t *ps )
+{
+  const char *buf = rr->buf;
+  size_t end = rr->len, eol, next;
+  eredis_view_t *v;
+  long long n;
+
+  for (;;) {
+    if (ps->p >= end)
+      return VIEW_NEED_MORE;
+
+    if (! (next = _eredis_view_line( buf, ps->p, end, &eol )))
+      return VIEW_NEED_MORE;
+
+    v = &r->views[ ps->slot ];
+    v->str      = NULL;
+    v->element  = NULL;
+    v->integer  = 0;
+    v->len      = 0;
+    v->off      = ps->p + 1;
+
+    switch (buf[ ps->p ]) {
+      case '+':
+        v->type = REDIS_REPLY_STATUS;
+        v->len  = eol - v->off;
+        break;
+
+      case '-':
+        v->type = REDIS_REPLY_ERROR;
+        v->len  = eol - v->off;
+        break;
+
+      case ':':
+        v->type     = REDIS_REPLY_INTEGER;
+        v->integer  = _eredis_view_integer( buf + v->off, buf + eol );
+        break;
+
+      case '$':
+        n = _eredis_view_integer( buf + v->off, buf + eol );
+        if (n < 0) {
+          v->type = REDIS_REPLY_NIL;
+          break;
+        }
+        if (next + n + 2 > end)
+          return VIEW_NEED_MORE;
+        v->type = REDIS_REPLY_STRING;
+        v->off  = next;
+        v->len  = n;
+        next   += n + 2;
+        break;
+
+      case '*':
+        n = _eredis_view_integer( buf + v->off, buf + eol );
+        if (n < 0) {
+          v->type = REDIS_REPLY_NIL;
+          break;
+        }
+        if (ps->depth >= VIEW_MAX_DEPTH)
+          return EREDIS_ERR;
+        /* children are consecutive: child(i) is O(1) */
+        if (_eredis_view_reserve( r, n ) != EREDIS_OK)
+          return EREDIS_ERR;
+        v = &r->views[ ps->slot ];
+        v->type   = REDIS_REPLY_ARRAY;
+        v->len    = n;
+        v->child  = r->views_nb;
+        r->views_nb += n;
+        if (n) {
+          ps->p = next;
+          ps->stack[ ps->depth ].next = v->child;
+          ps->stack[ ps->depth ].left = n;
+          ps->depth ++;
+          ps->slot = ps->stack[ ps->depth - 1 ].next;
+          continue;
+        }
+        break;
+
+      default:
+        return EREDIS_ERR;
+    }
+
+    ps->p = next;
+
+    /* Next slot: sibling, or climb up */
+    while (ps->depth) {
+      if (-- ps->stack[ ps->depth - 1 ].left) {
+        ps->slot = ++ ps->stack[ ps->depth - 1 ].next;
+        break;
+      }
+      ps->depth --;
+    }
+
+    if (! ps->depth)
+      return EREDIS_OK;
+  }
+}
+
+/*
+ * Send pending commands and drop consumed input: previous views are gone.
+ */
+  static int
+_eredis_view_prepare( eredis_reader_t *r, redisContext *c )
+{
+  int done;
+  redisReader *rr = c->reader;
+
+  /* Flush pending commands */
+  do {
+    if (redisBufferWrite( c, &done ) == REDIS_ERR)
+      return EREDIS_ERR;
+  } while (! done);
+
+  /* Compact as hiredis does */
+  if (rr->pos >= VIEW_COMPACT_AFTER) {
+    sdsrange( rr->buf, rr->pos, -1 );
+    rr->pos = 0;
+    rr->len = sdslen( rr->buf );
+  }
+
+  r->views_nb = 0;
+  if (_eredis_view_reserve( r, 1 ) != EREDIS_OK)
+    return EREDIS_ERR;
+  r->views_nb = 1;
+
+  return EREDIS_OK;
+}
+
+/*
+ * Parse one reply at reader->pos into node 'slot', reading from the
+ * connection as needed.
+ */
+  static int
+_eredis_view_fetch( eredis_reader_t *r, redisContext *c, size_t slot )
+{
+  int err;
+  view_parse_t ps;
+  redisReader *rr = c->reader;
+
+  memset( &ps, 0, sizeof(ps) );
+  ps.p    = rr->pos;
+  ps.slot = slot;
+
+  while ((err = _eredis_view_parse( r, rr, &ps )) == VIEW_NEED_MORE) {
+    if (redisBufferRead( c ) == REDIS_ERR)
+      return EREDIS_ERR;
+  }
+
+  if (err != EREDIS_OK) {
+    __redisSetError( c, REDIS_ERR_PROTOCOL, "eredis: view parse error" );
+    return EREDIS_ERR;
+  }
+
+  /* Consumed - buffer pinned until next read */
+  rr->pos = ps.p;
+
+  return EREDIS_OK;
+}
+
+/*
+ * Offsets to pointers, from node 'from'
+ */
+  static void
+_eredis_view_resolve( eredis_reader_t *r, redisReader *rr, size_t from )
+{
+  size_t i;
+
+  for (i=from; i<r->views_nb; i++) {
+    eredis_view_t *v = &r->views[i];
+    switch (v->type) {
+      case REDIS_REPLY_STRING:
+      case REDIS_REPLY_STATUS:
+      case REDIS_REPLY_ERROR:
+        v->str = rr->buf + v->off;
+        break;
+      case REDIS_REPLY_ARRAY:
+        v->element = &r->views[ v->child ];
+        break;
+    }
+  }
+}
+
+/*
+ * Drop the nodes from 'hole' to 'end' (excluded): the nodes from 'end'
+ * to 'mark' (excluded) are moved down, children offsets fixed.
+ */
+  static void
+_eredis_view_close( eredis_reader_t *r, size_t hole, size_t end, size_t mark )
+{
+  size_t i, gap = end - hole;
+
+  memmove( &r->views[ hole ], &r->views[ end ],
+           sizeof(eredis_view_t) * (mark - end) );
+  r->views_nb = mark - gap;
+
+  for (i=1; i<r->views_nb; i++)
+    if (r->views[i].type == REDIS_REPLY_ARRAY && r->views[i].child >= end)
+      r->views[i].child -= gap;
+}
+
+/*
+ * Fetch one reply as views, reading from the connection as needed.
+ */
+  static int
+_eredis_view_get( eredis_reader_t *r, redisContext *c )
+{
+  if (_eredis_view_prepare( r, c ) != EREDIS_OK ||
+      _eredis_view_fetch( r, c, 0 ) != EREDIS_OK)
+    return EREDIS_ERR;
+
+  _eredis_view_resolve( r, c->reader, 0 );
+
+  return EREDIS_OK;
+}
+
+/*
+ * Stream: fetch only the header of an array reply.
+ * Any other reply is fetched as a plain view.
+ */
+  static int
+_eredis_view_head( eredis_reader_t *r, redisContext *c )
+{
+  size_t eol, next;
+  long long n;
+  eredis_view_t *v;
+  redisReader *rr = c->reader;
+
+  if (_eredis_view_prepare( r, c ) != EREDIS_OK)
+    return EREDIS_ERR;
+
+  while (! (next = _eredis_view_line( rr->buf, rr->pos, rr->len, &eol ))) {
+    if (redisBufferRead( c ) == REDIS_ERR)
+      return EREDIS_ERR;
+  }
+
+  if (rr->buf[ rr->pos ] != '*' ||
+      (n = _eredis_view_integer( rr->buf + rr->pos + 1, rr->buf + eol )) < 0) {
+    if (_eredis_view_fetch( r, c, 0 ) != EREDIS_OK)
+      return EREDIS_ERR;
+    _eredis_view_resolve( r, rr, 0 );
+    return EREDIS_OK;
+  }
+
+  v = r->views;
+  memset( v, 0, sizeof(*v) );
+  v->type = REDIS_REPLY_ARRAY;
+  v->len  = n;
+
+  rr->pos         = next;
+  r->stream_left  = n;
+
+  return EREDIS_OK;
+}
+
+/**
+ * @brief eredis reader reply as a zero-copy view
+ *
+ * Same as eredis_r_reply, but no redisReply is built: the view
+ * indexes the reader's input buffer.
+ * The view and its elements are valid until the next command or
+ * reply on this reader, or its release.
+ * The client-side cache is not used.
+ *
+ * @param r     eredis reader
+ *
+ * @return root view of the reply, NULL on error
+ */
+  const eredis_view_t *
+eredis_r_view( eredis_reader_t *r )
+{
+  redisContext *c;
+  int retry, err;
+  long long us;
+
+  if (r->cmds_replied >= r->cmds_nb) {
+    fprintf(stderr,
+            "eredis: api misuse: all cmds are already replied: %d/%d\n",
+            r->cmds_replied, r->cmds_nb);
+    return NULL;
+  }
+
+  /* Retry allowed if already connected */
+  retry = (r->ctx) ? r->e->reader_retry : 0;
+
+  do {
+    if (_eredis_r_send( r, &c ) == EREDIS_ERR)
+      break;
+
+    us  = _eredis_now_us();
+    err = _eredis_view_get( r, c );
+    us  = _eredis_now_us() - us;
+
+    _eredis_stats_reply( r, us, err != EREDIS_OK );
+
+    if (err == EREDIS_OK) {
+      /* Good */
+      if (r->e->slowlog_us && us >= r->e->slowlog_us)
+        _eredis_slowlog_r( r, us, NULL, r->cmds_replied );
+      r->cmds_requested = r->cmds_nb;
+      _eredis_r_free_reply( r );
+      r->cmds_replied ++;
+      return r->views;
+    }
+
+    /* Bad */
+    /* retry? */
+    if (! _eredis_r_failed( r, c ))
+      break;
+
+  } while ( retry -- >0 );
+
+  return NULL;
+}
+
+/**
+ * @brief view type (REDIS_REPLY_*)
+ */
+  int
+eredis_view_type( const eredis_view_t *v )
+{
+  return v->type;
+}
+
+/**
+ * @brief view length: string length or number of array elements
+ */
+  size_t
+eredis_view_len( const eredis_view_t *v )
+{
+  return v->len;
+}
+
+/**
+ * @brief view string (status, error, string) - NOT nul terminated
+ */
+  const char *
+eredis_view_ptr( const eredis_view_t *v )
+{
+  return v->str;
+}
+
+/**
+ * @brief view integer value
+ */
+  long long
+eredis_view_integer( const eredis_view_t *v )
+{
+  return v->integer;
+}
+
+/**
+ * @brief view array element
+ *
+ * @param v view of an array
+ * @param i element index
+ *
+ * @return element view, NULL if out of range
+ */
+  const eredis_view_t *
+eredis_view_element( const eredis_view_t *v, size_t i )
+{
+  if (v->type != REDIS_REPLY_ARRAY || i >= v->len)
+    return NULL;
+  return &v->element[i];
+}
+
+/**
+ * @brief Build a redisReply from a view (opt-in full tree)
+ *
+ * The reply is detached: it must be freed via eredis_reply_free.
+ *
+ * @param v view
+ *
+ * @return reply, NULL on allocation failure
+ */
+  eredis_reply_t *
+eredis_view_reply( const eredis_view_t *v )
+{
+  size_t i;
+  redisReply *d;
+
+  d = calloc( 1, sizeof(redisReply) );
+  if (! d)
+    return NULL;
+
+  d->type     = v->type;
+  d->integer  = v->integer;
+
+  switch (v->type) {
+    case REDIS_REPLY_STRING:
+    case REDIS_REPLY_STATUS:
+    case REDIS_REPLY_ERROR:
+      d->len = v->len;
+      d->str = malloc( v->len + 1 );
+      if (! d->str)
+        goto err;
+      memcpy( d->str, v->str, v->len );
+      d->str[ v->len ] = '\0';
+      break;
+
+    case REDIS_REPLY_ARRAY:
+      if (! v->len)
+        break;
+      d->element = calloc( v->len, sizeof(redisReply*) );
+      if (! d->element)
+        goto err;
+      d->elements = v->len;
+      for (i=0; i<v->len; i++) {
+        d->element[i] = eredis_view_reply( &v->element[i] );
+        if (! d->element[i])
+          goto err;
+      }
+      break;
+  }
+
+  return d;
+
+err:
+  freeReplyObject( d );
+  return NULL;
+}
+
+/**
+ * @brief eredis reader stream begin
+ *
+ * Same as eredis_r_view, but the elements of an array reply are not
+ * parsed: they are then got by chunks via eredis_r_stream_next.
+ * Memory is bounded by the chunk size, not the reply size.
+ *
+ * The stream must be terminated via eredis_r_stream_end before any
+ * other call on this reader.
+ *
+ * @param r     eredis reader
+ *
+ * @return root view: for an array, elements are not available and
+ * the length is the number of elements to stream.
+ * NULL on error.
+ */
+  const eredis_view_t *
+eredis_r_stream_begin( eredis_reader_t *r )
+{
+  redisContext *c;
+  int retry, err;
+  long long us;
+
+  if (r->cmds_replied >= r->cmds_nb) {
+    fprintf(stderr,
+            "eredis: api misuse: all cmds are already replied: %d/%d\n",
+            r->cmds_replied, r->cmds_nb);
+    return NULL;
+  }
+
+  /* Retry allowed if already connected */
+  retry = (r->ctx) ? r->e->reader_retry : 0;
+
+  do {
+    if (_eredis_r_send( r, &c ) == EREDIS_ERR)
+      break;
+
+    us  = _eredis_now_us();
+    err = _eredis_view_head( r, c );
+    us  = _eredis_now_us() - us;
+
+    _eredis_stats_reply( r, us, err != EREDIS_OK );
+
+    if (err == EREDIS_OK) {
+      /* Good */
+      if (r->e->slowlog_us && us >= r->e->slowlog_us)
+        _eredis_slowlog_r( r, us, NULL, r->cmds_replied );
+      r->cmds_requested = r->cmds_nb;
+      _eredis_r_free_reply( r );
+      r->cmds_replied ++;
+      return r->views;
+    }
+
+    /* Bad */
+    /* retry? */
+    if (! _eredis_r_failed( r, c ))
+      break;
+
+  } while ( retry -- >0 );
+
+  return NULL;
+}
+
+/**
+ * @brief eredis reader stream next elements
+ *
+ * Up to 'max' elements are parsed. It blocks only if none is
+ * available yet.
+ * Elements are consecutive and valid until the next call on this
+ * reader.
+ *
+ * No retry: on error the connection is dropped and the stream ended.
+ *
+ * @param r     eredis reader
+ * @param elems first element
+ * @param max   max number of elements (chunk)
+ *
+ * @return number of elements, 0 at end of stream, -1 on error
+ */
+  int
+eredis_r_stream_next( eredis_reader_t *r,
+                      const eredis_view_t **elems, size_t max )
+{
+  size_t nb, got, mark;
+  int err;
+  view_parse_t ps;
+  redisReader *rr;
+  redisContext *c = r->ctx;
+
+  if (! r->stream_left || ! c)
+    return 0;
+
+  rr = c->reader;
+
+  /* Previous chunk is gone */
+  if (rr->pos >= VIEW_COMPACT_AFTER) {
+    sdsrange( rr->buf, rr->pos, -1 );
+    rr->pos = 0;
+    rr->len = sdslen( rr->buf );
+  }
+
+  /* Root is kept, elements are consecutive after it */
+  nb = (max && max < r->stream_left) ? max : r->stream_left;
+  r->views_nb = 1;
+  if (_eredis_view_reserve( r, nb ) != EREDIS_OK)
+    goto err;
+  r->views_nb += nb;
+
+  for (got=0; got<nb; got++) {
+    mark = r->views_nb;
+    memset( &ps, 0, sizeof(ps) );
+    ps.p    = rr->pos;
+    ps.slot = 1 + got;
+
+    while ((err = _eredis_view_parse( r, rr, &ps )) == VIEW_NEED_MORE) {
+      /* Do not wait for a full chunk */
+      if (got) {
+        /* Drop the nodes of this partial element and the unused
+         * element slots: children follow the 'got' elements */
+        _eredis_view_close( r, 1 + got, 1 + nb, mark );
+        goto out;
+      }
+      if (redisBufferRead( c ) == REDIS_ERR)
+        goto err;
+    }
+
+    if (err != EREDIS_OK) {
+      __redisSetError( c, REDIS_ERR_PROTOCOL, "eredis: view parse error" );
+      goto err;
+    }
+
+    rr->pos = ps.p;
+  }
+
+out:
+  _eredis_view_resolve( r, rr, 1 );
+
+  r->stream_left -= got;
+  *elems = &r->views[1];
+
+  return (int)got;
+
+err:
+  r->stream_left = 0;
+  _eredis_r_ctx( r, 1 );
+  return -1;
+}
+
+/**
+ * @brief eredis reader stream end
+ *
+ * Elements left are read and dropped, by chunks.
+ *
+ * @param r     eredis reader
+ */
+  void
+eredis_r_stream_end( eredis_reader_t *r )
+{
+  const eredis_view_t *elems;
+
+  while (eredis_r_stream_next( r, &elems, 1024 ) > 0)
+    ;
+}
@@ -0,0 +1,385 @@
+
+#include <unistd.h>
+#include <stdio.h>
+#include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "eredis.h"
+
+/*
+ * Throughput and latency of the eredis paths.
+ *
+ * Usage: eredis-bench [-f host-file] [-n requests] [-c threads]
+ *                     [-P pipeline] [-d size] [-t tests] [-j]
+ *
+ * Tests (-t, comma separated, default all):
+ * - write:  async mirrored SET (eredis_w_cmd), latency of the enqueue,
+ *           ops/s up to the write queue drained
+ * - read:   pooled sync GET (eredis_r_cmd) from 'threads' threads
+ * - pipe:   GET by batches of 'pipeline' from 'threads' threads,
+ *           latency of the batch for each command (as redis-benchmark)
+ * - pubsub: PUBLISH (eredis_w_cmd) to an eredis_sub callback, latency
+ *           from publish to delivery
+ *
+ * -j: one JSON document, for comparisons across releases and
+ *     configurations.
+ */
+
+typedef struct bench_s {
+  const char          *name;
+  long long           nb;
+  long long           errors;
+  double              secs;
+  unsigned long long  hist[ EREDIS_STATS_HIST ];
+} bench_t;
+
+static eredis_t *e;
+
+static long long nb      = 100000;
+static int       threads = 8;
+static int       pipe_nb = 16;
+static int       size    = 3;
+static int       json    = 0;
+
+static char *value;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+  static long long
+now_us( void )
+{
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/*
+ * Histogram with the eredis buckets: eredis_stats_percentile
+ */
+  static void
+hist_add( unsigned long long *hist, long long us )
+{
+  int lo = 0, hi = EREDIS_STATS_HIST - 1, mid;
+
+  while (lo < hi) {
+    mid = (lo + hi + 1) / 2;
+    if (eredis_stats_hist_value( mid ) <= us)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+
+  hist[ lo ] ++;
+}
+
+  static void
+hist_merge( bench_t *b, const unsigned long long *hist )
+{
+  int i;
+
+  pthread_mutex_lock( &lock );
+  for (i=0; i<EREDIS_STATS_HIST; i++)
+    b->hist[i] += hist[i];
+  pthread_mutex_unlock( &lock );
+}
+
+  static void
+report( bench_t *b, int first )
+{
+  double ops = (b->secs > 0) ? b->nb / b->secs : 0;
+
+  if (json) {
+    printf("%s\n    { \"test\": \"%s\", \"requests\": %lld, "
+           "\"errors\": %lld, \"seconds\": %.3f, \"ops_per_sec\": %.0f,\n"
+           "      \"p50_us\": %lld, \"p99_us\": %lld, \"p999_us\": %lld }",
+           first ? "" : ",",
+           b->name, b->nb, b->errors, b->secs, ops,
+           eredis_stats_percentile( b->hist, 50. ),
+           eredis_stats_percentile( b->hist, 99. ),
+           eredis_stats_percentile( b->hist, 99.9 ));
+    return;
+  }
+
+  printf("%-8s %10lld %8lld %12.0f %10lld %10lld %10lld\n",
+         b->name, b->nb, b->errors, ops,
+         eredis_stats_percentile( b->hist, 50. ),
+         eredis_stats_percentile( b->hist, 99. ),
+         eredis_stats_percentile( b->hist, 99.9 ));
+}
+
+/*
+ * write: async mirrored
+ */
+  static void
+bench_write( bench_t *b )
+{
+  long long i, t0 = now_us(), us;
+
+  for (i=0; i<nb; i++) {
+    us = now_us();
+    if (eredis_w_cmd( e, "SET bench:%lld %s", i % 10000, value ) != EREDIS_OK)
+      b->errors ++;
+    hist_add( b->hist, now_us() - us );
+  }
+
+  while (eredis_w_pending( e ))
+    usleep(100);
+
+  b->nb   = nb;
+  b->secs = (now_us() - t0) / 1e6;
+}
+
+/*
+ * read / pipe: pooled readers
+ */
+typedef struct thr_s {
+  bench_t             *b;
+  int                 id;
+  int                 pipe;
+  pthread_t           thr;
+} thr_t;
+
+  static void *
+reader_thr( void *vt )
+{
+  thr_t *t = vt;
+  unsigned long long hist[ EREDIS_STATS_HIST ];
+  long long i, j, k, n, errors = 0, us;
+  eredis_reader_t *reader;
+  eredis_reply_t *reply;
+
+  memset( hist, 0, sizeof(hist) );
+
+  n = nb / threads + ((t->id < nb % threads) ? 1 : 0);
+
+  for (i=0; i<n; i+=j) {
+    /* From the pool at each batch */
+    reader = eredis_r( e );
+    if (! reader) {
+      errors += n - i;
+      break;
+    }
+
+    us = now_us();
+
+    if (! t->pipe) {
+      j = 1;
+      reply = eredis_r_cmd( reader, "GET bench:%lld", i % 10000 );
+      if (! reply || reply->type == REDIS_REPLY_ERROR)
+        errors ++;
+    }
+    else {
+      for (j=0; j<t->pipe && i+j<n; j++)
+        eredis_r_append_cmd( reader, "GET bench:%lld", (i+j) % 10000 );
+      for (j=0; j<t->pipe && i+j<n; j++) {
+        reply = eredis_r_reply( reader );
+        if (! reply || reply->type == REDIS_REPLY_ERROR)
+          errors ++;
+      }
+    }
+
+    us = now_us() - us;
+    for (k=0; k<j; k++)
+      hist_add( hist, us );
+
+    eredis_r_release( reader );
+  }
+
+  hist_merge( t->b, hist );
+  __sync_fetch_and_add( &t->b->errors, errors );
+
+  return NULL;
+}
+
+  static void
+bench_read( bench_t *b, int pipe )
+{
+  thr_t *t = calloc( threads, sizeof(thr_t) );
+  long long t0 = now_us();
+  int i;
+
+  for (i=0; i<threads; i++) {
+    t[i].b    = b;
+    t[i].id   = i;
+    t[i].pipe = pipe;
+    pthread_create( &t[i].thr, NULL, reader_thr, &t[i] );
+  }
+  for (i=0; i<threads; i++)
+    pthread_join( t[i].thr, NULL );
+
+  b->nb   = nb;
+  b->secs = (now_us() - t0) / 1e6;
+
+  free( t );
+}
+
+/*
+ * pubsub: publish time in the message
+ */
+static volatile long long sub_nb = 0;
+static volatile int sub_ready = 0;
+
+  static void
+sub_cb( const char *channel, const char *msg, size_t len, void *data )
+{
+  bench_t *b = data;
+  char buf[32];
+
+  (void) channel;
+
+  if (! msg || ! len || len >= sizeof(buf))
+    return;
+
+  if (*msg == 'r') {
+    sub_ready = 1;
+    return;
+  }
+
+  memcpy( buf, msg, len );
+  buf[ len ] = '\0';
+
+  /* Event loop thread only */
+  hist_add( b->hist, now_us() - atoll( buf ) );
+  sub_nb ++;
+}
+
+  static void
+bench_pubsub( bench_t *b )
+{
+  long long i, t0;
+
+  eredis_sub( e, "bench:chan", sub_cb, b );
+
+  for (i=0; i<300 && ! sub_ready; i++) {
+    eredis_w_cmd( e, "PUBLISH bench:chan ready" );
+    usleep(10000);
+  }
+  if (! sub_ready) {
+    b->errors = nb;
+    goto out;
+  }
+
+  t0 = now_us();
+  for (i=0; i<nb; i++)
+    eredis_w_cmd( e, "PUBLISH bench:chan %lld", now_us() );
+
+  /* Wait for the last messages (up to 10s without progress) */
+  for (i=0; sub_nb < nb && i<10000; i++) {
+    long long prev = sub_nb;
+    usleep(1000);
+    if (sub_nb != prev)
+      i = 0;
+  }
+
+  b->nb     = sub_nb;
+  b->errors = nb - sub_nb;
+  b->secs   = (now_us() - t0) / 1e6;
+
+out:
+  eredis_unsub( e, "bench:chan" );
+}
+
+  static int
+test_on( const char *tests, const char *name )
+{
+  const char *p = tests;
+  size_t l = strlen( name );
+
+  while ((p = strstr( p, name ))) {
+    if ((p == tests || p[-1] == ',') && (p[l] == ',' || p[l] == '\0'))
+      return 1;
+    p += l;
+  }
+  return 0;
+}
+
+  static void
+usage( const char *prog )
+{
+  fprintf(stderr,
+          "Usage: %s [-f host-file] [-n requests] [-c threads] "
+          "[-P pipeline] [-d size] [-t write,read,pipe,pubsub] [-j]\n",
+          prog);
+  exit(1);
+}
+
+  int
+main( int argc, char *argv[] )
+{
+  const char *host_file = "test-hosts.conf";
+  const char *tests = "write,read,pipe,pubsub";
+  bench_t b;
+  int opt, first = 1;
+
+  while ((opt = getopt( argc, argv, "f:n:c:P:d:t:j" )) != -1) {
+    switch (opt) {
+      case 'f': host_file = optarg; break;
+      case 'n': nb        = atoll( optarg ); break;
+      case 'c': threads   = atoi( optarg ); break;
+      case 'P': pipe_nb   = atoi( optarg ); break;
+      case 'd': size      = atoi( optarg ); break;
+      case 't': tests     = optarg; break;
+      case 'j': json      = 1; break;
+      default:  usage( argv[0] );
+    }
+  }
+  if (nb <= 0 || threads <= 0 || pipe_nb <= 0 || size <= 0)
+    usage( argv[0] );
+
+  value = malloc( size + 1 );
+  memset( value, 'x', size );
+  value[ size ] = '\0';
+
+  /* cancel sigpipe */
+  signal(SIGPIPE, SIG_IGN);
+
+  /* eredis */
+  e = eredis_new();
+
+  /* conf */
+  if (eredis_host_file( e, host_file )<=0) {
+    fprintf(stderr, "Unable to load conf %s\n", host_file);
+    exit(1);
+  }
+
+  eredis_r_max( e, threads );
+
+  /* async writes and pub/sub */
+  eredis_run_thr( e );
+
+  if (json)
+    printf("{ \"requests\": %lld, \"threads\": %d, \"pipeline\": %d, "
+           "\"size\": %d,\n  \"results\": [", nb, threads, pipe_nb, size);
+  else
+    printf("%-8s %10s %8s %12s %10s %10s %10s\n",
+           "test", "requests", "errors", "ops/s",
+           "p50 us", "p99 us", "p99.9 us");
+
+#define BENCH(_name, _call)                       \
+  if (test_on( tests, _name )) {                  \
+    memset( &b, 0, sizeof(b) );                   \
+    b.name = _name;                               \
+    _call;                                        \
+    report( &b, first );                          \
+    first = 0;                                    \
+    fflush( stdout );                             \
+  }
+
+  /* write first: keys for the reads */
+  BENCH( "write",  bench_write( &b ) );
+  BENCH( "read",   bench_read( &b, 0 ) );
+  BENCH( "pipe",   bench_read( &b, pipe_nb ) );
+  BENCH( "pubsub", bench_pubsub( &b ) );
+
+  if (json)
+    printf("\n  ]\n}\n");
+
+  eredis_free( e );
+
+  free( value );
+
+  return 0;
+}
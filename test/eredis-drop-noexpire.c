@@ -17,22 +17,44 @@
 /*
  * Drop all records without expire
  *
- * Launch a 'SCAN' command, check 'TTL' of each record and
+ * SCAN iterator with a pipelined 'TTL' per key, and
  * issue a DEL if TTL is -1.
  * One reader and async loop: 2 connections.
  *
  * One main function to make it fast to read.
- *
- * Most of the code is reply processing
  */
 
+static eredis_t *e;
+
+/*
+ * Per key: TTL reply in follow[0]
+ */
+  static int
+drop_cb( eredis_reply_t *key, eredis_reply_t *val,
+         eredis_reply_t **follow, void *data )
+{
+  int *dropped = data;
+
+  if (key->type != REDIS_REPLY_STRING ||
+      follow[0]->type != REDIS_REPLY_INTEGER)
+    return 0;
+
+  if (follow[0]->integer == -1) {
+    /* no expire - drop it in async */
+    eredis_w_cmd( e, "DEL %b", key->str, key->len );
+    (*dropped) ++;
+    /*printf("Dropped: %s\n", key->str);*/
+  }
+
+  return 0;
+}
+
   int
 main( int argc, char *argv[] )
 {
   int i, dropped = 0;
-  char cursor[32];
-  eredis_t *e;
-  eredis_reader_t *reader;
+  long long scanned;
+  eredis_scan_t *scan;
 
   if (argc==1) {
     fprintf(stderr,
@@ -67,89 +89,23 @@ main( int argc, char *argv[] )
   /* Launch the async context */
   eredis_run_thr( e );
 
-  /* a reader */
-  reader = eredis_r( e );
-
-  /* cursor start */
-  cursor[0] = '0';
-  cursor[1] = '\0';
-  do {
-    eredis_reply_t *scan_reply, **subs;
-    size_t k_nb;
-
-    scan_reply = eredis_r_cmd( reader, "SCAN %s", cursor );
-    if (! scan_reply) {
-      fprintf(stderr, "Failed to connect\n");
-      break;
-    }
+  /* SCAN, TTL of each key pipelined with the next SCAN */
+  scan = eredis_scan_new( e, "SCAN", NULL );
+  eredis_scan_follow( scan, "TTL" );
 
-    /* Detach it */
-    eredis_r_reply_detach( reader );
-
-    /* Validate the reply */
-    if (scan_reply->type != REDIS_REPLY_ARRAY
-        ||
-        scan_reply->elements != 2
-        ||
-        !(subs = scan_reply->element)
-        ||
-        subs[0]->type != REDIS_REPLY_STRING
-        ||
-        subs[1]->type != REDIS_REPLY_ARRAY)
-    {
-      fprintf(stderr, "Not compliant reply to SCAN command\n");
-      eredis_reply_dump( scan_reply );
-      break;
-    }
+  scanned = eredis_scan_run( scan, 1, drop_cb, &dropped );
+  if (scanned < 0)
+    fprintf(stderr, "Failed to scan\n");
 
-    /* My next cursor in [0], copy '\0' */
-    memcpy( cursor, subs[0]->str, subs[0]->len + 1 );
-
-    /* My keys to check in [1], jump to subs */
-    k_nb = subs[1]->elements;
-    subs = subs[1]->element;
-
-    if (subs) {
-      for (i=0; i<k_nb; i++) {
-        eredis_reply_t *look_reply;
-        char *k;
-
-        k = subs[i]->str;
-        if (! k)
-          continue;
-
-        /* lookup ttl for this one */
-        look_reply = eredis_r_cmd( reader, "TTL %s", k );
-        if (
-          ! look_reply
-          ||
-          look_reply->type != REDIS_REPLY_INTEGER)
-          continue;
-
-        if (look_reply->integer == -1) {
-          /* no expire - drop it in async */
-          eredis_w_cmd( e, "DEL %s", k );
-          dropped ++;
-          /*printf("Dropped: %s\n", k);*/
-        }
-      }
-    }
-
-    /* Drop the detached scan reply */
-    eredis_reply_free( scan_reply );
-
-  } while (cursor[0] != '0'); /* iteration ends at 0 */
+  eredis_scan_free( scan );
 
   printf("%d record(s) dropped\n", dropped);
 
-  eredis_r_release( reader );
-
   /* Wait for possible async pending commands to end */
   while (eredis_w_pending( e ))
     usleep(1000);
 
   eredis_free( e );
 
-  return 0;
+  return (scanned < 0) ? 1 : 0;
 }
-
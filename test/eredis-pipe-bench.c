@@ -0,0 +1,135 @@
+
+#include <unistd.h>
+#include <stdio.h>
+#include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "eredis.h"
+
+/*
+ * Pipeline throughput across window sizes.
+ *
+ * Usage: eredis-pipe-bench [host-file] [commands]
+ *
+ * For each window: 'commands' SET then GET in pipeline mode.
+ * Window 0 is the classic way: all appended, then all replied.
+ */
+
+static int windows[] = { 0, 1, 16, 128, 1024, 8192, -1 };
+
+static long long replies;
+static long long errors;
+
+  static double
+now( void )
+{
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+  static void
+reply_cb( eredis_reply_t *reply, void *data )
+{
+  (void)data;
+
+  replies ++;
+  if (reply->type == REDIS_REPLY_ERROR)
+    errors ++;
+}
+
+  static int
+bench( eredis_reader_t *reader, int window, int nb, const char *cmd )
+{
+  int i;
+
+  replies = errors = 0;
+
+  /* Classic: all in memory */
+  if (! window) {
+    for (i=0; i<nb; i++)
+      if (eredis_r_append_cmd( reader, cmd, i, i ) != EREDIS_OK)
+        return EREDIS_ERR;
+    for (i=0; i<nb; i++) {
+      eredis_reply_t *reply = eredis_r_reply( reader );
+      if (! reply)
+        return EREDIS_ERR;
+      reply_cb( reply, NULL );
+    }
+    eredis_r_clear( reader );
+    return EREDIS_OK;
+  }
+
+  eredis_r_pipe( reader, window, reply_cb, NULL );
+  for (i=0; i<nb; i++)
+    if (eredis_r_pipe_cmd( reader, cmd, i, i ) != EREDIS_OK)
+      break;
+
+  return eredis_r_pipe_end( reader );
+}
+
+  int
+main( int argc, char *argv[] )
+{
+  /* optional command line arguments */
+  const char *host_file = "test-hosts.conf";
+  int i, nb = 100000, ret = 0;
+  eredis_t *e;
+  eredis_reader_t *reader;
+  double t;
+
+  if (argc >= 2)
+    host_file = argv[1];
+  if (argc >= 3)
+    nb = atoi( argv[2] );
+
+  /* cancel sigpipe */
+  signal(SIGPIPE, SIG_IGN);
+
+  /* eredis */
+  e = eredis_new();
+
+  /* conf */
+  if (eredis_host_file( e, host_file )<=0) {
+    fprintf(stderr, "Unable to load conf %s\n", host_file);
+    exit(1);
+  }
+
+  reader = eredis_r( e );
+
+  printf("%8s %12s %12s\n", "window", "SET ops/s", "GET ops/s");
+
+  for (i=0; windows[i] >= 0; i++) {
+    double set_rate, get_rate;
+
+    t = now();
+    if (bench( reader, windows[i], nb, "SET bench:pipe:%d %d" ) != EREDIS_OK
+        || replies != nb || errors) {
+      fprintf(stderr, "SET failed for window %d: %lld/%d replies\n",
+              windows[i], replies, nb);
+      ret = 1;
+      break;
+    }
+    set_rate = nb / (now() - t);
+
+    t = now();
+    if (bench( reader, windows[i], nb, "GET bench:pipe:%d" ) != EREDIS_OK
+        || replies != nb || errors) {
+      fprintf(stderr, "GET failed for window %d: %lld/%d replies\n",
+              windows[i], replies, nb);
+      ret = 1;
+      break;
+    }
+    get_rate = nb / (now() - t);
+
+    printf("%8d %12.0f %12.0f\n", windows[i], set_rate, get_rate);
+  }
+
+  eredis_r_release( reader );
+
+  eredis_free( e );
+
+  return ret;
+}
@@ -0,0 +1,267 @@
+
+/* Internal structures: built with the eredis sources, no network */
+#include "eredis.c"
+
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+/*
+ * Write queue and reader pool contention.
+ *
+ * Usage: eredis-queue-bench [-n ops per thread] [-t max threads]
+ *                           [-r pool size] [-j]
+ *
+ * - wqueue: 1..'max threads' producers (_eredis_wqueue_push), one
+ *   consumer (_eredis_wqueue_shift)
+ * - rqueue: 1..'max threads' threads, _eredis_rqueue_get and
+ *   _eredis_rqueue_release churn on a pool of 'pool size' readers
+ *
+ * Per thread count: ns per op, Mops/s and cache misses per op
+ * (perf_event_open, '-' if not permitted).
+ */
+
+static long long nb        = 200000;
+static int       thr_max   = 64;
+static int       pool      = 8;
+static int       json      = 0;
+
+static eredis_t *e;
+
+static volatile int go;
+
+static char cmd[] = "*1\r\n$4\r\nPING\r\n";
+
+  static long long
+now_ns( void )
+{
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * Cache misses of the process, threads created after included
+ */
+  static int
+misses_open( void )
+{
+  struct perf_event_attr pe;
+
+  memset( &pe, 0, sizeof(pe) );
+  pe.type           = PERF_TYPE_HARDWARE;
+  pe.size           = sizeof(pe);
+  pe.config         = PERF_COUNT_HW_CACHE_MISSES;
+  pe.disabled       = 1;
+  pe.inherit        = 1;
+  pe.exclude_kernel = 1;
+  pe.exclude_hv     = 1;
+
+  return syscall( __NR_perf_event_open, &pe, 0, -1, -1, 0 );
+}
+
+  static long long
+misses_read( int fd )
+{
+  long long v;
+
+  if (fd < 0 || read( fd, &v, sizeof(v) ) != sizeof(v))
+    return -1;
+
+  return v;
+}
+
+/*
+ * Thread start barrier
+ */
+  static void
+wait_go( void )
+{
+  while (! go)
+    __sync_synchronize();
+}
+
+  static void *
+wqueue_producer( void *v )
+{
+  long long i;
+
+  (void) v;
+
+  wait_go();
+
+  for (i=0; i<nb; i++)
+    _eredis_wqueue_push( e, cmd, sizeof(cmd) - 1 );
+
+  return NULL;
+}
+
+  static void *
+wqueue_consumer( void *v )
+{
+  long long left = *(long long *)v;
+  int l;
+
+  wait_go();
+
+  while (left)
+    if (_eredis_wqueue_shift( e, &l ))
+      left --;
+
+  return NULL;
+}
+
+  static void *
+rqueue_churn( void *v )
+{
+  eredis_reader_t *r;
+  long long i;
+
+  (void) v;
+
+  wait_go();
+
+  for (i=0; i<nb; i++) {
+    r = _eredis_rqueue_get( e, 0 );
+    if (r)
+      _eredis_rqueue_release( r );
+  }
+
+  return NULL;
+}
+
+/*
+ * Run 'thr' threads of 'fn' (and 'extra', if any), return the time (ns)
+ */
+  static long long
+run( int thr, void *(*fn)(void *), void *(*extra)(void *), void *arg,
+     long long *misses )
+{
+  pthread_t *t = calloc( thr + 1, sizeof(pthread_t) );
+  int i, fd;
+  long long t0;
+
+  go = 0;
+
+  fd = misses_open();
+
+  for (i=0; i<thr; i++)
+    pthread_create( &t[i], NULL, fn, arg );
+  if (extra)
+    pthread_create( &t[thr], NULL, extra, arg );
+
+  if (fd >= 0) {
+    ioctl( fd, PERF_EVENT_IOC_RESET, 0 );
+    ioctl( fd, PERF_EVENT_IOC_ENABLE, 0 );
+  }
+
+  t0 = now_ns();
+  __sync_synchronize();
+  go = 1;
+
+  for (i=0; i<thr; i++)
+    pthread_join( t[i], NULL );
+  if (extra)
+    pthread_join( t[thr], NULL );
+
+  t0 = now_ns() - t0;
+
+  if (fd >= 0)
+    ioctl( fd, PERF_EVENT_IOC_DISABLE, 0 );
+  *misses = misses_read( fd );
+  if (fd >= 0)
+    close( fd );
+
+  free( t );
+
+  return t0;
+}
+
+  static void
+report( const char *name, int thr, long long ns, long long misses,
+        int first )
+{
+  long long ops = nb * thr;
+
+  if (json) {
+    printf("%s\n    { \"bench\": \"%s\", \"threads\": %d, \"ops\": %lld, "
+           "\"ns_per_op\": %.1f, \"mops_per_sec\": %.2f, "
+           "\"misses_per_op\": %.3f }",
+           first ? "" : ",", name, thr, ops,
+           (double)ns / ops, ops * 1e3 / ns,
+           (misses < 0) ? -1. : (double)misses / ops);
+    return;
+  }
+
+  printf("%-8s %8d %12.1f %10.2f ", name, thr,
+         (double)ns / ops, ops * 1e3 / ns);
+  if (misses < 0)
+    printf("%12s\n", "-");
+  else
+    printf("%12.3f\n", (double)misses / ops);
+  fflush( stdout );
+}
+
+  static void
+usage( const char *prog )
+{
+  fprintf(stderr, "Usage: %s [-n ops per thread] [-t max threads] "
+          "[-r pool size] [-j]\n", prog);
+  exit(1);
+}
+
+  int
+main( int argc, char *argv[] )
+{
+  long long ns, misses, total;
+  int opt, thr, first = 1;
+
+  while ((opt = getopt( argc, argv, "n:t:r:j" )) != -1) {
+    switch (opt) {
+      case 'n': nb      = atoll( optarg ); break;
+      case 't': thr_max = atoi( optarg ); break;
+      case 'r': pool    = atoi( optarg ); break;
+      case 'j': json    = 1; break;
+      default:  usage( argv[0] );
+    }
+  }
+  if (nb <= 0 || thr_max <= 0 || pool <= 0)
+    usage( argv[0] );
+
+  e = eredis_new();
+  eredis_r_max( e, pool );
+
+  if (json)
+    printf("{ \"ops_per_thread\": %lld, \"pool\": %d,\n  \"results\": [",
+           nb, pool);
+  else
+    printf("%-8s %8s %12s %10s %12s\n",
+           "bench", "threads", "ns/op", "Mops/s", "misses/op");
+
+  /* Write queue: producers, one consumer */
+  for (thr=1; thr<=thr_max; thr*=2) {
+    total = nb * thr;
+    ns = run( thr, wqueue_producer, wqueue_consumer, &total, &misses );
+    report( "wqueue", thr, ns, misses, first );
+    first = 0;
+  }
+
+  /* Reader pool churn */
+  for (thr=1; thr<=thr_max; thr*=2) {
+    ns = run( thr, rqueue_churn, NULL, NULL, &misses );
+    report( "rqueue", thr, ns, misses, first );
+  }
+
+  if (json)
+    printf("\n  ]\n}\n");
+
+  eredis_free( e );
+
+  return 0;
+}
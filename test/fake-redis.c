@@ -0,0 +1,814 @@
+/**
+ * @file fake-redis.c
+ * @brief In-process RESP server for the tests and benchmarks
+ */
+
+#define _GNU_SOURCE
+
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "fake-redis.h"
+
+#define RULES_MAX       32
+#define CONNS_MAX       256
+#define BUF_SIZE        65536
+#define ARGS_MAX        64
+
+/* Latency and error rule of a command ("*": all) */
+typedef struct rule_s {
+  char                cmd[ 32 ];
+  int                 min_us;
+  int                 max_us;
+  double              tail_pct;
+  int                 tail_us;
+  char                *err;
+} rule_t;
+
+typedef struct kv_s {
+  struct kv_s         *next;
+  char                *key;
+  size_t              key_len;
+  char                *val;
+  size_t              val_len;
+} kv_t;
+
+typedef struct conn_s {
+  fake_redis_t        *f;
+  int                 fd;
+  int                 used;
+  pthread_t           thr;
+  size_t              written;
+} conn_t;
+
+struct fake_redis_s {
+  pthread_mutex_t     lock;
+  pthread_t           thr;
+  volatile int        stop;
+
+  int                 lfd;
+  int                 port;
+  volatile int        want_down;
+
+  rule_t              rules[ RULES_MAX ];
+  int                 rules_nb;
+  size_t              reset_after;
+  size_t              chunk;
+  int                 chunk_delay;
+  int                 blackhole;
+  unsigned int        seed;
+
+  kv_t                *kv;
+
+  conn_t              conns[ CONNS_MAX ];
+
+  fake_redis_stats_t  stats;
+};
+
+/*
+ * Listen, port 0: ephemeral
+ */
+  static int
+_fr_listen( int port, int *pport )
+{
+  struct sockaddr_in sa;
+  socklen_t sl = sizeof(sa);
+  int fd, on = 1;
+
+  fd = socket( AF_INET, SOCK_STREAM, 0 );
+  if (fd < 0)
+    return -1;
+
+  setsockopt( fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on) );
+
+  memset( &sa, 0, sizeof(sa) );
+  sa.sin_family       = AF_INET;
+  sa.sin_port         = htons( port );
+  sa.sin_addr.s_addr  = htonl( INADDR_LOOPBACK );
+
+  if (bind( fd, (struct sockaddr *)&sa, sizeof(sa) ) ||
+      listen( fd, 128 ) ||
+      getsockname( fd, (struct sockaddr *)&sa, &sl )) {
+    close( fd );
+    return -1;
+  }
+
+  if (pport)
+    *pport = ntohs( sa.sin_port );
+
+  return fd;
+}
+
+/*
+ * Key/value store (under lock)
+ */
+  static kv_t *
+_fr_kv( fake_redis_t *f, const char *key, size_t len, kv_t ***pprev )
+{
+  kv_t **prev, *kv;
+
+  for (prev = &f->kv; (kv = *prev); prev = &kv->next)
+    if (kv->key_len == len && ! memcmp( kv->key, key, len ))
+      break;
+
+  if (pprev)
+    *pprev = prev;
+
+  return kv;
+}
+
+  static void
+_fr_kv_set( fake_redis_t *f, const char *key, size_t key_len,
+            const char *val, size_t val_len )
+{
+  kv_t *kv = _fr_kv( f, key, key_len, NULL );
+
+  if (! kv) {
+    kv          = calloc( 1, sizeof(kv_t) );
+    kv->key     = malloc( key_len + 1 );
+    memcpy( kv->key, key, key_len );
+    kv->key_len = key_len;
+    kv->next    = f->kv;
+    f->kv       = kv;
+  }
+
+  free( kv->val );
+  kv->val     = malloc( val_len + 1 );
+  memcpy( kv->val, val, val_len );
+  kv->val_len = val_len;
+}
+
+  static int
+_fr_kv_del( fake_redis_t *f, const char *key, size_t len )
+{
+  kv_t **prev, *kv = _fr_kv( f, key, len, &prev );
+
+  if (! kv)
+    return 0;
+
+  *prev = kv->next;
+  free( kv->key );
+  free( kv->val );
+  free( kv );
+
+  return 1;
+}
+
+/*
+ * Rule of a command: exact name first, then "*"
+ */
+  static rule_t *
+_fr_rule( fake_redis_t *f, const char *cmd, size_t len )
+{
+  rule_t *all = NULL;
+  int i;
+
+  for (i=0; i<f->rules_nb; i++) {
+    rule_t *r = &f->rules[i];
+    if (r->cmd[0] == '*' && ! r->cmd[1])
+      all = r;
+    else if (strlen( r->cmd ) == len && ! strncasecmp( r->cmd, cmd, len ))
+      return r;
+  }
+
+  return all;
+}
+
+  static rule_t *
+_fr_rule_get( fake_redis_t *f, const char *cmd )
+{
+  rule_t *r;
+
+  if (! cmd)
+    cmd = "*";
+
+  r = _fr_rule( f, cmd, strlen( cmd ) );
+  if (r && ! strcasecmp( r->cmd, cmd ))
+    return r;
+
+  if (f->rules_nb >= RULES_MAX || strlen( cmd ) >= sizeof(r->cmd))
+    return NULL;
+
+  r = &f->rules[ f->rules_nb ++ ];
+  memset( r, 0, sizeof(rule_t) );
+  strcpy( r->cmd, cmd );
+
+  return r;
+}
+
+/*
+ * Parse one command: RESP multibulk or inline.
+ * Return the bytes used, 0 if incomplete, -1 on protocol error.
+ */
+  static int
+_fr_parse( char *buf, size_t len, char **argv, size_t *argl, int *pargc )
+{
+  char *p = buf, *end = buf + len, *nl;
+  long n, l;
+  int argc = 0;
+
+  if (! len)
+    return 0;
+
+  if (*p != '*') {
+    /* Inline */
+    if (! (nl = memchr( p, '\n', len )))
+      return 0;
+    *nl = '\0';
+    if (nl > p && nl[-1] == '\r')
+      nl[-1] = '\0';
+    while (argc < ARGS_MAX) {
+      while (*p == ' ')
+        p ++;
+      if (! *p)
+        break;
+      argv[ argc ] = p;
+      while (*p && *p != ' ')
+        p ++;
+      argl[ argc ] = p - argv[ argc ];
+      argc ++;
+      if (*p)
+        *p++ = '\0';
+    }
+    *pargc = argc;
+    return nl + 1 - buf;
+  }
+
+  if (! (nl = memchr( p, '\n', len )))
+    return 0;
+  n = strtol( p + 1, NULL, 10 );
+  if (n < 0 || n > ARGS_MAX)
+    return -1;
+  p = nl + 1;
+
+  for (argc = 0; argc < n; argc++) {
+    if (p >= end)
+      return 0;
+    if (*p != '$')
+      return -1;
+    if (! (nl = memchr( p, '\n', end - p )))
+      return 0;
+    l = strtol( p + 1, NULL, 10 );
+    if (l < 0)
+      return -1;
+    p = nl + 1;
+    if (end - p < l + 2)
+      return 0;
+    argv[ argc ] = p;
+    argl[ argc ] = l;
+    p += l + 2;
+  }
+
+  *pargc = argc;
+  return p - buf;
+}
+
+/*
+ * Write, in chunks and up to the reset
+ * Return -1 if the connection is closed
+ */
+  static int
+_fr_write( conn_t *c, const char *s, size_t len )
+{
+  fake_redis_t *f = c->f;
+  size_t chunk, reset;
+  int delay;
+  ssize_t w;
+
+  pthread_mutex_lock( &f->lock );
+  chunk = f->chunk;
+  delay = f->chunk_delay;
+  reset = f->reset_after;
+  pthread_mutex_unlock( &f->lock );
+
+  while (len) {
+    size_t l = (chunk && chunk < len) ? chunk : len;
+    int rst = 0;
+
+    if (reset && c->written + l >= reset) {
+      l   = (c->written < reset) ? reset - c->written : 0;
+      rst = 1;
+    }
+
+    if (l) {
+      w = send( c->fd, s, l, MSG_NOSIGNAL );
+      if (w <= 0)
+        return -1;
+      s           += w;
+      len         -= w;
+      c->written  += w;
+      if ((size_t)w < l)
+        continue;
+    }
+
+    if (rst) {
+      struct linger lg = { 1, 0 };
+      setsockopt( c->fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg) );
+      pthread_mutex_lock( &f->lock );
+      f->stats.resets ++;
+      pthread_mutex_unlock( &f->lock );
+      return -1;
+    }
+
+    if (chunk && delay && len)
+      usleep( delay );
+  }
+
+  return 0;
+}
+
+  static int
+_fr_reply_bulk( conn_t *c, const char *s, size_t len )
+{
+  char *buf = malloc( len + 32 );
+  int l, ret;
+
+  l = sprintf( buf, "$%zu\r\n", len );
+  memcpy( buf + l, s, len );
+  memcpy( buf + l + len, "\r\n", 2 );
+
+  ret = _fr_write( c, buf, l + len + 2 );
+  free( buf );
+
+  return ret;
+}
+
+  static int
+_fr_reply_fmt( conn_t *c, const char *fmt, ... )
+{
+  char buf[ 512 ];
+  va_list ap;
+  int l;
+
+  va_start( ap, fmt );
+  l = vsnprintf( buf, sizeof(buf), fmt, ap );
+  va_end( ap );
+
+  if (l >= (int)sizeof(buf))
+    l = sizeof(buf) - 1;
+
+  return _fr_write( c, buf, l );
+}
+
+#define ARG_IS(i, s)                                                    \
+  (argl[i] == sizeof(s) - 1 && ! strncasecmp( argv[i], s, argl[i] ))
+
+/*
+ * Run a command, with its rule
+ */
+  static int
+_fr_cmd( conn_t *c, int argc, char **argv, size_t *argl )
+{
+  fake_redis_t *f = c->f;
+  int delay = 0, blackhole;
+  char err[ 256 ];
+  rule_t *r;
+  kv_t *kv;
+
+  if (! argc)
+    return 0;
+
+  err[0] = '\0';
+
+  pthread_mutex_lock( &f->lock );
+  f->stats.cmds ++;
+  blackhole = f->blackhole;
+  if ((r = _fr_rule( f, argv[0], argl[0] ))) {
+    delay = r->min_us;
+    if (r->max_us > r->min_us)
+      delay += rand_r( &f->seed ) % (r->max_us - r->min_us + 1);
+    if (r->tail_pct > 0 &&
+        rand_r( &f->seed ) < r->tail_pct / 100. * RAND_MAX)
+      delay = r->tail_us;
+    if (r->err)
+      snprintf( err, sizeof(err), "%s", r->err );
+  }
+  pthread_mutex_unlock( &f->lock );
+
+  if (blackhole)
+    return 0;
+
+  if (delay)
+    usleep( delay );
+
+  if (err[0])
+    return _fr_reply_fmt( c, "-%s\r\n", err );
+
+  if (ARG_IS(0, "PING"))
+    return (argc > 1) ?
+      _fr_reply_bulk( c, argv[1], argl[1] ) : _fr_reply_fmt( c, "+PONG\r\n" );
+
+  if (ARG_IS(0, "ECHO") && argc == 2)
+    return _fr_reply_bulk( c, argv[1], argl[1] );
+
+  if (ARG_IS(0, "SET") && argc >= 3) {
+    pthread_mutex_lock( &f->lock );
+    _fr_kv_set( f, argv[1], argl[1], argv[2], argl[2] );
+    pthread_mutex_unlock( &f->lock );
+    return _fr_reply_fmt( c, "+OK\r\n" );
+  }
+
+  if (ARG_IS(0, "GET") && argc == 2) {
+    char *val = NULL;
+    size_t len = 0;
+    int ret;
+
+    pthread_mutex_lock( &f->lock );
+    if ((kv = _fr_kv( f, argv[1], argl[1], NULL ))) {
+      len = kv->val_len;
+      val = malloc( len + 1 );
+      memcpy( val, kv->val, len );
+    }
+    pthread_mutex_unlock( &f->lock );
+
+    if (! val)
+      return _fr_reply_fmt( c, "$-1\r\n" );
+
+    ret = _fr_reply_bulk( c, val, len );
+    free( val );
+    return ret;
+  }
+
+  if (ARG_IS(0, "DEL")) {
+    int i, n = 0;
+    pthread_mutex_lock( &f->lock );
+    for (i=1; i<argc; i++)
+      n += _fr_kv_del( f, argv[i], argl[i] );
+    pthread_mutex_unlock( &f->lock );
+    return _fr_reply_fmt( c, ":%d\r\n", n );
+  }
+
+  if (ARG_IS(0, "INCR") && argc == 2) {
+    char num[ 32 ];
+    long long v = 0;
+
+    pthread_mutex_lock( &f->lock );
+    if ((kv = _fr_kv( f, argv[1], argl[1], NULL )))
+      v = strtoll( kv->val, NULL, 10 );
+    v ++;
+    snprintf( num, sizeof(num), "%lld", v );
+    _fr_kv_set( f, argv[1], argl[1], num, strlen( num ) );
+    pthread_mutex_unlock( &f->lock );
+    return _fr_reply_fmt( c, ":%lld\r\n", v );
+  }
+
+  if (ARG_IS(0, "PUBLISH"))
+    return _fr_reply_fmt( c, ":0\r\n" );
+
+  if (ARG_IS(0, "COMMAND"))
+    return _fr_reply_fmt( c, "*0\r\n" );
+
+  if (ARG_IS(0, "QUIT")) {
+    _fr_reply_fmt( c, "+OK\r\n" );
+    return -1;
+  }
+
+  if (ARG_IS(0, "SELECT") || ARG_IS(0, "AUTH") || ARG_IS(0, "CLIENT") ||
+      ARG_IS(0, "READONLY") || ARG_IS(0, "EXPIRE"))
+    return _fr_reply_fmt( c, "+OK\r\n" );
+
+  return _fr_reply_fmt( c, "-ERR unknown command '%.*s'\r\n",
+                        (int)argl[0], argv[0] );
+}
+
+/*
+ * Connection thread
+ */
+  static void *
+_fr_conn_thr( void *vc )
+{
+  conn_t *c = vc;
+  fake_redis_t *f = c->f;
+  char *buf = malloc( BUF_SIZE );
+  char *argv[ ARGS_MAX ];
+  size_t argl[ ARGS_MAX ], len = 0, chunk;
+  int argc, used, delay;
+  ssize_t rd;
+
+  while (! f->stop) {
+    struct pollfd pfd = { c->fd, POLLIN, 0 };
+
+    if (poll( &pfd, 1, 100 ) <= 0)
+      continue;
+
+    pthread_mutex_lock( &f->lock );
+    chunk = f->chunk;
+    delay = f->chunk_delay;
+    pthread_mutex_unlock( &f->lock );
+
+    /* Slow reads */
+    if (chunk && delay)
+      usleep( delay );
+
+    rd = BUF_SIZE - len;
+    if (chunk && (size_t)rd > chunk)
+      rd = chunk;
+
+    rd = recv( c->fd, buf + len, rd, 0 );
+    if (rd <= 0)
+      break;
+    len += rd;
+
+    while ((used = _fr_parse( buf, len, argv, argl, &argc )) > 0) {
+      if (_fr_cmd( c, argc, argv, argl ) < 0)
+        goto out;
+      memmove( buf, buf + used, len - used );
+      len -= used;
+    }
+
+    if (used < 0 || len == BUF_SIZE) {
+      _fr_reply_fmt( c, "-ERR Protocol error\r\n" );
+      break;
+    }
+  }
+
+out:
+  free( buf );
+
+  pthread_mutex_lock( &f->lock );
+  close( c->fd );
+  c->fd = -1;
+  f->stats.clients --;
+  pthread_mutex_unlock( &f->lock );
+
+  return NULL;
+}
+
+/*
+ * Accept thread: listening state and new connections
+ */
+  static void *
+_fr_accept_thr( void *vf )
+{
+  fake_redis_t *f = vf;
+  int fd, i;
+
+  while (! f->stop) {
+    struct pollfd pfd;
+
+    pthread_mutex_lock( &f->lock );
+    if (f->want_down && f->lfd >= 0) {
+      close( f->lfd );
+      f->lfd = -1;
+    }
+    else if (! f->want_down && f->lfd < 0)
+      f->lfd = _fr_listen( f->port, NULL );
+    pfd.fd      = f->lfd;
+    pfd.events  = POLLIN;
+    pthread_mutex_unlock( &f->lock );
+
+    if (pfd.fd < 0) {
+      usleep( 10000 );
+      continue;
+    }
+
+    if (poll( &pfd, 1, 10 ) <= 0)
+      continue;
+
+    if ((fd = accept( pfd.fd, NULL, NULL )) < 0)
+      continue;
+
+    i = 1;
+    setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &i, sizeof(i) );
+
+    pthread_mutex_lock( &f->lock );
+    /* Free slot: finished threads joined */
+    for (i=0; i<CONNS_MAX; i++) {
+      if (f->conns[i].used && f->conns[i].fd < 0) {
+        pthread_mutex_unlock( &f->lock );
+        pthread_join( f->conns[i].thr, NULL );
+        pthread_mutex_lock( &f->lock );
+        f->conns[i].used = 0;
+      }
+      if (! f->conns[i].used)
+        break;
+    }
+    if (i == CONNS_MAX) {
+      pthread_mutex_unlock( &f->lock );
+      close( fd );
+      continue;
+    }
+    f->conns[i].f       = f;
+    f->conns[i].fd      = fd;
+    f->conns[i].used    = 1;
+    f->conns[i].written = 0;
+    f->stats.conns ++;
+    f->stats.clients ++;
+    pthread_create( &f->conns[i].thr, NULL, _fr_conn_thr, &f->conns[i] );
+    pthread_mutex_unlock( &f->lock );
+  }
+
+  return NULL;
+}
+
+/*
+ * Wait for the accept thread to be in the asked listening state
+ */
+  static int
+_fr_listen_wait( fake_redis_t *f, int down )
+{
+  int i, lfd = -1;
+
+  f->want_down = down;
+
+  for (i=0; i<200; i++) {
+    pthread_mutex_lock( &f->lock );
+    lfd = f->lfd;
+    pthread_mutex_unlock( &f->lock );
+    if ((lfd < 0) == down)
+      return 0;
+    usleep( 5000 );
+  }
+
+  return -1;
+}
+
+  fake_redis_t *
+fake_redis_new( void )
+{
+  fake_redis_t *f = calloc( 1, sizeof(fake_redis_t) );
+  int i;
+
+  if (! f)
+    return NULL;
+
+  f->lfd = _fr_listen( 0, &f->port );
+  if (f->lfd < 0) {
+    free( f );
+    return NULL;
+  }
+
+  for (i=0; i<CONNS_MAX; i++)
+    f->conns[i].fd = -1;
+
+  f->seed = 1;
+  pthread_mutex_init( &f->lock, NULL );
+  pthread_create( &f->thr, NULL, _fr_accept_thr, f );
+
+  return f;
+}
+
+  void
+fake_redis_free( fake_redis_t *f )
+{
+  kv_t *kv;
+  int i;
+
+  fake_redis_kill( f );
+
+  f->stop = 1;
+  pthread_join( f->thr, NULL );
+
+  for (i=0; i<CONNS_MAX; i++)
+    if (f->conns[i].used)
+      pthread_join( f->conns[i].thr, NULL );
+
+  if (f->lfd >= 0)
+    close( f->lfd );
+
+  while ((kv = f->kv)) {
+    f->kv = kv->next;
+    free( kv->key );
+    free( kv->val );
+    free( kv );
+  }
+
+  for (i=0; i<f->rules_nb; i++)
+    free( f->rules[i].err );
+
+  pthread_mutex_destroy( &f->lock );
+  free( f );
+}
+
+  int
+fake_redis_port( fake_redis_t *f )
+{
+  return f->port;
+}
+
+  void
+fake_redis_seed( fake_redis_t *f, unsigned int seed )
+{
+  pthread_mutex_lock( &f->lock );
+  f->seed = seed;
+  pthread_mutex_unlock( &f->lock );
+}
+
+  int
+fake_redis_latency( fake_redis_t *f, const char *cmd,
+                    int min_us, int max_us, double tail_pct, int tail_us )
+{
+  rule_t *r;
+
+  pthread_mutex_lock( &f->lock );
+  if ((r = _fr_rule_get( f, cmd ))) {
+    r->min_us   = min_us;
+    r->max_us   = max_us;
+    r->tail_pct = tail_pct;
+    r->tail_us  = tail_us;
+  }
+  pthread_mutex_unlock( &f->lock );
+
+  return (r) ? 0 : -1;
+}
+
+  int
+fake_redis_error( fake_redis_t *f, const char *cmd, const char *err )
+{
+  rule_t *r;
+
+  pthread_mutex_lock( &f->lock );
+  if ((r = _fr_rule_get( f, cmd ))) {
+    free( r->err );
+    r->err = (err) ? strdup( err ) : NULL;
+  }
+  pthread_mutex_unlock( &f->lock );
+
+  return (r) ? 0 : -1;
+}
+
+  void
+fake_redis_clear( fake_redis_t *f )
+{
+  int i;
+
+  pthread_mutex_lock( &f->lock );
+  for (i=0; i<f->rules_nb; i++)
+    free( f->rules[i].err );
+  f->rules_nb = 0;
+  pthread_mutex_unlock( &f->lock );
+}
+
+  void
+fake_redis_reset_after( fake_redis_t *f, size_t bytes )
+{
+  int i;
+
+  pthread_mutex_lock( &f->lock );
+  f->reset_after = bytes;
+  /* Counted from now */
+  for (i=0; i<CONNS_MAX; i++)
+    f->conns[i].written = 0;
+  pthread_mutex_unlock( &f->lock );
+}
+
+  void
+fake_redis_chunk( fake_redis_t *f, size_t chunk, int delay_us )
+{
+  pthread_mutex_lock( &f->lock );
+  f->chunk        = chunk;
+  f->chunk_delay  = delay_us;
+  pthread_mutex_unlock( &f->lock );
+}
+
+  void
+fake_redis_blackhole( fake_redis_t *f, int on )
+{
+  pthread_mutex_lock( &f->lock );
+  f->blackhole = on;
+  pthread_mutex_unlock( &f->lock );
+}
+
+  void
+fake_redis_kill( fake_redis_t *f )
+{
+  int i;
+
+  /* Threads close on EOF */
+  pthread_mutex_lock( &f->lock );
+  for (i=0; i<CONNS_MAX; i++)
+    if (f->conns[i].used && f->conns[i].fd >= 0)
+      shutdown( f->conns[i].fd, SHUT_RDWR );
+  pthread_mutex_unlock( &f->lock );
+}
+
+  void
+fake_redis_down( fake_redis_t *f )
+{
+  _fr_listen_wait( f, 1 );
+}
+
+  int
+fake_redis_up( fake_redis_t *f )
+{
+  return _fr_listen_wait( f, 0 );
+}
+
+  void
+fake_redis_stats( fake_redis_t *f, fake_redis_stats_t *st )
+{
+  pthread_mutex_lock( &f->lock );
+  *st = f->stats;
+  pthread_mutex_unlock( &f->lock );
+}
@@ -0,0 +1,61 @@
+/**
+ * @file fake-redis.h
+ * @brief In-process RESP server for the tests and benchmarks
+ *
+ * Listens on 127.0.0.1 (ephemeral port) and serves a small subset of
+ * the commands (PING, ECHO, SET, GET, DEL, INCR, PUBLISH...), one
+ * thread per connection. Its behavior is scriptable at run time:
+ * latency per command, error replies, resets after N bytes, partial
+ * writes and slow reads, blackholing, refused connections.
+ */
+
+#ifndef FAKE_REDIS_H
+#define FAKE_REDIS_H
+
+#include <stddef.h>
+
+typedef struct fake_redis_s fake_redis_t;
+
+typedef struct fake_redis_stats_s {
+  unsigned long long  conns;        /* accepted */
+  unsigned long long  cmds;         /* received */
+  unsigned long long  resets;       /* by fake_redis_reset_after */
+  int                 clients;      /* connected */
+} fake_redis_stats_t;
+
+/* New server, listening and serving (thread) */
+fake_redis_t * fake_redis_new( void );
+/* Stop and free */
+void fake_redis_free( fake_redis_t *f );
+/* Listening port */
+int fake_redis_port( fake_redis_t *f );
+/* Seed of the latency distributions */
+void fake_redis_seed( fake_redis_t *f, unsigned int seed );
+
+/* Reply latency of 'cmd' (NULL: all commands): uniform from min to max,
+ * and tail_us for 'tail_pct' percent of the replies */
+int fake_redis_latency( fake_redis_t *f, const char *cmd,
+                        int min_us, int max_us,
+                        double tail_pct, int tail_us );
+/* Error reply to 'cmd' (NULL: all commands), 'err' NULL to remove */
+int fake_redis_error( fake_redis_t *f, const char *cmd, const char *err );
+/* Remove all the latencies and errors */
+void fake_redis_clear( fake_redis_t *f );
+/* Reset (RST) the connections after 'bytes' written, 0: never */
+void fake_redis_reset_after( fake_redis_t *f, size_t bytes );
+/* Partial writes and slow reads: 'chunk' bytes per 'delay_us', 0: off */
+void fake_redis_chunk( fake_redis_t *f, size_t chunk, int delay_us );
+/* Read the commands, never reply */
+void fake_redis_blackhole( fake_redis_t *f, int on );
+
+/* Close all the connections */
+void fake_redis_kill( fake_redis_t *f );
+/* Stop listening: new connections refused */
+void fake_redis_down( fake_redis_t *f );
+/* Listen again, same port */
+int fake_redis_up( fake_redis_t *f );
+
+/* Counters */
+void fake_redis_stats( fake_redis_t *f, fake_redis_stats_t *st );
+
+#endif /* FAKE_REDIS_H */
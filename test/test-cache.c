@@ -0,0 +1,152 @@
+
+#include <unistd.h>
+#include <stdio.h>
+#include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "eredis.h"
+
+/*
+ * Client-side cache:
+ * - second GET is a hit
+ * - a mirrored SET invalidates it
+ * Skipped (exit 0) only if the servers reject CLIENT TRACKING.
+ */
+
+static eredis_t *e;
+
+/*
+ * CLIENT TRACKING support, on a separate eredis without cache:
+ * 1 supported, 0 rejected, -1 no reply
+ */
+  static int
+tracking_supported( const char *host_file )
+{
+  eredis_t *p = eredis_new();
+  eredis_reader_t *reader;
+  eredis_reply_t *reply;
+  int ret = -1;
+
+  if (eredis_host_file( p, host_file )<=0) {
+    eredis_free( p );
+    return -1;
+  }
+
+  reader = eredis_r( p );
+  if (reader) {
+    reply = eredis_r_cmd( reader, "CLIENT TRACKING on" );
+    if (reply)
+      ret = (reply->type != REDIS_REPLY_ERROR);
+    eredis_r_release( reader );
+  }
+
+  eredis_free( p );
+
+  return ret;
+}
+
+  static int
+get_check( eredis_reader_t *reader, const char *expected )
+{
+  eredis_reply_t *reply;
+
+  reply = eredis_r_cmd( reader, "GET test-cache-key" );
+  if (! reply || reply->type != REDIS_REPLY_STRING)
+    return 0;
+
+  return ! strcmp( reply->str, expected );
+}
+
+  int
+main( int argc, char *argv[] )
+{
+  /* optional command line arguments */
+  const char *host_file = "test-hosts.conf";
+  if (argc >= 2) {
+    host_file = argv[1];
+  }
+
+  int i, ret = 1;
+  eredis_reader_t *reader;
+  eredis_cache_stats_t st;
+
+  memset( &st, 0, sizeof(st) );
+
+  /* cancel sigpipe */
+  signal(SIGPIPE, SIG_IGN);
+
+  switch (tracking_supported( host_file )) {
+    case 0:
+      printf("CLIENT TRACKING unsupported: skipping\n");
+      return 0;
+    case -1:
+      fprintf(stderr, "Unable to query %s\n", host_file);
+      return 1;
+  }
+
+  /* eredis */
+  e = eredis_new();
+
+  /* conf */
+  if (eredis_host_file( e, host_file )<=0) {
+    fprintf(stderr, "Unable to load conf %s\n", host_file);
+    exit(1);
+  }
+
+  eredis_cache( e, 1<<20, 0 );
+  eredis_cache_cmd( e, "GET" );
+
+  /* mandatory for the invalidation connections */
+  eredis_run_thr( e );
+
+  eredis_w_cmd( e, "SET test-cache-key v1" );
+  while (eredis_w_pending( e ))
+    usleep(1000);
+
+  reader = eredis_r( e );
+
+  /* Wait for the invalidation channel and a first hit */
+  for (i=0; i<300; i++) {
+    if (! get_check( reader, "v1" )) {
+      usleep(10000);
+      continue;
+    }
+    eredis_cache_stats( e, &st );
+    if (st.hits)
+      break;
+    usleep(10000);
+  }
+
+  if (! st.hits) {
+    fprintf(stderr, "No cache hit\n");
+    goto out;
+  }
+
+  /* Mirrored write - must be invalidated */
+  eredis_w_cmd( e, "SET test-cache-key v2" );
+
+  for (i=0; i<300; i++) {
+    if (get_check( reader, "v2" ))
+      break;
+    usleep(10000);
+  }
+
+  eredis_cache_stats( e, &st );
+  printf("Cache: %llu hits, %llu misses, %llu invalidations, %zu entries\n",
+         st.hits, st.misses, st.invalidations, st.entries);
+
+  if (i == 300)
+    fprintf(stderr, "Cached value was not invalidated\n");
+  else if (! st.invalidations)
+    fprintf(stderr, "No invalidation recorded\n");
+  else
+    ret = 0;
+
+out:
+  eredis_r_release( reader );
+
+  eredis_free( e );
+
+  return ret;
+}
@@ -0,0 +1,194 @@
+
+#include <unistd.h>
+#include <stdio.h>
+#include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "eredis.h"
+#include "fake-redis.h"
+
+/*
+ * Failures injected by two in-process fake servers (no redis-server):
+ * - error replies and reader deadlines on slow replies
+ * - failover of the readers when the prefered host is lost
+ * - connection reset in the middle of a reply
+ * - reconnection of the event loop to the recovered host
+ */
+
+static eredis_t *e;
+
+  static long long
+now_ms( void )
+{
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/* GET with a fresh reader: 1 if 'expected' */
+  static int
+get_check( const char *key, const char *expected )
+{
+  eredis_reader_t *reader = eredis_r( e );
+  eredis_reply_t *reply;
+  int ok = 0;
+
+  if (! reader)
+    return 0;
+
+  reply = eredis_r_cmd( reader, "GET %s", key );
+  if (reply && reply->type == REDIS_REPLY_STRING)
+    ok = ! strcmp( reply->str, expected );
+
+  eredis_r_release( reader );
+
+  return ok;
+}
+
+  static int
+get_wait( const char *key, const char *expected, int timeout_ms )
+{
+  long long end = now_ms() + timeout_ms;
+
+  while (now_ms() < end) {
+    if (get_check( key, expected ))
+      return 1;
+    usleep(10000);
+  }
+  return 0;
+}
+
+  int
+main( int argc, char *argv[] )
+{
+  fake_redis_t *a, *b;
+  fake_redis_stats_t st;
+  eredis_reader_t *reader;
+  eredis_reply_t *reply;
+  char big[ 1001 ];
+  long long t;
+  int err, ret = 1;
+
+  (void) argc;
+  (void) argv;
+
+  /* cancel sigpipe */
+  signal(SIGPIPE, SIG_IGN);
+
+  a = fake_redis_new();
+  b = fake_redis_new();
+  if (! a || ! b) {
+    fprintf(stderr, "Unable to start the fake servers\n");
+    exit(1);
+  }
+
+  /* eredis */
+  e = eredis_new();
+
+  eredis_host_add( e, "127.0.0.1", fake_redis_port( a ) );
+  eredis_host_add( e, "127.0.0.1", fake_redis_port( b ) );
+
+  eredis_reconnect( e, 10, 100 );
+  eredis_r_retry( e, 1 );
+
+  eredis_run_thr( e );
+
+  /* Mirrored write, read from the prefered host */
+  eredis_w_cmd( e, "SET test-fake-key v1" );
+  if (! get_wait( "test-fake-key", "v1", 3000 )) {
+    fprintf(stderr, "Mirrored write not read\n");
+    goto out;
+  }
+
+  /* Error reply (on both: reader on either host) */
+  fake_redis_error( a, "GET", "ERR injected" );
+  fake_redis_error( b, "GET", "ERR injected" );
+  reader = eredis_r( e );
+  reply = eredis_r_cmd( reader, "GET test-fake-key" );
+  if (! reply || reply->type != REDIS_REPLY_ERROR) {
+    fprintf(stderr, "No injected error reply\n");
+    eredis_r_release( reader );
+    goto out;
+  }
+  fake_redis_clear( a );
+  fake_redis_clear( b );
+
+  /* Slow reply: deadline */
+  fake_redis_latency( a, "GET", 300000, 300000, 0, 0 );
+  fake_redis_latency( b, "GET", 300000, 300000, 0, 0 );
+  eredis_r_deadline( reader, eredis_deadline( 50 ) );
+  t = now_ms();
+  reply = eredis_r_cmd( reader, "GET test-fake-key" );
+  t = now_ms() - t;
+  err = eredis_r_error( reader );
+  eredis_r_release( reader );
+  fake_redis_clear( a );
+  fake_redis_clear( b );
+  if (reply || err != EREDIS_ERRTIMEOUT || t >= 300) {
+    fprintf(stderr, "Deadline not enforced (%lld ms)\n", t);
+    goto out;
+  }
+
+  /* Prefered host lost: readers on the second one */
+  fake_redis_down( a );
+  fake_redis_kill( a );
+  t = now_ms();
+  if (! get_wait( "test-fake-key", "v1", 5000 )) {
+    fprintf(stderr, "No failover\n");
+    goto out;
+  }
+  printf("Failover: %lld ms\n", now_ms() - t);
+
+  /* Reset in the middle of a reply */
+  memset( big, 'x', sizeof(big) - 1 );
+  big[ sizeof(big) - 1 ] = '\0';
+  eredis_w_cmd( e, "SET test-fake-big %s", big );
+  if (! get_wait( "test-fake-big", big, 3000 )) {
+    fprintf(stderr, "Big value not read\n");
+    goto out;
+  }
+
+  fake_redis_reset_after( b, 100 );
+  if (get_check( "test-fake-big", big )) {
+    fprintf(stderr, "Reply not reset\n");
+    goto out;
+  }
+  fake_redis_reset_after( b, 0 );
+
+  fake_redis_stats( b, &st );
+  if (! st.resets) {
+    fprintf(stderr, "No reset\n");
+    goto out;
+  }
+
+  if (! get_wait( "test-fake-big", big, 3000 )) {
+    fprintf(stderr, "No recovery after reset\n");
+    goto out;
+  }
+
+  /* Prefered host back: event loop reconnection */
+  fake_redis_up( a );
+  t = now_ms();
+  do {
+    usleep(10000);
+    fake_redis_stats( a, &st );
+  } while (st.clients < 1 && now_ms() - t < 5000);
+
+  if (st.clients < 1) {
+    fprintf(stderr, "No reconnection\n");
+    goto out;
+  }
+  printf("Reconnect: %lld ms\n", now_ms() - t);
+
+  ret = 0;
+
+out:
+  eredis_free( e );
+
+  fake_redis_free( a );
+  fake_redis_free( b );
+
+  return ret;
+}
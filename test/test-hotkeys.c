@@ -0,0 +1,120 @@
+
+#include <unistd.h>
+#include <stdio.h>
+#include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "eredis.h"
+#include "fake-redis.h"
+
+/*
+ * Hot and big keys, sampled 1 in 4 (fake server, no redis-server):
+ * - heaviest first, by requests and by bytes
+ * - estimates scaled back by the rate
+ * - truncated output keeps the heaviest
+ */
+
+#define RATE  4
+#define LOOPS 700
+
+  static int
+sorted( eredis_hotkey_t *hk, int n, int by )
+{
+  int i;
+
+  for (i=1; i<n; i++)
+    if ((by == EREDIS_HOTKEYS_COUNT) ?
+        hk[i-1].count < hk[i].count : hk[i-1].bytes < hk[i].bytes)
+      return 0;
+  return 1;
+}
+
+  int
+main( int argc, char *argv[] )
+{
+  eredis_t *e;
+  fake_redis_t *f;
+  eredis_hotkey_t hk[ 8 ];
+  char big[ 1001 ];
+  int i, n, ret = 1;
+
+  (void) argc;
+  (void) argv;
+
+  /* cancel sigpipe */
+  signal(SIGPIPE, SIG_IGN);
+
+  if (! (f = fake_redis_new())) {
+    fprintf(stderr, "Unable to start the fake server\n");
+    exit(1);
+  }
+
+  memset( big, 'x', sizeof(big) - 1 );
+  big[ sizeof(big) - 1 ] = '\0';
+
+  /* eredis */
+  e = eredis_new();
+  eredis_host_add( e, "127.0.0.1", fake_redis_port( f ) );
+  eredis_hotkeys( e, RATE, 8 );
+  eredis_run_thr( e );
+
+  /* Period of 7 commands: all sampled alike at a rate of 4 */
+  for (i=0; i<LOOPS; i++) {
+    eredis_w_cmd( e, "SET test-hk-hot %d", i );
+    eredis_w_cmd( e, "SET test-hk-hot %d", i );
+    eredis_w_cmd( e, "SET test-hk-hot %d", i );
+    eredis_w_cmd( e, "SET test-hk-warm %d", i );
+    eredis_w_cmd( e, "SET test-hk-warm %d", i );
+    eredis_w_cmd( e, "SET test-hk-big %s", big );
+    eredis_w_cmd( e, "SET test-hk-cold-%d 1", i );
+  }
+
+  n = eredis_hotkeys_get( e, EREDIS_HOTKEYS_COUNT, hk, 8 );
+  for (i=0; i<n; i++)
+    printf("hot: %s %llu requests %llu bytes\n",
+           hk[i].key, hk[i].count, hk[i].bytes);
+  if (n < 3 || ! sorted( hk, n, EREDIS_HOTKEYS_COUNT )) {
+    fprintf(stderr, "Hot keys not sorted\n");
+    goto out;
+  }
+  if (strcmp( hk[0].key, "test-hk-hot" ) ||
+      strcmp( hk[1].key, "test-hk-warm" )) {
+    fprintf(stderr, "Wrong hot keys\n");
+    goto out;
+  }
+  /* Scaled back: about 3 * LOOPS */
+  if (hk[0].count < 3 * LOOPS * 9 / 10 || hk[0].count > 3 * LOOPS * 2) {
+    fprintf(stderr, "Hot key estimate: %llu\n", hk[0].count);
+    goto out;
+  }
+
+  /* Truncated: the heaviest kept */
+  n = eredis_hotkeys_get( e, EREDIS_HOTKEYS_COUNT, hk, 2 );
+  if (n != 2 || strcmp( hk[0].key, "test-hk-hot" ) ||
+      strcmp( hk[1].key, "test-hk-warm" )) {
+    fprintf(stderr, "Wrong truncated hot keys\n");
+    goto out;
+  }
+
+  n = eredis_hotkeys_get( e, EREDIS_HOTKEYS_BYTES, hk, 8 );
+  if (n < 3 || ! sorted( hk, n, EREDIS_HOTKEYS_BYTES ) ||
+      strcmp( hk[0].key, "test-hk-big" )) {
+    fprintf(stderr, "Wrong big keys\n");
+    goto out;
+  }
+
+  n = eredis_hotkeys_get( e, EREDIS_HOTKEYS_BYTES, hk, 1 );
+  if (n != 1 || strcmp( hk[0].key, "test-hk-big" )) {
+    fprintf(stderr, "Wrong truncated big keys\n");
+    goto out;
+  }
+
+  ret = 0;
+
+out:
+  eredis_free( e );
+  fake_redis_free( f );
+
+  return ret;
+}
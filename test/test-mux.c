@@ -0,0 +1,130 @@
+
+#include <unistd.h>
+#include <stdio.h>
+#include <signal.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "eredis.h"
+
+/*
+ * Multiplexed readers:
+ * - many threads, commands sent on the event loop connections
+ * - each thread checks its own replies, in order
+ * - a stateful command keeps its pipeline on the reader connection
+ */
+
+#define THR_NB 50
+
+static eredis_t *e;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static int throk = 0;
+static int nbtot = 0;
+static int nberr = 0;
+
+  void *
+reader_thr( void *ve )
+{
+  long id = (long)ve;
+  int i;
+  char val[32];
+
+  __sync_fetch_and_add( &throk, 1 );
+
+  pthread_mutex_lock(&lock); pthread_mutex_unlock(&lock);
+
+  for (i=0; i<2000; i++) {
+    eredis_reader_t *reader = eredis_r( e );
+    eredis_reply_t *reply;
+
+    sprintf(val, "%ld-%d", id, i);
+
+    /* Pipelined: one batch for the event loop */
+    eredis_r_append_cmd( reader, "SET test-mux-%ld %s", id, val );
+    eredis_r_append_cmd( reader, "GET test-mux-%ld", id );
+
+    reply = eredis_r_reply( reader );
+    if (! reply || reply->type != REDIS_REPLY_STATUS)
+      __sync_fetch_and_add( &nberr, 1 );
+
+    reply = eredis_r_reply( reader );
+    if (! reply || reply->type != REDIS_REPLY_STRING || strcmp(reply->str, val))
+      __sync_fetch_and_add( &nberr, 1 );
+    else
+      __sync_fetch_and_add( &nbtot, 1 );
+
+    /* Denied command: the whole pipeline on the reader connection */
+    if (! (i % 100)) {
+      eredis_r_append_cmd( reader, "SELECT 0" );
+      eredis_r_append_cmd( reader, "GET test-mux-%ld", id );
+
+      reply = eredis_r_reply( reader );
+      if (! reply || reply->type != REDIS_REPLY_STATUS)
+        __sync_fetch_and_add( &nberr, 1 );
+
+      reply = eredis_r_reply( reader );
+      if (! reply || reply->type != REDIS_REPLY_STRING ||
+          strcmp(reply->str, val))
+        __sync_fetch_and_add( &nberr, 1 );
+    }
+
+    eredis_r_release( reader );
+  }
+
+  pthread_exit(NULL);
+}
+
+  int
+main( int argc, char *argv[] )
+{
+  /* optional command line arguments */
+  const char *host_file = "test-hosts.conf";
+  if (argc >= 2) {
+    host_file = argv[1];
+  }
+
+  long i;
+  pthread_t thrs[ THR_NB ];
+
+  /* cancel sigpipe */
+  signal(SIGPIPE, SIG_IGN);
+
+  /* eredis */
+  e = eredis_new();
+
+  /* conf */
+  if (eredis_host_file( e, host_file )<=0) {
+    fprintf(stderr, "Unable to load conf %s\n", host_file);
+    exit(1);
+  }
+
+  /* readers without connection: one per thread */
+  eredis_r_max( e, THR_NB );
+  eredis_mux( e, 1 );
+
+  /* mandatory: commands are sent by the event loop */
+  eredis_run_thr( e );
+
+  pthread_mutex_lock( &lock );
+
+  for (i=0; i<THR_NB; i++) {
+    pthread_create( &thrs[i], NULL, reader_thr, (void*)i );
+  }
+
+  while (throk != THR_NB)
+    usleep(10);
+
+  pthread_mutex_unlock( &lock );
+
+  for (i=0; i<THR_NB; i++) {
+    pthread_join( thrs[i], NULL );
+  }
+
+  eredis_free( e );
+
+  fprintf(stderr, "Got: %d replies, %d errors\n", nbtot, nberr);
+
+  return (nberr) ? 1 : 0;
+}
@@ -0,0 +1,120 @@
+
+#include <unistd.h>
+#include <stdio.h>
+#include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "eredis.h"
+
+/*
+ * Runtime statistics:
+ * - mirrored writes are counted per host
+ * - reader replies are counted with their latency
+ * - counters of exited threads are kept, their blocks recycled
+ */
+
+#define NB_HOSTS_MAX  16
+#define NB_CMDS       100
+#define NB_CHURN      20          /* rounds of THR_NB short threads */
+#define THR_NB        8
+
+static eredis_t *e;
+
+/* One reply, then exit */
+  static void *
+churn_thr( void *v )
+{
+  eredis_reader_t *reader = eredis_r( e );
+
+  (void) v;
+
+  if (! reader || ! eredis_r_cmd( reader, "GET test-stats-0" ))
+    fprintf(stderr, "Err on eredis_r_cmd (thread)\n");
+  if (reader)
+    eredis_r_release( reader );
+
+  return NULL;
+}
+
+  int
+main( int argc, char *argv[] )
+{
+  /* optional command line arguments */
+  const char *host_file = "test-hosts.conf";
+  if (argc >= 2) {
+    host_file = argv[1];
+  }
+
+  int i, j, n, ret = 1;
+  unsigned long long cmds = 0, replies = 0;
+  eredis_reader_t *reader;
+  pthread_t thrs[ THR_NB ];
+  eredis_stats_t st;
+  eredis_host_stats_t hs[ NB_HOSTS_MAX ];
+
+  /* cancel sigpipe */
+  signal(SIGPIPE, SIG_IGN);
+
+  /* eredis */
+  e = eredis_new();
+
+  /* conf */
+  if (eredis_host_file( e, host_file )<=0) {
+    fprintf(stderr, "Unable to load conf %s\n", host_file);
+    exit(1);
+  }
+
+  eredis_run_thr( e );
+
+  for (i=0; i<NB_CMDS; i++)
+    eredis_w_cmd( e, "SET test-stats-%d %d", i, i );
+  while (eredis_w_pending( e ))
+    usleep(1000);
+
+  reader = eredis_r( e );
+  for (i=0; i<NB_CMDS; i++)
+    if (! eredis_r_cmd( reader, "GET test-stats-%d", i ))
+      fprintf(stderr, "Err on eredis_r_cmd\n");
+  eredis_r_release( reader );
+
+  /* Thread churn */
+  for (i=0; i<NB_CHURN; i++) {
+    for (j=0; j<THR_NB; j++)
+      pthread_create( &thrs[j], NULL, churn_thr, NULL );
+    for (j=0; j<THR_NB; j++)
+      pthread_join( thrs[j], NULL );
+  }
+
+  n = eredis_stats( e, &st, hs, NB_HOSTS_MAX );
+
+  for (i=0; i<n && i<NB_HOSTS_MAX; i++) {
+    printf("%s:%d: %llu cmds, %llu bytes, %llu replies, %llu errors, "
+           "%llu connects, p50 %lldus, p99 %lldus\n",
+           hs[i].target, hs[i].port, hs[i].cmds, hs[i].bytes,
+           hs[i].replies, hs[i].errors, hs[i].connects,
+           eredis_stats_percentile( hs[i].latency, 50. ),
+           eredis_stats_percentile( hs[i].latency, 99. ));
+    cmds    += hs[i].cmds;
+    replies += hs[i].replies;
+  }
+  printf("wqueue %d, readers %d/%d, threads %d, "
+         "loop lag %lldus (max %lldus)\n",
+         st.wqueue, st.readers_busy, st.readers, st.threads,
+         st.loop_lag_us, st.loop_lag_max_us);
+
+  if (cmds < 2 * NB_CMDS)
+    fprintf(stderr, "Commands not counted: %llu\n", cmds);
+  else if (replies != NB_CMDS + NB_CHURN * THR_NB)
+    fprintf(stderr, "Replies not counted: %llu\n", replies);
+  /* main thread and event loop at most */
+  else if (st.threads > 2)
+    fprintf(stderr, "Blocks of exited threads kept: %d\n", st.threads);
+  else
+    ret = 0;
+
+  eredis_free( e );
+
+  return ret;
+}
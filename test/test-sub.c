@@ -0,0 +1,120 @@
+
+#include <unistd.h>
+#include <stdio.h>
+#include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "eredis.h"
+
+/*
+ * Pub/sub dispatcher:
+ * - channel and pattern callbacks from the event loop
+ * - mirrors: each message delivered once
+ * - no more message after unsubscribe
+ */
+
+static eredis_t *e;
+
+static volatile int nb_chan = 0;
+static volatile int nb_pat  = 0;
+static volatile int nb_uniq = 0;
+
+  static void
+chan_cb( const char *channel, const char *msg, size_t len, void *data )
+{
+  (void) channel;
+  (void) data;
+
+  if (msg && len == 5 && ! memcmp( msg, "hello", 5 ))
+    nb_chan ++;
+  else if (msg && len > 5 && ! memcmp( msg, "uniq-", 5 ))
+    nb_uniq ++;
+}
+
+  static void
+pat_cb( const char *channel, const char *msg, size_t len, void *data )
+{
+  (void) msg;
+  (void) len;
+  (void) data;
+
+  if (! strncmp( channel, "test-sub-", 9 ))
+    nb_pat ++;
+}
+
+  int
+main( int argc, char *argv[] )
+{
+  /* optional command line arguments */
+  const char *host_file = "test-hosts.conf";
+  if (argc >= 2) {
+    host_file = argv[1];
+  }
+
+  int i, ret = 1;
+
+  /* cancel sigpipe */
+  signal(SIGPIPE, SIG_IGN);
+
+  /* eredis */
+  e = eredis_new();
+
+  /* conf */
+  if (eredis_host_file( e, host_file )<=0) {
+    fprintf(stderr, "Unable to load conf %s\n", host_file);
+    exit(1);
+  }
+
+  /* PUBLISH is mirrored: received from all hosts, delivered once */
+  eredis_sub_mirrors( e, 1000 );
+
+  eredis_sub( e, "test-sub-chan", chan_cb, NULL );
+  eredis_psub( e, "test-sub-*", pat_cb, NULL );
+
+  /* mandatory: dispatched by the event loop */
+  eredis_run_thr( e );
+
+  /* Publish until subscribed (one host gets it) */
+  for (i=0; i<300 && ! nb_chan; i++) {
+    eredis_w_cmd( e, "PUBLISH test-sub-chan hello" );
+    usleep(10000);
+  }
+
+  if (! nb_chan || ! nb_pat) {
+    fprintf(stderr, "No message: %d %d\n", nb_chan, nb_pat);
+    goto out;
+  }
+
+  /* All hosts subscribed */
+  usleep(200000);
+
+  for (i=0; i<100; i++)
+    eredis_w_cmd( e, "PUBLISH test-sub-chan uniq-%d", i );
+  usleep(200000);
+
+  if (nb_uniq != 100) {
+    fprintf(stderr, "Mirrors: %d messages delivered for 100\n", nb_uniq);
+    goto out;
+  }
+
+  eredis_unsub( e, "test-sub-chan" );
+  eredis_punsub( e, "test-sub-*" );
+  usleep(100000);
+
+  i = nb_chan;
+  eredis_w_cmd( e, "PUBLISH test-sub-chan hello" );
+  usleep(100000);
+
+  if (nb_chan != i)
+    fprintf(stderr, "Message after unsubscribe\n");
+  else
+    ret = 0;
+
+  printf("Got: %d channel, %d pattern messages\n", nb_chan, nb_pat);
+
+out:
+  eredis_free( e );
+
+  return ret;
+}
@@ -30,7 +30,7 @@ main( int argc, char *argv[] )
     host_file = argv[1];
   }
 
-  int err;
+  int err, ret = 0;
   /* to interrupt */
   struct sigaction action;
   memset(&action, 0, sizeof(action));
@@ -89,12 +89,76 @@ main( int argc, char *argv[] )
     }
   }
 
+  /* Zero-copy view of the same reply */
+  {
+    const eredis_view_t *view;
+    eredis_reply_t *reply;
+
+    eredis_r_append_cmd( reader, "MGET a0 a1" );
+    view = eredis_r_view( reader );
+    if (view && eredis_view_type( view ) == REDIS_REPLY_ARRAY) {
+      reply = eredis_view_reply( view );
+      if (reply && reply->elements == eredis_view_len( view ))
+        nb ++;
+      else {
+        fprintf(stderr, "Err on eredis_view_reply\n");
+        ret = 1;
+      }
+      if (reply)
+        eredis_reply_free( reply );
+    }
+    else {
+      fprintf(stderr, "Err on eredis_r_view\n");
+      ret = 1;
+    }
+    eredis_r_clear( reader );
+  }
+
+  /* Same reply streamed, one element at a time */
+  {
+    const eredis_view_t *view, *elems;
+    size_t got = 0;
+    int n;
+
+    eredis_r_append_cmd( reader, "MGET a0 a1 b0 b1" );
+    view = eredis_r_stream_begin( reader );
+    if (view && eredis_view_type( view ) == REDIS_REPLY_ARRAY) {
+      while ((n = eredis_r_stream_next( reader, &elems, 1 )) > 0)
+        got += n;
+      if (n == 0 && got == eredis_view_len( view ))
+        nb ++;
+      else {
+        fprintf(stderr, "Err on eredis_r_stream_next\n");
+        ret = 1;
+      }
+    }
+    else {
+      fprintf(stderr, "Err on eredis_r_stream_begin\n");
+      ret = 1;
+    }
+    eredis_r_stream_end( reader );
+    eredis_r_clear( reader );
+  }
+
+  /* Expired deadline: fail fast, nothing sent */
+  eredis_r_deadline( reader, eredis_deadline( -1 ) );
+  if (! eredis_r_cmd( reader, "GET a0" )
+      &&
+      eredis_r_error( reader ) == EREDIS_ERRTIMEOUT)
+    nb ++;
+  else {
+    fprintf(stderr, "Err on eredis_r_deadline\n");
+    ret = 1;
+  }
+  eredis_r_deadline( reader, 0 );
+  eredis_r_clear( reader );
+
   eredis_r_release( reader );
 
   eredis_free( e );
 
   fprintf(stderr, "Got: %d replies\n", nb);
 
-  return 0;
+  return ret;
 }
 